@@ -0,0 +1,134 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+#include "alloc_check.h"
+#include <atomic>
+#include <cstddef>
+#include <errno.h>
+
+// glibc allocator entry points, our
+// overrides below forward to them
+extern "C" {
+	extern void* __libc_malloc(size_t sz);
+	extern void* __libc_calloc(size_t n, size_t sz);
+	extern void* __libc_realloc(void* p, size_t sz);
+	extern void* __libc_memalign(size_t al, size_t sz);
+}
+
+namespace {
+	// all of these are constant initialized, hence
+	// usable before any static constructor ran
+	std::atomic<bool>	armed(false);
+	std::atomic<uint64_t>	counts[alloc_check::N_STAGES];
+	// initial-exec TLS, accessing it never allocates
+	__thread int		cur_stage = alloc_check::NONE;
+
+	inline void account(void) {
+		if(armed.load(std::memory_order_relaxed))
+			counts[cur_stage].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	const char	*names[alloc_check::N_STAGES] = { "other", "capture", "writer", "backend", "libav" };
+
+	inline bool enforced(const int s) {
+		return s == alloc_check::CAPTURE || s == alloc_check::WRITER;
+	}
+}
+
+// ThreadSanitizer interposes the allocator itself,
+// counting is disabled in such builds
+#ifndef __SANITIZE_THREAD__
+extern "C" {
+	void* malloc(size_t sz) {
+		account();
+		return __libc_malloc(sz);
+	}
+
+	void* calloc(size_t n, size_t sz) {
+		account();
+		return __libc_calloc(n, sz);
+	}
+
+	void* realloc(void* p, size_t sz) {
+		account();
+		return __libc_realloc(p, sz);
+	}
+
+	void* memalign(size_t al, size_t sz) {
+		account();
+		return __libc_memalign(al, sz);
+	}
+
+	void* aligned_alloc(size_t al, size_t sz) {
+		account();
+		return __libc_memalign(al, sz);
+	}
+
+	// av_malloc goes through this one
+	int posix_memalign(void** p, size_t al, size_t sz) {
+		account();
+		if(!al || (al % sizeof(void*)) || (al & (al - 1)))
+			return EINVAL;
+		void	*r = __libc_memalign(al, sz);
+		if(!r && sz)
+			return ENOMEM;
+		*p = r;
+		return 0;
+	}
+}
+#endif //__SANITIZE_THREAD__
+
+alloc_check::stage alloc_check::set_stage(const stage s) {
+	const stage	prev = (stage)cur_stage;
+	cur_stage = s;
+	return prev;
+}
+
+alloc_check::stage alloc_check::get_stage(void) {
+	return (stage)cur_stage;
+}
+
+void alloc_check::arm(const bool on) {
+	if(on) {
+		for(int i = 0; i < N_STAGES; ++i)
+			counts[i].store(0, std::memory_order_relaxed);
+	}
+	armed.store(on, std::memory_order_seq_cst);
+}
+
+uint64_t alloc_check::count(const stage s) {
+	return counts[s].load(std::memory_order_relaxed);
+}
+
+uint64_t alloc_check::report(std::ostream& ostr, const int n_frames) {
+	uint64_t	rv = 0;
+	ostr << "Allocations over " << n_frames << " steady state frames:\n";
+#ifdef __SANITIZE_THREAD__
+	ostr << "  (ThreadSanitizer build, allocations are not counted)\n";
+#endif //__SANITIZE_THREAD__
+	for(int i = 0; i < N_STAGES; ++i) {
+		const uint64_t	n = counts[i].load(std::memory_order_relaxed);
+		ostr << "  " << names[i] << ": " << n;
+		if(n_frames > 0)
+			ostr << " (" << (double)n/n_frames << "/frame)";
+		ostr << (enforced(i) ? "" : " [not enforced]") << '\n';
+		if(enforced(i))
+			rv += n;
+	}
+	ostr << (rv ? "FAIL: pipeline allocates in steady state" : "OK: no pipeline allocations in steady state") << std::endl;
+	return rv;
+}
@@ -0,0 +1,70 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+#ifndef _ALLOC_CHECK_H_
+#define _ALLOC_CHECK_H_
+
+#include <cstdint>
+#include <ostream>
+
+/* Heap allocation accounting
+ * malloc and friends are interposed; while armed every
+ * allocation is counted against the stage the calling
+ * thread is in. Our own stages (capture, writer) must
+ * not allocate once warmed up, library stages are
+ * only reported: their internals are not ours to fix
+ * (e.g. avcodec_send_frame references the frame, which
+ * allocates AVBufferRef wrappers).
+ * When not armed the cost is one relaxed load.
+ */
+namespace alloc_check {
+	enum stage {
+		NONE = 0,
+		CAPTURE,	// pool, queue and loop on the capture thread
+		WRITER,		// writer and scaler threads
+		BACKEND,	// capture backend (X server and GL driver)
+		LIBAV,		// libavcodec/libavformat/libswscale calls and sinks
+		N_STAGES
+	};
+
+	// tags the calling thread, returns the previous stage
+	extern stage set_stage(const stage s);
+
+	extern stage get_stage(void);
+
+	class scope {
+		const stage	prev_;
+	public:
+		scope(const stage s) : prev_(set_stage(s)) {
+		}
+
+		~scope() {
+			set_stage(prev_);
+		}
+	};
+
+	// arming resets all the counters
+	extern void arm(const bool on);
+
+	extern uint64_t count(const stage s);
+
+	// prints the per stage counts over 'n_frames' and
+	// returns the allocations of the enforced stages
+	extern uint64_t report(std::ostream& ostr, const int n_frames);
+}
+
+#endif //_ALLOC_CHECK_H_
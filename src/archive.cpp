@@ -0,0 +1,335 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+
+#include "archive.h"
+#include "stage.h"
+#include "stats.h"
+#include "alloc_check.h"
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <string>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <stdexcept>
+#include <iostream>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+extern "C" {
+	#include <libavutil/sha.h>
+}
+
+namespace {
+	typedef std::unique_ptr<AVPacket, void(*)(AVPacket*)>	packet_ptr;
+	typedef std::unique_ptr<struct AVSHA, void(*)(struct AVSHA*)>	sha_ptr;
+
+	sha_ptr make_sha(void) {
+		sha_ptr	s(av_sha_alloc(), [](struct AVSHA* p){ av_free(p); });
+		if(!s)
+			throw std::runtime_error("av_sha_alloc failed");
+		return s;
+	}
+
+	std::string to_hex(const uint8_t* sha) {
+		static const char	digits[] = "0123456789abcdef";
+		std::string		rv(64, '0');
+		for(int i = 0; i < 32; ++i) {
+			rv[2*i] = digits[sha[i] >> 4];
+			rv[2*i + 1] = digits[sha[i] & 0xf];
+		}
+		return rv;
+	}
+
+	void make_dir(const std::string& d) {
+		if(mkdir(d.c_str(), 0755) && errno != EEXIST)
+			throw std::runtime_error("Can't create directory " + d);
+	}
+
+	std::string object_path(const std::string& store, const uint8_t* sha) {
+		const std::string	h = to_hex(sha);
+		return store + "/objects/" + h.substr(0, 2) + "/" + h.substr(2);
+	}
+
+	// a stage on the shared executor, no thread of its own
+	class impl : public writer::packet_sink {
+		// GOPs waiting for the store, beyond this (the
+		// store is slower than the encoder) they're
+		// dropped, as the writer can't be blocked
+		static const size_t	MAX_QUEUE_BYTES = 256*1024*1024;
+
+		struct gop {
+			std::vector<packet_ptr>	pkts;
+			size_t			bytes;
+		};
+
+		const std::string	store_;
+		std::ofstream		manifest_;
+		// writer thread only
+		std::unique_ptr<gop>	cur_;
+		// set by on_stream, before the stage starts
+		std::vector<char>	header_;
+		// owned by the stage once pushed
+		utils::concurrent_deque<gop*>	queue_;
+		std::atomic<size_t>	queue_bytes_;
+		// stage only
+		sha_ptr			sha_;
+		std::vector<uint8_t>	obj_;
+		std::latch		*done_;
+		stats::value		&gops_,
+					&dedup_gops_,
+					&bytes_written_,
+					&bytes_dedup_,
+					&queue_hwm_,
+					&dropped_gops_;
+
+		void push_gop(void) {
+			if(!cur_ || cur_->pkts.empty())
+				return;
+			if(queue_bytes_ + cur_->bytes > MAX_QUEUE_BYTES) {
+				if(!dropped_gops_.get())
+					std::cerr << "Archive store is too slow, GOPs are being dropped from the manifest" << std::endl;
+				dropped_gops_.add();
+				cur_.reset();
+				return;
+			}
+			queue_hwm_.max(queue_bytes_ += cur_->bytes);
+			queue_.push(cur_.release());
+		}
+
+		// serializes and hashes 'g' into obj_, timestamps
+		// relative to the first packet so that the object
+		// doesn't depend on where the GOP is in the recording
+		archive::manifest_entry hash(const gop& g) {
+			const AVPacket	*first = g.pkts[0].get();
+			obj_.clear();
+			for(const auto& p : g.pkts) {
+				const archive::object_packet	op = { (uint32_t)p->size, (uint32_t)p->flags, p->pts - first->pts, p->dts - first->dts };
+				obj_.insert(obj_.end(), (const uint8_t*)&op, (const uint8_t*)&op + sizeof(op));
+				obj_.insert(obj_.end(), p->data, p->data + p->size);
+			}
+			archive::manifest_entry	e;
+			av_sha_init(sha_.get(), 256);
+			av_sha_update(sha_.get(), obj_.data(), obj_.size());
+			av_sha_final(sha_.get(), e.sha);
+			e.pts = first->pts;
+			e.dts = first->dts;
+			e.n_packets = g.pkts.size();
+			e.size = obj_.size();
+			return e;
+		}
+
+		// blocking, on the I/O thread
+		void store(const archive::manifest_entry& e) {
+			gops_.add();
+			const std::string	path = object_path(store_, e.sha);
+			if(!access(path.c_str(), F_OK)) {
+				dedup_gops_.add();
+				bytes_dedup_.add(obj_.size());
+			} else {
+				make_dir(path.substr(0, path.rfind('/')));
+				const std::string	tmp = path + ".tmp." + std::to_string(getpid());
+				{
+					std::ofstream	ostr(tmp.c_str(), std::ios_base::binary);
+					ostr.write((const char*)obj_.data(), obj_.size());
+					if(!ostr)
+						throw std::runtime_error("Can't write object " + tmp);
+				}
+				if(std::rename(tmp.c_str(), path.c_str()))
+					throw std::runtime_error("Can't rename object " + tmp);
+				bytes_written_.add(obj_.size());
+			}
+			manifest_.write((const char*)&e, sizeof(e));
+		}
+
+		// hashing runs on the executor, file
+		// operations on the I/O thread
+		stage::task run(void) {
+			co_await stage::io([this]() { manifest_.write(header_.data(), header_.size()); });
+			gop	*g = 0;
+			while(co_await stage::pop(queue_, g)) {
+				archive::manifest_entry	e;
+				{
+					// accounted as a sink, not as the
+					// writer the executor threads are
+					alloc_check::scope	as(alloc_check::LIBAV);
+					std::unique_ptr<gop>	owned(g);
+					queue_bytes_ -= g->bytes;
+					e = hash(*g);
+				}
+				co_await stage::io([this, &e]() { store(e); });
+			}
+			co_await stage::io([this]() {
+				manifest_.flush();
+				if(!manifest_)
+					throw std::runtime_error("Can't write manifest");
+			});
+		}
+	public:
+		impl(const char* store_dir, const char* name) : store_(store_dir), queue_bytes_(0), sha_(make_sha()), done_(0),
+		gops_(stats::get("archive.gops")), dedup_gops_(stats::get("archive.dedup_gops")), bytes_written_(stats::get("archive.bytes_written")),
+		bytes_dedup_(stats::get("archive.bytes_dedup")), queue_hwm_(stats::get("archive.queue_bytes_hwm")),
+		dropped_gops_(stats::get("archive.dropped_gops")) {
+			make_dir(store_);
+			make_dir(store_ + "/objects");
+			const std::string	mpath = store_ + "/" + name + ".manifest";
+			manifest_.open(mpath.c_str(), std::ios_base::binary);
+			if(!manifest_)
+				throw std::runtime_error("Can't open manifest " + mpath);
+		}
+
+		void on_stream(const AVCodecContext* ocodec, const AVRational& time_base) {
+			const archive::manifest_header	h = { archive::MAGIC, archive::VERSION, ocodec->codec_id, ocodec->width, ocodec->height, ocodec->pix_fmt,
+							time_base.num, time_base.den, ocodec->extradata ? ocodec->extradata_size : 0 };
+			std::vector<char>	hdr((const char*)&h, (const char*)&h + sizeof(h));
+			hdr.insert(hdr.end(), (const char*)ocodec->extradata, (const char*)ocodec->extradata + h.extradata_size);
+			header_.swap(hdr);
+			done_ = new std::latch(1);
+			stage::shared().spawn(run(), done_);
+		}
+
+		void on_packet(const AVPacket* pkt) {
+			if(pkt->flags & AV_PKT_FLAG_KEY)
+				push_gop();
+			if(!cur_) {
+				cur_.reset(new gop());
+				cur_->bytes = 0;
+			}
+			// references the encoder buffer, no copy
+			packet_ptr	p(av_packet_clone(pkt), [](AVPacket* p){ if(p) av_packet_free(&p); });
+			if(!p)
+				throw std::runtime_error("av_packet_clone failed");
+			cur_->bytes += p->size;
+			cur_->pkts.push_back(std::move(p));
+		}
+
+		void on_end(void) {
+			push_gop();
+			// the stage stores what's left, then ends
+			queue_.close();
+		}
+
+		~impl() {
+			on_end();
+			if(done_) {
+				done_->wait();
+				delete done_;
+			}
+			// never started
+			gop	*g = 0;
+			while(queue_.pop(g, 0))
+				delete g;
+			if(gops_.get())
+				std::cout << "Archived " << gops_.get() << " GOPs, " << dedup_gops_.get() << " already in the store ("
+					<< bytes_dedup_.get()/(1024*1024) << " MB not written)" << std::endl;
+			if(dropped_gops_.get())
+				std::cout << "Dropped " << dropped_gops_.get() << " GOPs, the store was too slow" << std::endl;
+		}
+	};
+}
+
+writer::packet_sink* archive::init(const char* store_dir, const char* name) {
+	return new impl(store_dir, name);
+}
+
+void archive::restore(const char* manifest, const char* outfile) {
+	using namespace utils;
+
+	std::ifstream	istr(manifest, std::ios_base::binary);
+	manifest_header	hdr;
+	if(!istr.read((char*)&hdr, sizeof(hdr)) || hdr.magic != MAGIC || hdr.version != VERSION || hdr.extradata_size < 0)
+		throw std::runtime_error("Invalid archive manifest");
+	std::vector<uint8_t>	extradata(hdr.extradata_size);
+	if(hdr.extradata_size && !istr.read((char*)extradata.data(), extradata.size()))
+		throw std::runtime_error("Truncated archive manifest");
+	const std::string	m(manifest),
+				store = (m.rfind('/') == std::string::npos) ? "." : m.substr(0, m.rfind('/'));
+	// same output setup as the writer
+	AVOutputFormat  *ofmt = av_guess_format(0, outfile, 0);
+	if(!ofmt)
+		throw std::runtime_error("av_guess_format");
+	AVFormatContext	*octx_ = 0;
+	averror(avformat_alloc_output_context2(&octx_, ofmt, 0, outfile));
+	std::unique_ptr<AVFormatContext, void(*)(AVFormatContext*)>	octx(octx_, [](AVFormatContext* p){ if(p) { if(p->pb) avio_closep(&p->pb); avformat_free_context(p); } });
+	AVStream	*strm = avformat_new_stream(octx.get(), 0);
+	if(!strm)
+		throw std::runtime_error("avformat_new_stream");
+	const AVRational	tb = { hdr.tb_num, hdr.tb_den };
+	strm->time_base = tb;
+	strm->avg_frame_rate = av_inv_q(tb);
+	strm->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+	strm->codecpar->codec_id = (AVCodecID)hdr.codec_id;
+	strm->codecpar->width = hdr.width;
+	strm->codecpar->height = hdr.height;
+	strm->codecpar->format = hdr.pix_fmt;
+	if(!extradata.empty()) {
+		strm->codecpar->extradata = (uint8_t*)av_mallocz(extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+		if(!strm->codecpar->extradata)
+			throw std::runtime_error("av_mallocz");
+		std::memcpy(strm->codecpar->extradata, extradata.data(), extradata.size());
+		strm->codecpar->extradata_size = extradata.size();
+	}
+	if(!(octx->oformat->flags & AVFMT_NOFILE))
+		averror(avio_open2(&octx->pb , outfile , AVIO_FLAG_WRITE, 0, 0));
+	averror(avformat_write_header(octx.get(), 0));
+	std::unique_ptr<AVPacket, void(*)(AVPacket*)>	pkt(av_packet_alloc(), [](AVPacket* p){ if(p) av_packet_free(&p); });
+	sha_ptr			sha(make_sha());
+	std::vector<uint8_t>	obj;
+	manifest_entry		e;
+	int64_t			n_gops = 0,
+				n_packets = 0;
+	while(istr.read((char*)&e, sizeof(e))) {
+		const std::string	path = object_path(store, e.sha);
+		std::ifstream		ostr(path.c_str(), std::ios_base::binary);
+		obj.resize(e.size);
+		if(!ostr.read((char*)obj.data(), obj.size()))
+			throw std::runtime_error("Missing or truncated object " + path);
+		uint8_t	check[32];
+		av_sha_init(sha.get(), 256);
+		av_sha_update(sha.get(), obj.data(), obj.size());
+		av_sha_final(sha.get(), check);
+		if(std::memcmp(check, e.sha, sizeof(check)))
+			throw std::runtime_error("Corrupted object " + path);
+		size_t	off = 0;
+		for(uint32_t i = 0; i < e.n_packets; ++i) {
+			object_packet	op;
+			if(off + sizeof(op) > obj.size())
+				throw std::runtime_error("Invalid object " + path);
+			std::memcpy(&op, &obj[off], sizeof(op));
+			off += sizeof(op);
+			if(off + op.size > obj.size())
+				throw std::runtime_error("Invalid object " + path);
+			averror(av_new_packet(pkt.get(), op.size));
+			std::memcpy(pkt->data, &obj[off], op.size);
+			off += op.size;
+			pkt->flags = op.flags;
+			pkt->pts = e.pts + op.pts;
+			pkt->dts = e.dts + op.dts;
+			pkt->stream_index = strm->index;
+			// the muxer may have changed the time base
+			av_packet_rescale_ts(pkt.get(), tb, strm->time_base);
+			averror(av_write_frame(octx.get(), pkt.get()));
+			av_packet_unref(pkt.get());
+			++n_packets;
+		}
+		++n_gops;
+	}
+	averror(av_write_trailer(octx.get()));
+	std::cout << "Restored " << n_gops << " GOPs (" << n_packets << " packets) into '" << outfile << "'" << std::endl;
+}
@@ -0,0 +1,84 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+
+#ifndef _ARCHIVE_H_
+#define _ARCHIVE_H_
+
+#include "writer.h"
+#include <cstdint>
+
+/* Content addressed archive of recordings
+ * The encoded stream is split in GOPs (at each keyframe,
+ * the writer asks the encoder for closed GOPs with
+ * AV_CODEC_FLAG_CLOSED_GOP); each GOP is serialized
+ * with timestamps relative to its first packet, hashed
+ * (SHA-256) and stored once as '<store>/objects/xx/<hash>'.
+ * A recording is a manifest '<store>/<name>.manifest'
+ * listing its GOPs with their base timestamps, hence the
+ * same screens recorded at different times are stored
+ * once. Objects are written to a temporary file and
+ * renamed, so several recorders can share a store.
+ * When the store can't keep up, GOPs beyond 256 MB of
+ * backlog are left out of the manifest (a gap on restore).
+ *
+ * Manifest layout (native endianness):
+ *   manifest_header extradata manifest_entry*
+ * Object layout:
+ *   [object_packet data]*
+ */
+namespace archive {
+	const uint32_t	MAGIC = 0x41525052; // "RPRA"
+	const uint32_t	VERSION = 1;
+
+	struct manifest_header {
+		uint32_t	magic;
+		uint32_t	version;
+		int32_t		codec_id;
+		int32_t		width;
+		int32_t		height;
+		int32_t		pix_fmt;
+		int32_t		tb_num;
+		int32_t		tb_den;
+		int32_t		extradata_size;
+	};
+
+	struct manifest_entry {
+		uint8_t		sha[32];
+		int64_t		pts;
+		int64_t		dts;
+		uint32_t	n_packets;
+		uint32_t	size;
+	};
+
+	struct object_packet {
+		uint32_t	size;
+		uint32_t	flags;
+		int64_t		pts;
+		int64_t		dts;
+	};
+
+	// GOPs are hashed and written by a stage (see
+	// stage.h), the writer only references packets
+	extern writer::packet_sink* init(const char* store_dir, const char* name);
+
+	// reassembles the recording of 'manifest' into
+	// 'outfile' (any container libav can mux into)
+	extern void restore(const char* manifest, const char* outfile);
+}
+
+#endif //_ARCHIVE_H_
@@ -0,0 +1,222 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+
+#include "audio.h"
+#include "stats.h"
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+extern "C" {
+	#include <libavutil/time.h>
+}
+
+namespace {
+	class impl : public audio::iface {
+		// 4 KiB is ~21 ms of 48 kHz stereo s16,
+		// hence the ring holds ~5 s of it
+		static const int	SLOT_BYTES = 4096;
+		static const size_t	N_SLOTS = 256;
+
+		struct slot {
+			audio::chunk		c;
+			std::vector<uint8_t>	buf;
+		};
+
+		std::unique_ptr<AVFormatContext, void(*)(AVFormatContext*)>	fctx_;
+		int			astream_,
+					frame_bytes_;
+		AVRational		time_base_;
+		// preallocated, slots in [head_, tail_) belong
+		// to the consumer, the others to the producer
+		std::vector<slot>	slots_;
+		std::atomic<size_t>	head_,
+					tail_;
+		std::atomic<bool>	run_;
+		std::thread		*th_;
+		stats::value		&chunks_,
+					&dropped_,
+					&cpu_us_,
+					&ring_hwm_;
+
+		// pulse stamps packets with the wall clock time
+		// of their first sample (latency accounted), other
+		// sources (lavfi) count from 0: map the former
+		// to the monotonic clock, use the arrival time
+		// minus the duration for the latter
+		int64_t capture_ts(const AVPacket& pkt, const int64_t now, const int64_t dur) const {
+			if(pkt.pts != AV_NOPTS_VALUE) {
+				const int64_t	pts_us = av_rescale_q(pkt.pts, time_base_, AV_TIME_BASE_Q),
+						wall = av_gettime();
+				if(std::llabs(wall - pts_us) < 10*1000000LL)
+					return now - (wall - pts_us);
+			}
+			return now - dur;
+		}
+
+		// splits the data over as many slots as needed,
+		// what doesn't fit in the ring is dropped
+		void push(const uint8_t* data, int size, int64_t ts) {
+			const AVCodecParameters	*par = codecpar();
+			const int		max_bytes = SLOT_BYTES - SLOT_BYTES%frame_bytes_;
+			while(size > 0) {
+				const size_t	tail = tail_.load(std::memory_order_relaxed),
+						head = head_.load(std::memory_order_acquire);
+				if(tail - head == N_SLOTS) {
+					dropped_.add();
+					return;
+				}
+				const int	n = std::min(size, max_bytes);
+				slot&		s = slots_[tail%N_SLOTS];
+				std::memcpy(&s.buf[0], data, n);
+				s.c.ts = ts;
+				s.c.nb_samples = n/frame_bytes_;
+				s.c.size = n;
+				s.c.data = &s.buf[0];
+				tail_.store(tail + 1, std::memory_order_release);
+				ring_hwm_.max(tail + 1 - head);
+				ts += (int64_t)s.c.nb_samples*1000000/par->sample_rate;
+				data += n;
+				size -= n;
+			}
+		}
+
+		static int64_t thread_cpu_us(void) {
+			struct timespec	ts;
+			if(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+				return 0;
+			return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+		}
+
+		void loop(void) {
+			const int	sample_rate = codecpar()->sample_rate;
+			AVPacket	pkt;
+			av_init_packet(&pkt);
+			pkt.data = 0;
+			pkt.size = 0;
+			while(run_) {
+				const int	rv = av_read_frame(fctx_.get(), &pkt);
+				if(AVERROR(EAGAIN) == rv) {
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+					continue;
+				}
+				utils::averror(rv);
+				if(pkt.stream_index == astream_ && pkt.size > 0) {
+					const int64_t	now = av_gettime_relative(),
+							dur = (int64_t)(pkt.size/frame_bytes_)*1000000/sample_rate;
+					push(pkt.data, pkt.size - pkt.size%frame_bytes_, capture_ts(pkt, now, dur));
+					chunks_.add();
+				}
+				av_packet_unref(&pkt);
+				cpu_us_.set(thread_cpu_us());
+			}
+		}
+	public:
+		impl(const char* format, const char* source) : fctx_(0, [](AVFormatContext* p){ if(p) avformat_close_input(&p); }), astream_(-1), frame_bytes_(0),
+		time_base_((AVRational){1, 1}), slots_(N_SLOTS), head_(0), tail_(0), run_(false), th_(0), chunks_(stats::get("audio.chunks")),
+		dropped_(stats::get("audio.dropped_chunks")), cpu_us_(stats::get("audio.cpu_us")), ring_hwm_(stats::get("audio.ring_slots_hwm")) {
+			using namespace utils;
+
+			auto*	ifmt = av_find_input_format(format);
+			if(!ifmt)
+				throw std::runtime_error(std::string("av_find_input_format - can't find '") + format + "'");
+			AVDictionary	*opt = 0;
+			// one slot per fragment, lower latency
+			if(std::string("pulse") == format)
+				av_dict_set_int(&opt, "fragment_size", SLOT_BYTES, 0);
+			// lavfi sources aren't real time, they would fill
+			// the ring at once: pace them as --synthetic does
+			std::string	src = source;
+			if(std::string("lavfi") == format && src.find("arealtime") == std::string::npos)
+				src += ",arealtime";
+			AVFormatContext	*fctx = 0;
+			const int	rv = avformat_open_input(&fctx, src.c_str(), ifmt, &opt);
+			av_dict_free(&opt);
+			averror(rv);
+			fctx_.reset(fctx);
+			astream_ = av_find_best_stream(fctx, AVMEDIA_TYPE_AUDIO, -1, -1, 0, 0);
+			averror(astream_);
+			const AVCodecParameters	*par = codecpar();
+			const int		bits = av_get_bits_per_sample(par->codec_id);
+			if(bits <= 0 || bits%8 || par->channels <= 0 || par->sample_rate <= 0)
+				throw std::runtime_error("Audio source doesn't provide interleaved PCM");
+			frame_bytes_ = bits/8*par->channels;
+			if(frame_bytes_ > SLOT_BYTES)
+				throw std::runtime_error("Audio sample frames are too large");
+			time_base_ = fctx->streams[astream_]->time_base;
+			for(auto& s : slots_)
+				s.buf.resize(SLOT_BYTES);
+			std::cout << "Audio: '" << source << "' (" << format << "), " << par->sample_rate << " Hz, " << par->channels << " channels" << std::endl;
+		}
+
+		const AVCodecParameters* codecpar(void) const {
+			return fctx_->streams[astream_]->codecpar;
+		}
+
+		void start(void) {
+			if(th_)
+				throw std::runtime_error("already running");
+			run_ = true;
+			th_ = new std::thread(
+				[this]() -> void {
+					// a failing source must not stop
+					// the video capture
+					try {
+						loop();
+					} catch(const std::exception& e) {
+						std::cerr << "[audio] Capture stopped: " << e.what() << std::endl;
+					}
+				}
+			);
+		}
+
+		void stop(void) {
+			if(!th_)
+				return;
+			// the source delivers a fragment every few
+			// ms, the loop sees the flag soon
+			run_ = false;
+			th_->join();
+			delete th_;
+			th_ = 0;
+		}
+
+		const audio::chunk* peek(void) {
+			const size_t	head = head_.load(std::memory_order_relaxed);
+			if(head == tail_.load(std::memory_order_acquire))
+				return 0;
+			return &slots_[head%N_SLOTS].c;
+		}
+
+		void pop(void) {
+			head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+
+		~impl() {
+			stop();
+		}
+	};
+}
+
+audio::iface* audio::init(const char* format, const char* source) {
+	return new impl(format, source);
+}
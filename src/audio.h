@@ -0,0 +1,64 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+
+#ifndef _AUDIO_H_
+#define _AUDIO_H_
+
+#include "utils.h"
+
+/* Audio capture
+ * Reads PCM from a libavdevice source (by default a
+ * PulseAudio/PipeWire source, i.e. the monitor of a
+ * sink such as '@DEFAULT_MONITOR@' or the one of a
+ * null sink for tests) on its own thread. Chunks are
+ * timestamped on the monotonic clock xcompgrab paces
+ * on (av_gettime_relative) and handed to the writer
+ * through a single producer single consumer lock free
+ * ring of preallocated slots: neither side ever blocks
+ * or allocates, when the ring is full chunks are
+ * dropped (and counted).
+ */
+namespace audio {
+	struct chunk {
+		// capture time of the first sample
+		int64_t		ts;
+		int		nb_samples;
+		int		size;
+		const uint8_t	*data;
+	};
+
+	class iface {
+	public:
+		// PCM parameters, valid after init
+		virtual const AVCodecParameters* codecpar(void) const = 0;
+		virtual void start(void) = 0;
+		virtual void stop(void) = 0;
+		// consumer side, never blocks; the chunk is
+		// valid until pop, 0 when the ring is empty
+		virtual const chunk* peek(void) = 0;
+		virtual void pop(void) = 0;
+		virtual ~iface() {}
+	};
+
+	// 'format' is the libavdevice input format (i.e.
+	// "pulse", or "lavfi" for synthetic sources, which get
+	// an arealtime filter appended to be paced)
+	extern iface* init(const char* format, const char* source);
+}
+
+#endif //_AUDIO_H_
@@ -0,0 +1,226 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+
+#include "execpool.h"
+#include "numa_utils.h"
+#include "stats.h"
+#include "alloc_check.h"
+#include <thread>
+#include <vector>
+#include <map>
+
+namespace {
+	class client_impl;
+
+	class pool {
+		std::mutex			mtx_;
+		std::condition_variable		cv_;
+		std::vector<client_impl*>	clients_;
+		// next client to be served
+		size_t				rr_;
+		// codecs counted by all the clients
+		int				codecs_;
+		std::vector<std::thread>	th_;
+		const int			size_,
+						node_;
+		stats::value			&n_clients_,
+						&n_codecs_,
+						&worker_jobs_;
+
+		void worker(void);
+	public:
+		pool(const int n, const int node);
+
+		inline int size(void) const {
+			return size_;
+		}
+
+		inline std::mutex& mtx(void) {
+			return mtx_;
+		}
+
+		inline void notify(const int n) {
+			if(n >= (int)th_.size())
+				cv_.notify_all();
+			else
+				for(int i = 0; i < n; ++i)
+					cv_.notify_one();
+		}
+
+		void add(client_impl* c);
+
+		void remove(client_impl* c);
+
+		int add_codec(client_impl* c);
+	};
+
+	class client_impl : public execpool::client {
+		friend class pool;
+
+		pool&				p_;
+		// current batch, guarded by the pool mutex
+		execpool::job_fn		fn_;
+		void				*arg_;
+		int				n_,
+						next_,
+						pending_;
+		// codecs announced at attach and bound,
+		// guarded by the pool mutex
+		const int			reserved_;
+		int				bound_;
+		alloc_check::stage		stage_;
+		std::condition_variable		cv_done_;
+
+		// under the pool mutex, runs one job
+		// and unlocks it in the meantime
+		void run_one(std::unique_lock<std::mutex>& ul) {
+			const int	j = next_++;
+			ul.unlock();
+			{
+				alloc_check::scope	s(stage_);
+				fn_(arg_, j);
+			}
+			ul.lock();
+			if(!--pending_)
+				cv_done_.notify_all();
+		}
+	public:
+		client_impl(pool& p, const int n_codecs) : p_(p), fn_(0), arg_(0), n_(0), next_(0), pending_(0), reserved_(std::max(0, n_codecs)), bound_(0), stage_(alloc_check::NONE) {
+			p_.add(this);
+		}
+
+		void run(const int n, execpool::job_fn fn, void* arg) {
+			if(n <= 0)
+				return;
+			if(n == 1 || p_.size() == 1) {
+				for(int i = 0; i < n; ++i)
+					fn(arg, i);
+				return;
+			}
+			std::unique_lock<std::mutex>	ul(p_.mtx());
+			fn_ = fn;
+			arg_ = arg;
+			n_ = n;
+			next_ = 0;
+			pending_ = n;
+			// workers account their allocations
+			// as the caller would
+			stage_ = alloc_check::get_stage();
+			p_.notify(n - 1);
+			while(next_ < n_)
+				run_one(ul);
+			cv_done_.wait(ul, [this](){ return !pending_; });
+			n_ = next_ = 0;
+		}
+
+		int add_codec(void) {
+			return p_.add_codec(this);
+		}
+
+		~client_impl() {
+			p_.remove(this);
+		}
+	};
+
+	pool::pool(const int n, const int node) : rr_(0), codecs_(0), size_(n), node_(node), n_clients_(stats::get("execpool.clients")), n_codecs_(stats::get("execpool.codecs")), worker_jobs_(stats::get("execpool.worker_jobs")) {
+		// the callers are threads too
+		for(int i = 1; i < size_; ++i)
+			th_.push_back(std::thread(&pool::worker, this));
+	}
+
+	void pool::worker(void) {
+		// as the writer threads, so that bands
+		// work on memory of their node
+		numa_utils::run_on_node(node_);
+		std::unique_lock<std::mutex>	ul(mtx_);
+		while(true) {
+			client_impl	*c = 0;
+			for(size_t i = 0; i < clients_.size(); ++i) {
+				client_impl	*cur = clients_[(rr_ + i)%clients_.size()];
+				if(cur->next_ < cur->n_) {
+					c = cur;
+					rr_ = (rr_ + i + 1)%clients_.size();
+					break;
+				}
+			}
+			if(!c) {
+				cv_.wait(ul);
+				continue;
+			}
+			c->run_one(ul);
+			worker_jobs_.add();
+		}
+	}
+
+	void pool::add(client_impl* c) {
+		std::unique_lock<std::mutex>	ul(mtx_);
+		clients_.push_back(c);
+		codecs_ += c->reserved_;
+		n_clients_.max(clients_.size());
+		n_codecs_.set(codecs_);
+	}
+
+	void pool::remove(client_impl* c) {
+		std::unique_lock<std::mutex>	ul(mtx_);
+		clients_.erase(std::find(clients_.begin(), clients_.end(), c));
+		if(rr_ >= clients_.size())
+			rr_ = 0;
+		codecs_ -= std::max(c->reserved_, c->bound_);
+		n_codecs_.set(codecs_);
+	}
+
+	int pool::add_codec(client_impl* c) {
+		std::unique_lock<std::mutex>	ul(mtx_);
+		// reserved ones are counted already
+		if(++c->bound_ > c->reserved_)
+			++codecs_;
+		n_codecs_.set(codecs_);
+		return std::max(1, size_/std::max(1, codecs_));
+	}
+
+	std::atomic<int>	pool_size(0);
+
+	// one per node, live as long as the process,
+	// workers are never joined
+	pool& get_pool(const int node) {
+		static std::mutex		mtx;
+		static std::map<int, pool*>	pools;
+		std::lock_guard<std::mutex>	lg(mtx);
+		pool	*&p = pools[std::max(-1, node)];
+		if(!p)
+			p = new pool(pool_size.load() > 0 ? pool_size.load() : std::max(1, (int)std::thread::hardware_concurrency()), std::max(-1, node));
+		return *p;
+	}
+}
+
+void execpool::set_size(const int n) {
+	pool_size.store(n);
+}
+
+int execpool::size(void) {
+	return get_pool(-1).size();
+}
+
+execpool::client* execpool::attach(const int n_codecs, const int numa_node) {
+	return new client_impl(get_pool(numa_node), n_codecs);
+}
+
+void execpool::bind(AVCodecContext* c, const AVCodec* codec, client* cl) {
+	if(codec->capabilities & (AV_CODEC_CAP_AUTO_THREADS | AV_CODEC_CAP_FRAME_THREADS | AV_CODEC_CAP_SLICE_THREADS))
+		c->thread_count = cl->add_codec();
+}
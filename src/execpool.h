@@ -0,0 +1,75 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+
+#ifndef _EXECPOOL_H_
+#define _EXECPOOL_H_
+
+#include "utils.h"
+
+/* Process wide execution pool
+ * One set of worker threads, sized to the cores, shared
+ * by all the scalers of the process, so that many
+ * concurrent recordings don't multiply threads. There is
+ * one such pool per NUMA node clients attach from, its
+ * workers run on that node (see numa_utils.h).
+ * Each stream attaches as a client; workers take one job
+ * at a time from the clients round robin, hence a stream
+ * with many bands can't starve the others.
+ * The calling thread always helps with its own jobs.
+ * Codecs keep their own threads (libavcodec replaces custom
+ * execute hooks with its slice threads, and doesn't call
+ * them without), those are capped instead: the pool size
+ * is split among the codecs of all the clients, see bind.
+ */
+namespace execpool {
+	typedef void (*job_fn)(void* arg, const int job);
+
+	class client {
+	public:
+		// runs fn(arg, 0 ... n-1) on the pool and
+		// returns once all the jobs are done
+		virtual void run(const int n, job_fn fn, void* arg) = 0;
+		// counts one more codec of this client, returns
+		// its share of the pool (see bind)
+		virtual int add_codec(void) = 0;
+		virtual ~client() {}
+	};
+
+	// number of threads of each pool (callers included), can
+	// only be set before the first attach; 0 means one per core
+	extern void set_size(const int n);
+
+	extern int size(void);
+
+	// 'n_codecs' is the number of codecs the client
+	// will bind, they are counted from now on so that
+	// the first one doesn't get the whole pool.
+	// The client is served by the pool of 'numa_node'
+	// (-1 for the one not bound to any node)
+	extern client* attach(const int n_codecs = 0, const int numa_node = -1);
+
+	// to be called before avcodec_open2: threaded codecs
+	// (i.e. libx264, h264 decoder) get the pool size divided
+	// by the codecs of all the attached clients (at least 1)
+	// as thread_count. libavcodec fixes it at open, hence the
+	// shares are divided again only for codecs opened later,
+	// as clients attach and detach.
+	extern void bind(AVCodecContext* c, const AVCodec* codec, client* cl);
+}
+
+#endif //_EXECPOOL_H_
@@ -0,0 +1,370 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+#include "fanout.h"
+#include "stats.h"
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <string>
+#include <cstring>
+#include <stdexcept>
+#include <iostream>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+namespace {
+	typedef std::shared_ptr<AVPacket>	shared_packet;
+
+	// references the encoder buffer, no copy
+	shared_packet make_shared_packet(const AVPacket* pkt) {
+		AVPacket	*p = av_packet_clone(pkt);
+		if(!p)
+			throw std::runtime_error("av_packet_clone failed");
+		return shared_packet(p, [](AVPacket* p){ av_packet_free(&p); });
+	}
+
+	shared_packet make_shared_packet(const uint8_t* data, const int sz) {
+		AVPacket	*p = av_packet_alloc();
+		if(!p)
+			throw std::runtime_error("av_packet_alloc failed");
+		shared_packet	rv(p, [](AVPacket* p){ av_packet_free(&p); });
+		utils::averror(av_new_packet(p, sz));
+		std::memcpy(p->data, data, sz);
+		return rv;
+	}
+
+	void set_nonblock(const int fd) {
+		const int	fl = fcntl(fd, F_GETFL, 0);
+		if(fl < 0 || fcntl(fd, F_SETFL, fl | O_NONBLOCK) < 0)
+			throw std::runtime_error("fcntl O_NONBLOCK failed");
+	}
+
+	class impl : public writer::packet_sink {
+		// at most these packets are referenced
+		// by a single client at any time
+		static const size_t	MAX_IOV = 64;
+
+		struct entry {
+			shared_packet	pkt;
+			uint64_t	seq;
+			bool		key;
+		};
+
+		struct client {
+			int				fd;
+			uint64_t			next_seq;
+			bool				need_key;
+			// packets taken from the ring, the first
+			// one may have been partially sent already
+			std::deque<shared_packet>	pending;
+			size_t				offset;
+		};
+
+		const size_t		max_bytes_;
+		std::string		unix_path_;
+		int			listen_fd_,
+					wake_fd_;
+		// ring, protected by mtx_
+		std::mutex		mtx_;
+		std::deque<entry>	ring_;
+		size_t			ring_bytes_;
+		uint64_t		next_seq_;
+		shared_packet		header_;
+		bool			ended_;
+		// owned by the server thread only
+		std::vector<client>	clients_;
+		std::atomic<bool>	run_;
+		std::thread		*th_;
+		stats::value		&n_clients_,
+					&bytes_sent_,
+					&skips_,
+					&ring_bytes_stat_;
+
+		void wake(void) {
+			const uint64_t	v = 1;
+			if(write(wake_fd_, &v, sizeof(v)) < 0) {
+				// counter overflow only, server is awake anyway
+			}
+		}
+
+		// to be called with mtx_ locked
+		void seek_key(client& c) {
+			for(const auto& e : ring_) {
+				if(e.seq >= c.next_seq && e.key) {
+					c.next_seq = e.seq;
+					c.need_key = false;
+					return;
+				}
+			}
+			c.next_seq = next_seq_;
+		}
+
+		// to be called with mtx_ locked
+		void refill(client& c) {
+			if(ring_.empty())
+				return;
+			if(c.next_seq < ring_.front().seq) {
+				// fell out of the ring, can only
+				// restart cleanly at a keyframe
+				skips_.add();
+				c.need_key = true;
+			}
+			if(c.need_key)
+				seek_key(c);
+			if(c.need_key || c.next_seq >= next_seq_)
+				return;
+			for(auto it = ring_.begin() + (c.next_seq - ring_.front().seq); it != ring_.end() && c.pending.size() < MAX_IOV; ++it) {
+				c.pending.push_back(it->pkt);
+				++c.next_seq;
+			}
+		}
+
+		// returns false if the client has to be dropped
+		bool send_client(client& c) {
+			while(true) {
+				if(c.pending.size() < MAX_IOV/2) {
+					std::lock_guard<std::mutex>	lg(mtx_);
+					refill(c);
+				}
+				if(c.pending.empty())
+					return true;
+				struct iovec	iov[MAX_IOV];
+				size_t		n_iov = 0;
+				for(const auto& p : c.pending) {
+					if(n_iov == MAX_IOV)
+						break;
+					iov[n_iov].iov_base = p->data;
+					iov[n_iov].iov_len = p->size;
+					++n_iov;
+				}
+				iov[0].iov_base = (uint8_t*)iov[0].iov_base + c.offset;
+				iov[0].iov_len -= c.offset;
+				struct msghdr	msg = {0};
+				msg.msg_iov = iov;
+				msg.msg_iovlen = n_iov;
+				const ssize_t	rv = sendmsg(c.fd, &msg, MSG_NOSIGNAL|MSG_DONTWAIT);
+				if(rv < 0)
+					return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+				bytes_sent_.add(rv);
+				// release the fully sent packets
+				size_t	sent = rv + c.offset;
+				c.offset = 0;
+				while(!c.pending.empty() && sent >= (size_t)c.pending.front()->size) {
+					sent -= c.pending.front()->size;
+					c.pending.pop_front();
+				}
+				c.offset = sent;
+				if(c.offset)
+					return true;
+			}
+		}
+
+		void accept_clients(void) {
+			while(true) {
+				const int	fd = accept(listen_fd_, 0, 0);
+				if(fd < 0)
+					return;
+				set_nonblock(fd);
+				client	c = { fd, 0, true, std::deque<shared_packet>(), 0 };
+				{
+					std::lock_guard<std::mutex>	lg(mtx_);
+					if(header_)
+						c.pending.push_back(header_);
+					// start at the latest keyframe
+					for(auto it = ring_.rbegin(); it != ring_.rend(); ++it) {
+						if(it->key) {
+							c.next_seq = it->seq;
+							c.need_key = false;
+							break;
+						}
+					}
+					if(c.need_key)
+						c.next_seq = next_seq_;
+				}
+				clients_.push_back(std::move(c));
+			}
+		}
+
+		void loop(void) {
+			std::vector<struct pollfd>	fds;
+			while(run_) {
+				fds.clear();
+				fds.push_back(pollfd{wake_fd_, POLLIN, 0});
+				fds.push_back(pollfd{listen_fd_, POLLIN, 0});
+				for(const auto& c : clients_)
+					fds.push_back(pollfd{c.fd, (short)(c.pending.empty() ? 0 : POLLOUT), 0});
+				// every state change writes to wake_fd_,
+				// no need for a periodic timeout
+				if(poll(&fds[0], fds.size(), -1) < 0) {
+					if(errno == EINTR)
+						continue;
+					throw std::runtime_error("poll failed");
+				}
+				if(fds[0].revents & POLLIN) {
+					uint64_t	v = 0;
+					if(read(wake_fd_, &v, sizeof(v)) < 0) {
+						// spurious, nothing to do
+					}
+				}
+				if(fds[1].revents & POLLIN)
+					accept_clients();
+				bool	ended = false;
+				{
+					std::lock_guard<std::mutex>	lg(mtx_);
+					ended = ended_;
+				}
+				// clients accepted in this iteration
+				// have no entry in fds
+				for(size_t i = 0; i < clients_.size(); ) {
+					client&		c = clients_[i];
+					const short	rev = (i + 2 < fds.size()) ? fds[i + 2].revents : 0;
+					bool		keep = !(rev & (POLLERR|POLLHUP)) && send_client(c);
+					if(keep && ended && c.pending.empty()) {
+						std::lock_guard<std::mutex>	lg(mtx_);
+						keep = c.next_seq < next_seq_;
+					}
+					if(!keep) {
+						close(c.fd);
+						clients_.erase(clients_.begin() + i);
+						fds.erase(fds.begin() + i + 2);
+						continue;
+					}
+					++i;
+				}
+				n_clients_.set(clients_.size());
+			}
+		}
+	public:
+		impl(const char* addr, const size_t max_bytes) : max_bytes_(max_bytes), listen_fd_(-1), wake_fd_(-1), ring_bytes_(0), next_seq_(0), ended_(false), run_(true), th_(0),
+		n_clients_(stats::get("fanout.clients")), bytes_sent_(stats::get("fanout.bytes_sent")), skips_(stats::get("fanout.skips")), ring_bytes_stat_(stats::get("fanout.ring_bytes")) {
+			const std::string	a(addr);
+			try {
+				if(a.compare(0, 5, "unix:") == 0) {
+					struct sockaddr_un	sa = {0};
+					unix_path_ = a.substr(5);
+					if(unix_path_.empty() || unix_path_.size() >= sizeof(sa.sun_path))
+						throw std::runtime_error("Invalid unix socket path");
+					sa.sun_family = AF_UNIX;
+					std::strcpy(sa.sun_path, unix_path_.c_str());
+					// stale socket from a previous run
+					unlink(unix_path_.c_str());
+					if((listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+						throw std::runtime_error("socket failed");
+					if(bind(listen_fd_, (struct sockaddr*)&sa, sizeof(sa)))
+						throw std::runtime_error("Can't bind unix socket");
+				} else if(a.compare(0, 4, "tcp:") == 0) {
+					const int		port = std::atoi(a.c_str() + 4);
+					struct sockaddr_in	sa = {0};
+					if(port <= 0 || port > 65535)
+						throw std::runtime_error("Invalid tcp port");
+					sa.sin_family = AF_INET;
+					sa.sin_port = htons(port);
+					sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+					if((listen_fd_ = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+						throw std::runtime_error("socket failed");
+					const int	one = 1;
+					setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+					if(bind(listen_fd_, (struct sockaddr*)&sa, sizeof(sa)))
+						throw std::runtime_error("Can't bind tcp port");
+				} else {
+					throw std::runtime_error("Invalid serve address, use unix:<path> or tcp:<port>");
+				}
+				if(listen(listen_fd_, 16))
+					throw std::runtime_error("listen failed");
+				set_nonblock(listen_fd_);
+				if((wake_fd_ = eventfd(0, EFD_NONBLOCK)) < 0)
+					throw std::runtime_error("eventfd failed");
+			} catch(...) {
+				if(listen_fd_ >= 0)
+					close(listen_fd_);
+				throw;
+			}
+			th_ = new std::thread([this]() {
+				try {
+					loop();
+				} catch(const std::exception& e) {
+					std::cerr << "[fanout] Exception: " << e.what() << std::endl;
+				}
+			});
+		}
+
+		void on_stream(const AVCodecContext* ocodec, const AVRational& time_base) {
+			// with global headers SPS/PPS are not repeated
+			// in keyframes, every client gets them first
+			if(ocodec->extradata && ocodec->extradata_size > 0) {
+				shared_packet	h = make_shared_packet(ocodec->extradata, ocodec->extradata_size);
+				std::lock_guard<std::mutex>	lg(mtx_);
+				header_ = h;
+			}
+		}
+
+		void on_packet(const AVPacket* pkt) {
+			entry	e = { make_shared_packet(pkt), 0, (pkt->flags & AV_PKT_FLAG_KEY) != 0 };
+			{
+				std::lock_guard<std::mutex>	lg(mtx_);
+				e.seq = next_seq_++;
+				ring_bytes_ += pkt->size;
+				ring_.push_back(std::move(e));
+				// always keep the latest packet
+				while(ring_bytes_ > max_bytes_ && ring_.size() > 1) {
+					ring_bytes_ -= ring_.front().pkt->size;
+					ring_.pop_front();
+				}
+				ring_bytes_stat_.set(ring_bytes_);
+			}
+			wake();
+		}
+
+		void on_end(void) {
+			{
+				std::lock_guard<std::mutex>	lg(mtx_);
+				ended_ = true;
+			}
+			wake();
+		}
+
+		~impl() {
+			run_ = false;
+			wake();
+			if(th_) {
+				th_->join();
+				delete th_;
+			}
+			for(const auto& c : clients_)
+				close(c.fd);
+			close(wake_fd_);
+			close(listen_fd_);
+			if(!unix_path_.empty())
+				unlink(unix_path_.c_str());
+		}
+	};
+}
+
+writer::packet_sink* fanout::init(const char* addr, const size_t max_bytes) {
+	return new impl(addr, max_bytes);
+}
@@ -0,0 +1,40 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+#ifndef _FANOUT_H_
+#define _FANOUT_H_
+
+#include "writer.h"
+
+/* Live stream fan-out
+ * Serves the encoded stream (H.264 Annex B) to any
+ * number of local viewers. Each packet is kept once
+ * in a ring, referenced by the clients which still
+ * have to send it and sent straight from the encoder
+ * buffer with sendmsg; no per client copies.
+ * Clients start at the latest keyframe; a client which
+ * falls behind the ring skips to the next keyframe,
+ * hence memory is bounded whatever the viewers do.
+ */
+namespace fanout {
+	// addr is either "unix:/path/to/socket" or
+	// "tcp:port" (listens on 127.0.0.1 only)
+	// max_bytes is the ring size limit
+	extern writer::packet_sink* init(const char* addr, const size_t max_bytes = 32*1024*1024);
+}
+
+#endif //_FANOUT_H_
@@ -20,13 +20,37 @@
 #include <iostream>
 #include "utils.h"
 #include "writer.h"
+#include "audio.h"
+#include "tilecodec.h"
+#include "splitenc.h"
+#include "execpool.h"
+#include "numa_utils.h"
+#include "stats.h"
+#include "soak.h"
+#include "fanout.h"
+#include "alloc_check.h"
+#include "pressure.h"
+#include "review.h"
+#include "phash.h"
+#include "archive.h"
+#include "replay.h"
+#include "stress.h"
 #include <thread>
 #include <fstream>
-
+#include <getopt.h>
+#include <algorithm>
+#include <sys/prctl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
 extern "C" {
-	extern AVInputFormat ff_xcompgrab_demuxer;
+	#include <libavutil/parseutils.h>
+	#include <libavutil/time.h>
 }
 
+#include "xcompgrab.h"
+#include "xshmgrab.h"
+
 namespace {
 	void ppm_write(AVStream *st, AVPacket& pkt, int seq) {
 		std::ofstream ppm((std::string("out") + std::to_string(seq) + ".ppm").c_str());
@@ -38,22 +62,349 @@ namespace {
 			ppm << (int)data[0] << " " << (int)data[1] << " " << (int)data[2] << '\n';
 		}
 	}
+
+	struct settings {
+		bool	useX11grab = false;
+		bool	writeOutput = true;
+		bool	useTiles = false;
+		bool	followFocus = false;
+		bool	adaptPressure = false;
+		bool	lowPower = false;
+		bool	virtualTime = false;
+		int	fps = 60;
+		int	max_frames = 0;
+		int	out_width = 0;
+		int	out_height = 0;
+		int	scale_threads = 2;
+		int	numa_node = -1;
+		int	soak_secs = 0;
+		int	soak_interval = 60;
+		int	pool_size = 16;
+		int	alloc_check_frames = 0;
+		int	impact_secs = -1;
+		int	review_cache = 64;
+		int	phash_secs = 0;
+		int	max_distance = 8;
+		int	stress_secs = 0;
+		int	stress_threads = std::max(4, 2*(int)std::thread::hardware_concurrency());
+		int	split_bg_fps = 5;
+		int	replay_secs = 0;
+		int	replay_workers = 2;
+		int	exec_threads = 0;
+		std::string	window_name = "Firefox";
+		std::string	outfile = "output.mkv";
+		std::string	convert_file;
+		std::string	synthetic_size;
+		std::string	soak_csv;
+		std::string	canvas_size;
+		std::string	serve_addr;
+		std::string	desktop_tiles;
+		std::string	review_file;
+		std::string	find_image;
+		std::string	archive_dir;
+		std::string	restore_file;
+		std::string	split_region;
+		std::string	audio_source;
+		std::string	audio_format = "pulse";
+		std::vector<std::string>	find_paths;
+	};
+
+	void print_help(const char *prog) {
+		std::cerr <<	"Usage: " << prog << " [options] [window name]\n"
+				"Captures an X window (via XComposite) and writes it to a video file\n\n"
+				"Options:\n"
+				"  -w, --window-name n  Capture the first window whose title contains 'n' (default 'Firefox')\n"
+				"  -o, --output f       Output file (default 'output.mkv')\n"
+				"  -f, --fps n          Frames per second to capture (default 60)\n"
+				"  -n, --frames n       Stop after n frames (default 10 seconds of frames)\n"
+				"  -s, --out-size WxH   Downscale frames to WxH before encoding, exact 2x,\n"
+				"                       3x and 4x ratios use a box filter, others bilinear\n"
+				"      --scale-threads n Number of bands used to downscale (default 2)\n"
+				"      --exec-threads n Size of the execution pool shared by the scalers,\n"
+				"                       codec threads split it among the open codecs\n"
+				"                       (default one per core)\n"
+				"      --numa-node n    Run capture, writer and scaler threads on NUMA node 'n'\n"
+				"                       and allocate frame buffers there ('auto' for the\n"
+				"                       node replayer starts on)\n"
+				"      --follow-focus   Capture the focused window, switching capture when\n"
+				"                       focus changes (implies a canvas)\n"
+				"      --canvas WxH     Fixed capture size, the window is scaled and\n"
+				"                       letterboxed into it (default window size)\n"
+				"      --pool-size n    Number of frames in the pipeline pool, bounds\n"
+				"                       memory and capture to encode latency (default 16)\n"
+				"      --impact s       Measure the captured window presentation rate for\n"
+				"                       's' seconds before capturing and while capturing,\n"
+				"                       plus redirect and texture bind costs (0 skips\n"
+				"                       the measurement before capture, at most 600)\n"
+				"      --desktop t      Capture the whole desktop (root window, all\n"
+				"                       monitors) via MIT-SHM, as a grid of 't' (CxR)\n"
+				"                       tiles grabbed in parallel; 'auto' for about\n"
+				"                       1920x1080 tiles, at most one per CPU\n"
+				"      --virtual-time   Don't pace capture on the wall clock: frames are\n"
+				"                       captured as soon as the pipeline has room and\n"
+				"                       timestamped at the nominal fps (for deterministic,\n"
+				"                       faster than real time runs, i.e. under Xvfb)\n"
+				"      --audio s        Also capture audio from source 's' (i.e. a monitor\n"
+				"                       source, '@DEFAULT_MONITOR@' for what is played)\n"
+				"      --audio-format f libavdevice input for --audio (default 'pulse',\n"
+				"                       'lavfi' with i.e. 'sine' for tests, paced in\n"
+				"                       real time)\n"
+				"      --x11grab        Use libav x11grab instead of xcompgrab\n"
+				"      --synthetic WxH  Use a synthetic (libav testsrc2) source instead of\n"
+				"                       capturing a window\n"
+				"      --soak s         Run for 's' seconds sampling memory, fds, pools,\n"
+				"                       queue depth and latency, then report drift\n"
+				"      --soak-interval s Seconds between soak samples (default 60)\n"
+				"      --soak-csv f     Also write soak samples to csv file 'f'\n"
+				"      --serve addr     Serve the live encoded stream (H.264 Annex B) to\n"
+				"                       local clients on 'unix:<path>' or 'tcp:<port>'\n"
+				"      --archive d      Also store the recording in the content addressed\n"
+				"                       store 'd': GOPs already in the store are not\n"
+				"                       written again, only referenced by the manifest\n"
+				"      --replay s       Keep the last 's' seconds encoded, each SIGUSR1\n"
+				"                       saves them as '<output>-replay-<n>.mkv'; saves\n"
+				"                       may overlap and never stall the writer\n"
+				"      --replay-workers n Threads writing replay clips (default 2)\n"
+				"      --restore m      Reassemble archived manifest 'm' into a playable\n"
+				"                       file (--output) and exit\n"
+				"      --low-power      Minimise wakeups: frames are handed to the writer\n"
+				"                       in batches of up to 4 (adds latency), timers are\n"
+				"                       allowed to coalesce, no per frame output\n"
+				"      --pressure       Adapt to host memory and io pressure (PSI and\n"
+				"                       cgroup memory.max): shrink the frame pool and the\n"
+				"                       --replay ring, lower the bitrate and buffer\n"
+				"                       packets in memory\n"
+				"      --alloc-check n  After a 2 seconds warm-up, count heap allocations\n"
+				"                       during n frames; exits with 1 if the pipeline\n"
+				"                       (capture, queue, writer) allocated\n"
+				"      --no-output      Capture frames but don't write them\n"
+				"      --tiles          Write with the incremental tile codec instead\n"
+				"                       of libavcodec (see --convert)\n"
+				"      --split r        Encode the high motion region 'r' (WxH+X+Y, or\n"
+				"                       'auto' to detect it) at full fps and the rest\n"
+				"                       of the frame at --split-bg-fps, as two streams\n"
+				"                       (see --convert)\n"
+				"      --split-bg-fps n Frames per second of the background with --split\n"
+				"                       (default 5)\n"
+				"      --convert f      Convert tile codec or --split file 'f' into a\n"
+				"                       standard video file (--output) and exit\n"
+				"      --phash s        Store a perceptual hash of a frame every 's'\n"
+				"                       seconds in '<output>.phash' (default none)\n"
+				"      --find img       Search the recordings (or their .phash sidecars,\n"
+				"                       or directories of them) given as arguments for\n"
+				"                       frames looking like image 'img' and exit\n"
+				"      --max-distance n Max hash distance (0-64) for --find (default 8)\n"
+				"      --review f       Step interactively through recording 'f' (commands\n"
+				"                       on stdin), frames are decoded to RGB24 (--out-size)\n"
+				"                       and kept in an LRU cache\n"
+				"      --review-cache n Number of decoded frames cached by --review\n"
+				"                       (default 64)\n"
+				"      --stress s       Stress the concurrent queues and frame pools for\n"
+				"                       's' seconds each, check their invariants and exit\n"
+				"                       with 1 on violations (best with 'make tsan')\n"
+				"      --stress-threads n Threads used by --stress (default twice the\n"
+				"                       number of CPUs, at least 4)\n"
+				"  -h, --help           Prints this help and exit\n"
+		<< std::flush;
+	}
+
+	void parse_args(int argc, char *argv[], settings& s) {
+		static struct option	long_options[] = {
+			{"window-name",	required_argument,	0,	'w'},
+			{"output",	required_argument,	0,	'o'},
+			{"fps",		required_argument,	0,	'f'},
+			{"frames",	required_argument,	0,	'n'},
+			{"out-size",	required_argument,	0,	's'},
+			{"scale-threads",	required_argument,	0,	0},
+			{"exec-threads",	required_argument,	0,	0},
+			{"numa-node",	required_argument,	0,	0},
+			{"follow-focus",	no_argument,		0,	0},
+			{"canvas",	required_argument,	0,	0},
+			{"pool-size",	required_argument,	0,	0},
+			{"impact",	required_argument,	0,	0},
+			{"desktop",	required_argument,	0,	0},
+			{"virtual-time",	no_argument,		0,	0},
+			{"audio",	required_argument,	0,	0},
+			{"audio-format",	required_argument,	0,	0},
+			{"x11grab",	no_argument,		0,	0},
+			{"synthetic",	required_argument,	0,	0},
+			{"soak",	required_argument,	0,	0},
+			{"soak-interval",	required_argument,	0,	0},
+			{"soak-csv",	required_argument,	0,	0},
+			{"serve",	required_argument,	0,	0},
+			{"archive",	required_argument,	0,	0},
+			{"restore",	required_argument,	0,	0},
+			{"replay",	required_argument,	0,	0},
+			{"replay-workers",	required_argument,	0,	0},
+			{"low-power",	no_argument,		0,	0},
+			{"pressure",	no_argument,		0,	0},
+			{"alloc-check",	required_argument,	0,	0},
+			{"no-output",	no_argument,		0,	0},
+			{"tiles",	no_argument,		0,	0},
+			{"split",	required_argument,	0,	0},
+			{"split-bg-fps",	required_argument,	0,	0},
+			{"convert",	required_argument,	0,	0},
+			{"phash",	required_argument,	0,	0},
+			{"find",	required_argument,	0,	0},
+			{"max-distance",	required_argument,	0,	0},
+			{"review",	required_argument,	0,	0},
+			{"review-cache",	required_argument,	0,	0},
+			{"stress",	required_argument,	0,	0},
+			{"stress-threads",	required_argument,	0,	0},
+			{"help",	no_argument,		0,	'h'},
+			{0,		0,			0,	0}
+		};
+
+		while(1) {
+			int	option_index = 0;
+			const int	c = getopt_long(argc, argv, "w:o:f:n:s:h", long_options, &option_index);
+			if(-1 == c)
+				break;
+			switch(c) {
+			case 0: {
+				const std::string	opt = long_options[option_index].name;
+				if(opt == "x11grab") s.useX11grab = true;
+				else if(opt == "audio") s.audio_source = optarg;
+				else if(opt == "audio-format") s.audio_format = optarg;
+				else if(opt == "desktop") s.desktop_tiles = optarg;
+				else if(opt == "virtual-time") s.virtualTime = true;
+				else if(opt == "synthetic") s.synthetic_size = optarg;
+				else if(opt == "follow-focus") s.followFocus = true;
+				else if(opt == "canvas") s.canvas_size = optarg;
+				else if(opt == "soak") s.soak_secs = std::atoi(optarg);
+				else if(opt == "soak-interval") s.soak_interval = std::atoi(optarg);
+				else if(opt == "soak-csv") s.soak_csv = optarg;
+				else if(opt == "serve") s.serve_addr = optarg;
+				else if(opt == "impact") {
+					s.impact_secs = std::atoi(optarg);
+					if(s.impact_secs < 0 || s.impact_secs > XCOMPGRAB_MAX_IMPACT_BASELINE)
+						throw std::runtime_error("Invalid impact value, please specify 0 to " + std::to_string(XCOMPGRAB_MAX_IMPACT_BASELINE) + " seconds");
+				}
+				else if(opt == "archive") s.archive_dir = optarg;
+				else if(opt == "restore") s.restore_file = optarg;
+				else if(opt == "replay") s.replay_secs = std::max(1, std::atoi(optarg));
+				else if(opt == "replay-workers") s.replay_workers = std::max(1, std::atoi(optarg));
+				else if(opt == "low-power") s.lowPower = true;
+				else if(opt == "pressure") s.adaptPressure = true;
+				else if(opt == "alloc-check") s.alloc_check_frames = std::max(1, std::atoi(optarg));
+				else if(opt == "no-output") s.writeOutput = false;
+				else if(opt == "tiles") s.useTiles = true;
+				else if(opt == "split") s.split_region = optarg;
+				else if(opt == "split-bg-fps") s.split_bg_fps = std::max(1, std::atoi(optarg));
+				else if(opt == "convert") s.convert_file = optarg;
+				else if(opt == "phash") s.phash_secs = std::max(0, std::atoi(optarg));
+				else if(opt == "find") s.find_image = optarg;
+				else if(opt == "max-distance") s.max_distance = std::max(0, std::atoi(optarg));
+				else if(opt == "review") s.review_file = optarg;
+				else if(opt == "review-cache") s.review_cache = std::max(1, std::atoi(optarg));
+				else if(opt == "stress") s.stress_secs = std::max(1, std::atoi(optarg));
+				else if(opt == "stress-threads") s.stress_threads = std::max(2, std::atoi(optarg));
+				else if(opt == "pool-size") s.pool_size = std::max(2, std::atoi(optarg));
+				else if(opt == "scale-threads") s.scale_threads = std::max(1, std::atoi(optarg));
+				else if(opt == "exec-threads") s.exec_threads = std::max(1, std::atoi(optarg));
+				else if(opt == "numa-node") {
+					if(!numa_utils::available())
+						std::cerr << "NUMA is not available, ignoring --numa-node" << std::endl;
+					else if(std::string("auto") == optarg)
+						s.numa_node = numa_utils::current_node();
+					else
+						s.numa_node = std::atoi(optarg);
+				}
+			} break;
+			case 'w':
+				s.window_name = optarg;
+				break;
+			case 'o':
+				s.outfile = optarg;
+				break;
+			case 'f':
+				s.fps = std::atoi(optarg);
+				if(s.fps <= 0)
+					throw std::runtime_error("Invalid fps value");
+				break;
+			case 'n':
+				s.max_frames = std::atoi(optarg);
+				break;
+			case 's':
+				if(av_parse_video_size(&s.out_width, &s.out_height, optarg) < 0)
+					throw std::runtime_error("Invalid output size, please specify as WxH");
+				break;
+			case 'h':
+				print_help(argv[0]);
+				std::exit(0);
+			default:
+				throw std::runtime_error("Invalid option, please run with -h for help");
+			}
+		}
+		// with --find arguments are paths, otherwise for
+		// backwards compatibility, the first non option
+		// argument is the window name
+		if(!s.find_image.empty())
+			s.find_paths.assign(argv + optind, argv + argc);
+		else if(optind < argc)
+			s.window_name = argv[optind];
+		if(s.soak_secs > 0)
+			s.max_frames = s.soak_secs*s.fps;
+		if(s.alloc_check_frames > 0)
+			s.max_frames = 2*s.fps + s.alloc_check_frames;
+		if(s.max_frames <= 0)
+			s.max_frames = 10*s.fps;
+	}
 }
 
 int main(int argc, char *argv[]) {
 	try {
 		using namespace utils;
 
+		settings	s;
+		parse_args(argc, argv, s);
 		// Initial setup
+		execpool::set_size(s.exec_threads);
 		av_register_all();
 		avdevice_register_all();
-		bool		useX11grab = false,
-				writeOutput = true;
+		if(!s.convert_file.empty()) {
+			// tile codec files start with their magic,
+			// anything else should be a split recording
+			uint32_t	magic = 0;
+			std::ifstream(s.convert_file, std::ios_base::binary).read((char*)&magic, sizeof(magic));
+			if(magic == tilecodec::MAGIC)
+				tilecodec::convert(s.convert_file.c_str(), s.outfile.c_str());
+			else
+				splitenc::convert(s.convert_file.c_str(), s.outfile.c_str());
+			return 0;
+		}
+		if(!s.restore_file.empty()) {
+			archive::restore(s.restore_file.c_str(), s.outfile.c_str());
+			return 0;
+		}
+		if(!s.find_image.empty()) {
+			phash::query(s.find_image.c_str(), s.find_paths, s.max_distance, std::cout);
+			return 0;
+		}
+		if(!s.review_file.empty()) {
+			review::run(s.review_file.c_str(), s.out_width, s.out_height, s.review_cache);
+			return 0;
+		}
+		if(s.stress_secs > 0)
+			return stress::run(s.stress_secs, s.stress_threads, std::cout) ? 1 : 0;
+		// capture happens on this thread, hence
+		// move it before any buffer is allocated
+		numa_utils::run_on_node(s.numa_node);
 		// fps value
-		const int	FPS = 60;
+		const int	FPS = s.fps;
 		AVFormatContext	*fctx_ = 0;
 		// HW decode sample https://ffmpeg.org/doxygen/3.4/hw__decode_8c_source.html
-		if(useX11grab) {
+		if(!s.synthetic_size.empty()) {
+			auto*	lavfiformat = av_find_input_format("lavfi");
+			if(!lavfiformat)
+				throw std::runtime_error("av_find_input_format - can't find 'lavfi'");
+			// 'realtime' paces frames as a real capture would,
+			// testsrc2 timestamps are virtual already
+			const std::string	graph = "testsrc2=size=" + s.synthetic_size + ":rate=" + std::to_string(FPS) + ",format=rgba" + (s.virtualTime ? "" : ",realtime");
+			averror(avformat_open_input(&fctx_, graph.c_str(), lavfiformat, 0));
+		} else if(s.useX11grab) {
+			if(s.virtualTime)
+				throw std::runtime_error("--virtual-time can't be used with --x11grab");
 			auto*	x11format = av_find_input_format("x11grab");
 			if(!x11format)
 				throw std::runtime_error("av_find_input_format - can't find 'x11grab'");
@@ -64,6 +415,15 @@ int main(int argc, char *argv[]) {
 			averror(avformat_open_input(&fctx_, ":0.0", x11format, &opt));
 			// this is not great... but still
 			av_dict_free(&opt);
+		} else if(!s.desktop_tiles.empty()) {
+			// open xshmgrab
+			AVDictionary	*opt = 0;
+			av_dict_set(&opt, "framerate", std::to_string(FPS).c_str(), 0);
+			if(s.desktop_tiles != "auto")
+				av_dict_set(&opt, "tiles", s.desktop_tiles.c_str(), 0);
+			av_dict_set_int(&opt, "virtual_time", s.virtualTime, 0);
+			averror(avformat_open_input(&fctx_, "", &ff_xshmgrab_demuxer, &opt));
+			av_dict_free(&opt);
 		} else {
 			auto*	xcompformat = &ff_xcompgrab_demuxer;
 			if(!xcompformat)
@@ -71,8 +431,19 @@ int main(int argc, char *argv[]) {
 			// open xcompgrab
 			AVDictionary	*opt = 0;
 			av_dict_set(&opt, "framerate", std::to_string(FPS).c_str(), 0);
-			av_dict_set(&opt, "window_name", (argc > 1) ? argv[1] : "Firefox", 0);
-			av_dict_set_int(&opt, "framebuf_type", 2, 0);
+			av_dict_set(&opt, "window_name", s.window_name.c_str(), 0);
+			// frames are read straight into the
+			// pipeline pool, no demuxer buffers
+			av_dict_set_int(&opt, "framebuf_type", 0, 0);
+			av_dict_set_int(&opt, "numa_node", s.numa_node, 0);
+			av_dict_set_int(&opt, "follow_focus", s.followFocus, 0);
+			av_dict_set_int(&opt, "virtual_time", s.virtualTime, 0);
+			if(!s.canvas_size.empty())
+				av_dict_set(&opt, "canvas_size", s.canvas_size.c_str(), 0);
+			if(s.impact_secs >= 0) {
+				av_dict_set_int(&opt, "impact_monitor", 1, 0);
+				av_dict_set_int(&opt, "impact_baseline", s.impact_secs, 0);
+			}
 			averror(avformat_open_input(&fctx_, "", xcompformat, &opt));
 			// this is not great... but still
 			av_dict_free(&opt);
@@ -93,59 +464,220 @@ int main(int argc, char *argv[]) {
 		}
 		if(-1 == vstream)
 			throw std::runtime_error("Can't find video stream");
-		// find and initialize the decoder
-		auto*	dec = avcodec_find_decoder(fctx->streams[vstream]->codecpar->codec_id);
-		if(!dec)
-			throw std::runtime_error("Can't find decoder");
+		// xcompgrab and xshmgrab write directly into the
+		// pipeline pool, other sources go through the decoder
+		const bool		direct_capture = s.synthetic_size.empty() && !s.useX11grab;
+		int			(*read_direct)(AVFormatContext*, AVFrame*) = s.desktop_tiles.empty() ? xcompgrab_read_frame : xshmgrab_read_frame;
+		const AVCodecParameters	*vpar = fctx->streams[vstream]->codecpar;
 		// embed in a unique_ptr to leverage RAII
-		std::unique_ptr<AVCodecContext, void(*)(AVCodecContext*)>	ccodec(avcodec_alloc_context3(dec), [](AVCodecContext* p){ if(p) {avcodec_free_context(&p);} });
-		if(!ccodec.get())
-			throw std::runtime_error("avcodec_alloc_context3");
-		averror(avcodec_parameters_to_context(ccodec.get(), fctx->streams[vstream]->codecpar));
-		// initialize the decoder
-		averror(avcodec_open2(ccodec.get(), dec, 0));
-		// TODO need to understand why one should
-		// allocate a new AVCodecContext and not
-		// use the existing one...
-		// Even the example at https://ffmpeg.org/doxygen/trunk/doc_2examples_2filtering_video_8c-example.html
-		// still use the deprecated member...
-		//averror(avcodec_open2(fctx->streams[vstream]->codec, dec, 0));
+		std::unique_ptr<AVCodecContext, void(*)(AVCodecContext*)>	ccodec(0, [](AVCodecContext* p){ if(p) {avcodec_free_context(&p);} });
+		if(!direct_capture) {
+			// find and initialize the decoder
+			auto*	dec = avcodec_find_decoder(vpar->codec_id);
+			if(!dec)
+				throw std::runtime_error("Can't find decoder");
+			ccodec.reset(avcodec_alloc_context3(dec));
+			if(!ccodec.get())
+				throw std::runtime_error("avcodec_alloc_context3");
+			averror(avcodec_parameters_to_context(ccodec.get(), vpar));
+			// initialize the decoder
+			averror(avcodec_open2(ccodec.get(), dec, 0));
+			// TODO need to understand why one should
+			// allocate a new AVCodecContext and not
+			// use the existing one...
+			// Even the example at https://ffmpeg.org/doxygen/trunk/doc_2examples_2filtering_video_8c-example.html
+			// still use the deprecated member...
+			//averror(avcodec_open2(fctx->streams[vstream]->codec, dec, 0));
+		}
 		// try to read n frames
-		const int	MAX_FRAMES = 10*FPS;
+		const int	MAX_FRAMES = s.max_frames;
 		int		cur_frame = 0;
 		AVPacket	packet = {0};
 		// structures to share data between threads
 		// the 'screen-reader' (main) and output 'writer'
-		concurrent_deque<frame_holder*>	c_deq;
-		frame_buffers			frame_bufs(128);
-		std::unique_ptr<writer::iface>	cur_writer(writer::init(writer::params{FPS, ccodec.get()}, c_deq));
+		// holders are bounded by the pool, hence
+		// the queue never has to grow
+		concurrent_deque<frame_holder*>	c_deq(s.pool_size);
+		// pool frames are preallocated only when
+		// captured directly, decoded ones come
+		// with their own buffers
+		std::unique_ptr<frame_buffers>	pool(direct_capture ? new frame_buffers(s.pool_size, vpar->width, vpar->height, (AVPixelFormat)vpar->format, s.numa_node)
+							: new frame_buffers(s.pool_size));
+		frame_buffers&			frame_bufs = *pool;
+		// live stream server, has to outlive the writer
+		std::unique_ptr<writer::packet_sink>	server(s.serve_addr.empty() ? 0 : fanout::init(s.serve_addr.c_str()));
+		std::vector<writer::packet_sink*>	sinks;
+		const bool			useSplit = !s.split_region.empty();
+		if(useSplit && s.useTiles)
+			throw std::runtime_error("--split can't be used with --tiles");
+		if(server) {
+			if(s.useTiles || useSplit)
+				throw std::runtime_error("--serve can't be used with --tiles or --split");
+			sinks.push_back(server.get());
+		}
+		// archive, named after the output file
+		std::unique_ptr<writer::packet_sink>	archiver;
+		if(!s.archive_dir.empty()) {
+			if(s.useTiles || useSplit)
+				throw std::runtime_error("--archive can't be used with --tiles or --split");
+			std::string	name = s.outfile.substr(s.outfile.rfind('/') + 1);
+			name = name.substr(0, name.rfind('.'));
+			archiver.reset(archive::init(s.archive_dir.c_str(), name.c_str()));
+			sinks.push_back(archiver.get());
+		}
+		// instant replay, saves are triggered by SIGUSR1
+		std::unique_ptr<replay::iface>		replayer;
+		if(s.replay_secs > 0) {
+			if(s.useTiles || useSplit)
+				throw std::runtime_error("--replay can't be used with --tiles or --split");
+			const size_t	dot = s.outfile.rfind('.'),
+					slash = s.outfile.rfind('/');
+			const std::string	prefix = ((dot != std::string::npos && (slash == std::string::npos || dot > slash)) ? s.outfile.substr(0, dot) : s.outfile) + "-replay";
+			replayer.reset(replay::init(prefix.c_str(), s.replay_secs, s.replay_workers));
+			sinks.push_back(replayer.get());
+			struct sigaction	sa = {};
+			sa.sa_handler = [](int) { replay::request_save(); };
+			sa.sa_flags = SA_RESTART;
+			sigemptyset(&sa.sa_mask);
+			if(sigaction(SIGUSR1, &sa, 0))
+				throw std::runtime_error("Can't install SIGUSR1 handler");
+			std::cout << "Instant replay of the last " << s.replay_secs << " s, save with 'kill -USR1 " << getpid() << "'" << std::endl;
+		}
+		// audio, captured on its own thread
+		std::unique_ptr<audio::iface>	audio_in;
+		if(!s.audio_source.empty()) {
+			if(s.useTiles || useSplit)
+				throw std::runtime_error("--audio can't be used with --tiles or --split");
+			if(s.virtualTime)
+				throw std::runtime_error("--audio can't be used with --virtual-time");
+			audio_in.reset(audio::init(s.audio_format.c_str(), s.audio_source.c_str()));
+		}
+		writer::controls		w_controls;
+		const writer::params		w_params = { FPS, vpar->width, vpar->height, (AVPixelFormat)vpar->format, s.outfile.c_str(),
+							s.out_width ? s.out_width : vpar->width, s.out_height ? s.out_height : vpar->height, s.scale_threads, s.numa_node, sinks, s.adaptPressure ? &w_controls : 0, s.phash_secs*FPS, audio_in.get() };
+		std::unique_ptr<writer::iface>	cur_writer(s.useTiles ? tilecodec::init(w_params, c_deq)
+							: (useSplit ? splitenc::init(w_params, splitenc::parse_region(s.split_region.c_str()), s.split_bg_fps, c_deq) : writer::init(w_params, c_deq)));
+		stats::value&			frame_bufs_hwm = stats::get("pool.frame_holders_hwm");
+		// soak monitor, if requested
+		std::unique_ptr<soak::monitor>	soak_mon;
+		if(s.soak_secs > 0) {
+			soak_mon.reset(new soak::monitor(s.soak_interval, s.soak_csv.c_str()));
+			soak_mon->add_probe("queue_depth", [&c_deq]() -> int64_t { return c_deq.size(); });
+			soak_mon->add_probe("frame_holders_used", [&frame_bufs]() -> int64_t { return frame_bufs.in_use(); });
+			soak_mon->add_probe("frame_holders_hwm", [&frame_bufs_hwm]() -> int64_t { return frame_bufs_hwm.get(); });
+			soak_mon->add_histogram("latency.capture_to_encode_us");
+			if(audio_in)
+				soak_mon->add_histogram("latency.audio_capture_to_mux_us");
+			soak_mon->start();
+		}
+		// host pressure adaptation, if requested
+		std::unique_ptr<pressure::monitor>	pressure_mon;
+		if(s.adaptPressure) {
+			if(s.useTiles || useSplit)
+				std::cerr << "--pressure only shrinks the frame pool with --tiles or --split" << std::endl;
+			pressure_mon.reset(new pressure::monitor(frame_bufs, w_controls));
+			// the replay ring is the other big holder
+			if(replayer)
+				pressure_mon->add_memory_callback([&replayer](const bool high) { replayer->set_low_memory(high); });
+			pressure_mon->start();
+		}
 		cur_writer->start();
+		if(audio_in)
+			audio_in->start();
+		// in low power mode frames are handed over in
+		// batches, one wakeup each; at least one holder
+		// has to stay free for the capture
+		const size_t			batch_size = s.lowPower ? std::min((size_t)4, frame_bufs.size() - 1) : 1;
+		std::vector<frame_holder*>	batch;
+		batch.reserve(batch_size);
+		// sleeps until a frame is available
+		stats::value&	pool_waits = stats::get("pool.waits");
+		auto	get_frame_holder = [&]() -> frame_holder* {
+			auto*		cur_fh = frame_bufs.get_one();
+			if(!cur_fh) {
+				pool_waits.add();
+				// low power batches and virtual time drain
+				// the pool on purpose, pool.waits counts it
+				if(!s.lowPower && !s.virtualTime) std::cout << "Had to wait for a free frame..." << std::endl;
+				// the writer can only release what
+				// it got (i.e. the pool was shrunk)
+				c_deq.push_n(batch.data(), batch.size());
+				batch.clear();
+				cur_fh = frame_bufs.wait_one();
+			}
+			frame_bufs_hwm.max(frame_bufs.in_use());
+			return cur_fh;
+		};
+		if(s.lowPower) {
+			// let the kernel coalesce our timer
+			// with other wakeups (in ns)
+			prctl(PR_SET_TIMERSLACK, 500*1000UL, 0, 0, 0);
+		}
+		struct rusage	ru_start;
+		getrusage(RUSAGE_SELF, &ru_start);
+		const int64_t	time_start = av_gettime_relative();
+		const int	alloc_check_start = s.alloc_check_frames ? MAX_FRAMES - s.alloc_check_frames : -1;
+		auto	on_frame = [&](frame_holder* cur_fh) {
+			cur_fh->ts = av_gettime_relative();
+			cur_frame++;
+			if(cur_frame == alloc_check_start)
+				alloc_check::arm(true);
+			else if(alloc_check_start > 0 && cur_frame == MAX_FRAMES)
+				alloc_check::arm(false);
+			if(!s.lowPower) {
+				std::printf("Frame %d\r", cur_frame);
+				std::fflush(stdout);
+			}
+			if(!s.writeOutput) {
+				cur_fh->release();
+				return;
+			}
+			batch.push_back(cur_fh);
+			if(batch.size() == batch_size) {
+				c_deq.push_n(&batch[0], batch.size());
+				batch.clear();
+			}
+		};
+		alloc_check::set_stage(alloc_check::CAPTURE);
+		if(direct_capture) {
+			while(cur_frame < MAX_FRAMES) {
+				auto*	cur_fh = get_frame_holder();
+				int	rv = 0;
+				{
+					alloc_check::scope	as(alloc_check::BACKEND);
+					rv = read_direct(fctx.get(), cur_fh->frame.get());
+				}
+				if(rv < 0) {
+					cur_fh->release();
+					averror(rv);
+				}
+				on_frame(cur_fh);
+			}
+		}
 		// embed in a unique_ptr to leverage RAII
-		while(av_read_frame(fctx.get(), &packet) >= 0) {
+		while(!direct_capture) {
+			{
+				alloc_check::scope	as(alloc_check::LIBAV);
+				if(av_read_frame(fctx.get(), &packet) < 0)
+					break;
+			}
 			if(vstream == packet.stream_index) {
 				//ppm_write(fctx->streams[vstream], packet, cur_frame);
-				averror(avcodec_send_packet(ccodec.get(), &packet));
+				{
+					alloc_check::scope	as(alloc_check::LIBAV);
+					averror(avcodec_send_packet(ccodec.get(), &packet));
+				}
 				while(1) {
-					// get a frame
-					auto*		cur_fh = frame_bufs.get_one();
-					int		iter = 0;
-					while(!cur_fh) {
-						++iter;
-						std::this_thread::yield();
-						cur_fh = frame_bufs.get_one();
-					}
-					if(iter) std::cout << "Had to wait: " << iter << " iterations..." << std::endl;
-					const int	rv = avcodec_receive_frame(ccodec.get(), cur_fh->frame.get());
-					if(!rv) {
-						cur_frame++;
-						std::printf("Frame %d\r", cur_frame);
-						std::fflush(stdout);
-						if(writeOutput) c_deq.push(cur_fh);
-						else {
-							av_frame_unref(cur_fh->frame.get());
-							cur_fh->release();
-						}
+					// the decoder replaces the frame
+					// buffers with its own references
+					auto*		cur_fh = get_frame_holder();
+					int		rv = 0;
+					{
+						alloc_check::scope	as(alloc_check::LIBAV);
+						rv = avcodec_receive_frame(ccodec.get(), cur_fh->frame.get());
 					}
+					if(!rv)
+						on_frame(cur_fh);
 					if(AVERROR(EAGAIN) == rv) {
 						cur_fh->release();
 						break;
@@ -157,8 +689,44 @@ int main(int argc, char *argv[]) {
 			if(cur_frame >= MAX_FRAMES)
 				break;
 		}
-		// join the writer
+		// partial batch, then join the writer
+		c_deq.push_n(batch.data(), batch.size());
 		cur_writer->stop();
+		if(audio_in)
+			audio_in->stop();
+		// each voluntary context switch is a sleep,
+		// hence a later wakeup
+		struct rusage	ru_end;
+		getrusage(RUSAGE_SELF, &ru_end);
+		const double	elapsed_s = (av_gettime_relative() - time_start)/1000000.0;
+		if(elapsed_s > 0.0) {
+			const int64_t	wakeups = ru_end.ru_nvcsw - ru_start.ru_nvcsw;
+			stats::get("power.wakeups_per_sec").set(wakeups/elapsed_s);
+			std::cout << "Wakeups: " << wakeups/elapsed_s << "/s (" << wakeups/elapsed_s/s.fps << " per frame)" << std::endl;
+		}
+		if(pressure_mon)
+			pressure_mon->stop();
+		XCompGrabImpact	imp;
+		if(direct_capture && s.desktop_tiles.empty() && s.impact_secs >= 0 && !xcompgrab_impact(fctx.get(), &imp)) {
+			stats::get("impact.baseline_fps").set(imp.baseline_fps);
+			stats::get("impact.capture_fps").set(imp.capture_fps);
+			stats::get("impact.capture_interval_p99_ms").set(imp.capture_p99_ms);
+			stats::get("impact.redirect_us").set(imp.redirect_us);
+			stats::get("impact.bind_avg_us").set(imp.bind_avg_us);
+			stats::get("impact.bind_max_us").set(imp.bind_max_us);
+			if(imp.baseline_fps > 0.0)
+				std::cout << "Impact: captured window went from " << imp.baseline_fps << " to " << imp.capture_fps << " fps ("
+					<< 100.0*(imp.baseline_fps - imp.capture_fps)/imp.baseline_fps << "% slower)" << std::endl;
+		}
+		alloc_check::set_stage(alloc_check::NONE);
+		stats::report(std::cout);
+		if(s.alloc_check_frames && alloc_check::report(std::cout, s.alloc_check_frames))
+			return 1;
+		if(soak_mon) {
+			soak_mon->stop();
+			if(soak_mon->report(std::cout))
+				return 1;
+		}
 	} catch(const std::exception& e) {
 		std::cerr << "Exception: " << e.what() << std::endl;
 	} catch(...) {
@@ -0,0 +1,101 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+#include "numa_utils.h"
+#include <numa.h> // libnuma-dev
+#include <numaif.h>
+#include <sched.h>
+#include <unistd.h>
+#include <cstdint>
+#include <stdexcept>
+#include <algorithm>
+#include <vector>
+
+namespace {
+	inline uintptr_t page_size(void) {
+		static const uintptr_t	ps = sysconf(_SC_PAGESIZE);
+		return ps;
+	}
+}
+
+bool numa_utils::available(void) {
+	static const bool	avail = (numa_available() >= 0);
+	return avail;
+}
+
+int numa_utils::current_node(void) {
+	if(!available())
+		return -1;
+	const int	cpu = sched_getcpu();
+	return (cpu < 0) ? -1 : numa_node_of_cpu(cpu);
+}
+
+void numa_utils::run_on_node(const int node) {
+	if(!available() || node < 0)
+		return;
+	if(numa_run_on_node(node))
+		throw std::runtime_error("numa_run_on_node failed, invalid node?");
+	numa_set_preferred(node);
+}
+
+void numa_utils::bind_memory(void* p, const size_t sz, const int node) {
+	if(!available() || node < 0 || !p)
+		return;
+	// mbind works on whole pages only
+	const uintptr_t	ps = page_size(),
+			start = ((uintptr_t)p + ps - 1) & ~(ps - 1),
+			end = ((uintptr_t)p + sz) & ~(ps - 1);
+	if(end <= start)
+		return;
+	std::vector<unsigned long>	mask(node/(8*sizeof(unsigned long)) + 1, 0);
+	mask[node/(8*sizeof(unsigned long))] |= 1UL << (node%(8*sizeof(unsigned long)));
+	// failure is not fatal, memory will
+	// simply be where it is
+	mbind((void*)start, end - start, MPOL_BIND, &mask[0], mask.size()*8*sizeof(unsigned long), MPOL_MF_MOVE);
+}
+
+int numa_utils::remote_pages_pct(const void* p, const size_t sz, const int node, const int max_pages) {
+	if(!available() || node < 0 || !p || !sz || max_pages <= 0)
+		return -1;
+	// on the stack, this is called from hot loops
+	const uintptr_t	MAX_SAMPLES = 256;
+	void		*pages[MAX_SAMPLES];
+	int		status[MAX_SAMPLES];
+	const uintptr_t	ps = page_size(),
+			start = (uintptr_t)p & ~(ps - 1),
+			n_pages = ((uintptr_t)p + sz - start + ps - 1)/ps,
+			n_samples = std::min((uintptr_t)max_pages, MAX_SAMPLES),
+			step = std::max((uintptr_t)1, (n_pages + n_samples - 1)/n_samples);
+	uintptr_t	n = 0;
+	for(uintptr_t i = 0; i < n_pages && n < n_samples; i += step, ++n) {
+		pages[n] = (void*)(start + i*ps);
+		status[n] = -1;
+	}
+	if(move_pages(0, n, pages, 0, status, 0))
+		return -1;
+	int	n_valid = 0,
+		n_remote = 0;
+	for(uintptr_t i = 0; i < n; ++i) {
+		// not yet faulted in pages are negative
+		if(status[i] < 0)
+			continue;
+		++n_valid;
+		if(status[i] != node)
+			++n_remote;
+	}
+	return n_valid ? (100*n_remote)/n_valid : -1;
+}
@@ -0,0 +1,53 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+#ifndef _NUMA_UTILS_H_
+#define _NUMA_UTILS_H_
+
+#include <cstddef>
+
+/* Thin layer on top of libnuma
+ * The placement policy is simple: all the stages
+ * touching frames (capture, writer and scaler threads)
+ * run on the same node and the buffers they share
+ * are bound to that node, so that frames never
+ * cross the interconnect.
+ * All functions are no-op when NUMA is not available
+ * or node is < 0.
+ */
+namespace numa_utils {
+	extern bool available(void);
+
+	// node of the CPU the calling thread is running on
+	extern int current_node(void);
+
+	// restricts the calling thread (and threads it
+	// will create) to the CPUs of 'node'
+	extern void run_on_node(const int node);
+
+	// binds already allocated memory to 'node', pages
+	// which have been touched already are migrated
+	extern void bind_memory(void* p, const size_t sz, const int node);
+
+	// returns the percentage (0-100) of the pages of
+	// [p, p+sz) which do not reside on 'node', sampling
+	// at most 'max_pages' (up to 256) pages; -1 if
+	// unknown. Doesn't allocate
+	extern int remote_pages_pct(const void* p, const size_t sz, const int node, const int max_pages = 64);
+}
+
+#endif //_NUMA_UTILS_H_
@@ -0,0 +1,187 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+
+#include "phash.h"
+#include "utils.h"
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <dirent.h>
+extern "C" {
+	#include <libavutil/time.h>
+}
+
+namespace {
+	bool ends_with(const std::string& s, const std::string& sfx) {
+		return s.size() >= sfx.size() && !s.compare(s.size() - sfx.size(), sfx.size(), sfx);
+	}
+
+	void collect(const std::string& path, std::vector<std::string>& out) {
+		struct stat	st;
+		if(stat(path.c_str(), &st))
+			return;
+		if(!S_ISDIR(st.st_mode)) {
+			out.push_back(ends_with(path, phash::EXT) ? path : path + phash::EXT);
+			return;
+		}
+		std::unique_ptr<DIR, int(*)(DIR*)>	dir(opendir(path.c_str()), closedir);
+		if(!dir)
+			return;
+		while(const struct dirent* de = readdir(dir.get())) {
+			const std::string	name = de->d_name;
+			if(name == "." || name == "..")
+				continue;
+			const std::string	cur = path + "/" + name;
+			if(ends_with(name, phash::EXT) || (!stat(cur.c_str(), &st) && S_ISDIR(st.st_mode)))
+				collect(cur, out);
+		}
+	}
+}
+
+uint64_t phash::dhash(const uint8_t* luma, const int linesize, const int w, const int h) {
+	const int	CELLS_X = 9,
+			CELLS_Y = 8,
+			MAX_SAMPLES = 16;
+	uint32_t	cells[CELLS_Y][CELLS_X];
+	for(int cy = 0; cy < CELLS_Y; ++cy) {
+		const int	y0 = cy*h/CELLS_Y,
+				y1 = std::max(y0 + 1, (cy + 1)*h/CELLS_Y),
+				sy = std::max(1, (y1 - y0)/MAX_SAMPLES);
+		for(int cx = 0; cx < CELLS_X; ++cx) {
+			const int	x0 = cx*w/CELLS_X,
+					x1 = std::max(x0 + 1, (cx + 1)*w/CELLS_X),
+					sx = std::max(1, (x1 - x0)/MAX_SAMPLES);
+			uint32_t	sum = 0,
+					n = 0;
+			for(int y = y0; y < y1 && y < h; y += sy) {
+				const uint8_t	*row = luma + y*linesize;
+				for(int x = x0; x < x1 && x < w; x += sx, ++n)
+					sum += row[x];
+			}
+			cells[cy][cx] = n ? sum/n : 0;
+		}
+	}
+	uint64_t	hash = 0;
+	for(int cy = 0; cy < CELLS_Y; ++cy)
+		for(int cx = 0; cx < CELLS_X - 1; ++cx)
+			hash = (hash << 1) | (cells[cy][cx] > cells[cy][cx + 1]);
+	return hash;
+}
+
+phash::index_writer::index_writer(const std::string& recording, const int w, const int h, const int fps, const int interval) : ostr_((recording + EXT).c_str(), std::ios_base::binary), interval_(std::max(1, interval)) {
+	if(!ostr_)
+		throw std::runtime_error("Can't open phash index for " + recording);
+	const file_header	hdr = { MAGIC, VERSION, w, h, fps, interval_ };
+	ostr_.write((const char*)&hdr, sizeof(hdr));
+}
+
+void phash::index_writer::add(const int64_t frame, const uint8_t* luma, const int linesize, const int w, const int h) {
+	if(frame%interval_)
+		return;
+	const entry	e = { frame, dhash(luma, linesize, w, h) };
+	ostr_.write((const char*)&e, sizeof(e));
+}
+
+uint64_t phash::hash_image(const char* file) {
+	using namespace utils;
+
+	AVFormatContext	*fctx_ = 0;
+	averror(avformat_open_input(&fctx_, file, 0, 0));
+	std::unique_ptr<AVFormatContext, void(*)(AVFormatContext*)>	fctx(fctx_, [](AVFormatContext* p){ if(p) avformat_close_input(&p); });
+	averror(avformat_find_stream_info(fctx.get(), 0));
+	const int	vstream = av_find_best_stream(fctx.get(), AVMEDIA_TYPE_VIDEO, -1, -1, 0, 0);
+	averror(vstream);
+	const AVCodecParameters	*par = fctx->streams[vstream]->codecpar;
+	auto*	dec = avcodec_find_decoder(par->codec_id);
+	if(!dec)
+		throw std::runtime_error("Can't find decoder");
+	std::unique_ptr<AVCodecContext, void(*)(AVCodecContext*)>	ccodec(avcodec_alloc_context3(dec), [](AVCodecContext* p){ if(p) avcodec_free_context(&p); });
+	if(!ccodec)
+		throw std::runtime_error("avcodec_alloc_context3");
+	averror(avcodec_parameters_to_context(ccodec.get(), par));
+	averror(avcodec_open2(ccodec.get(), dec, 0));
+	std::unique_ptr<AVFrame, void(*)(AVFrame*)>	frame(av_frame_alloc(), [](AVFrame* p){ if(p) av_frame_free(&p); }),
+							gray(av_frame_alloc(), [](AVFrame* p){ if(p) av_frame_free(&p); });
+	AVPacket	pkt;
+	av_init_packet(&pkt);
+	int		rv = AVERROR(EAGAIN);
+	while(AVERROR(EAGAIN) == rv) {
+		if(av_read_frame(fctx.get(), &pkt) < 0) {
+			averror(avcodec_send_packet(ccodec.get(), 0));
+		} else {
+			rv = (pkt.stream_index == vstream) ? avcodec_send_packet(ccodec.get(), &pkt) : 0;
+			av_packet_unref(&pkt);
+			averror(rv);
+		}
+		rv = avcodec_receive_frame(ccodec.get(), frame.get());
+	}
+	averror(rv);
+	// the recorded hashes are on luma, the
+	// range doesn't matter as only the sign of
+	// the differences is kept
+	gray->width = frame->width;
+	gray->height = frame->height;
+	gray->format = AV_PIX_FMT_GRAY8;
+	averror(av_frame_get_buffer(gray.get(), 32));
+	std::unique_ptr<SwsContext, void(*)(SwsContext*)>	sws(sws_getContext(frame->width, frame->height, (AVPixelFormat)frame->format, gray->width, gray->height, AV_PIX_FMT_GRAY8, SWS_POINT, 0, 0, 0), sws_freeContext);
+	if(!sws)
+		throw std::runtime_error("sws_getContext");
+	sws_scale(sws.get(), frame->data, frame->linesize, 0, frame->height, gray->data, gray->linesize);
+	return dhash(gray->data[0], gray->linesize[0], gray->width, gray->height);
+}
+
+void phash::find(const uint64_t hash, const std::vector<std::string>& paths, const int max_distance, std::vector<match>& out) {
+	std::vector<std::string>	files;
+	for(const auto& p : paths)
+		collect(p, files);
+	std::vector<entry>	entries;
+	for(const auto& f : files) {
+		std::ifstream	istr(f.c_str(), std::ios_base::binary);
+		file_header	hdr;
+		if(!istr.read((char*)&hdr, sizeof(hdr)) || hdr.magic != MAGIC || hdr.version != VERSION || hdr.fps <= 0)
+			continue;
+		istr.seekg(0, std::ios_base::end);
+		const size_t	n = ((size_t)istr.tellg() - sizeof(hdr))/sizeof(entry);
+		istr.seekg(sizeof(hdr));
+		entries.resize(n);
+		if(n && !istr.read((char*)&entries[0], n*sizeof(entry)))
+			continue;
+		const std::string	recording = f.substr(0, f.size() - (sizeof(EXT) - 1));
+		for(const auto& e : entries) {
+			const int	d = distance(hash, e.hash);
+			if(d <= max_distance)
+				out.push_back(match{ recording, (double)e.frame/hdr.fps, d });
+		}
+	}
+	std::stable_sort(out.begin(), out.end(), [](const match& a, const match& b) { return a.distance < b.distance; });
+}
+
+void phash::query(const char* image, const std::vector<std::string>& paths, const int max_distance, std::ostream& ostr) {
+	const size_t		MAX_PRINT = 50;
+	const uint64_t		hash = hash_image(image);
+	const int64_t		start = av_gettime_relative();
+	std::vector<match>	matches;
+	find(hash, paths, max_distance, matches);
+	ostr << "Found " << matches.size() << " frames within distance " << max_distance << " in " << (av_gettime_relative() - start)/1000.0 << " ms\n";
+	for(size_t i = 0; i < matches.size() && i < MAX_PRINT; ++i)
+		ostr << "  " << matches[i].distance << "\t" << matches[i].file << " @ " << matches[i].secs << " s\n";
+	if(matches.size() > MAX_PRINT)
+		ostr << "  ... " << matches.size() - MAX_PRINT << " more\n";
+	ostr << std::flush;
+}
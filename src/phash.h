@@ -0,0 +1,99 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+
+#ifndef _PHASH_H_
+#define _PHASH_H_
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <ostream>
+
+/* Perceptual hash index of recordings
+ * While recording, every 'interval' frames the writer
+ * computes a 64 bit difference hash (dHash) of the luma
+ * plane it already produces for the encoder and appends
+ * it to a sidecar file '<recording>.phash'.
+ * Similar looking frames have hashes with a small Hamming
+ * distance, hence a screenshot can be searched across
+ * any number of sidecars without decoding any video.
+ *
+ * Sidecar layout (native endianness):
+ *   file_header
+ *   entry*
+ */
+namespace phash {
+	const uint32_t	MAGIC = 0x48505052; // "RPPH"
+	const uint32_t	VERSION = 1;
+	const char	EXT[] = ".phash";
+
+	struct file_header {
+		uint32_t	magic;
+		uint32_t	version;
+		int32_t		width;
+		int32_t		height;
+		int32_t		fps;
+		int32_t		interval;
+	};
+
+	struct entry {
+		// frame number, from 0
+		int64_t		frame;
+		uint64_t	hash;
+	};
+
+	// dHash: the plane is box averaged into 9x8 cells
+	// (sampled, at most 16x16 pixels per cell), each bit
+	// is set when a cell is brighter than its right one
+	extern uint64_t dhash(const uint8_t* luma, const int linesize, const int w, const int h);
+
+	inline int distance(const uint64_t a, const uint64_t b) {
+		return __builtin_popcountll(a ^ b);
+	}
+
+	class index_writer {
+		std::ofstream	ostr_;
+		const int	interval_;
+	public:
+		index_writer(const std::string& recording, const int w, const int h, const int fps, const int interval);
+
+		// hashes frames which are a multiple of the
+		// interval, doesn't allocate
+		void add(const int64_t frame, const uint8_t* luma, const int linesize, const int w, const int h);
+	};
+
+	// hash of an image file (anything libav decodes)
+	extern uint64_t hash_image(const char* file);
+
+	struct match {
+		std::string	file;
+		double		secs;
+		int		distance;
+	};
+
+	// searches the sidecars of 'paths' (recordings, sidecars
+	// or directories, recursively) for frames within
+	// 'max_distance' of 'hash', best matches first
+	extern void find(const uint64_t hash, const std::vector<std::string>& paths, const int max_distance, std::vector<match>& out);
+
+	// runs find for 'image' and prints the matches
+	extern void query(const char* image, const std::vector<std::string>& paths, const int max_distance, std::ostream& ostr);
+}
+
+#endif //_PHASH_H_
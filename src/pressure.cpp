@@ -0,0 +1,180 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+#include "pressure.h"
+#include "stats.h"
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+	// returns the 'some avg10' of a PSI file
+	// in percent, -1 if not available
+	double psi_some_avg10(const char* file) {
+		std::ifstream	istr(file);
+		std::string	line;
+		while(std::getline(istr, line)) {
+			if(line.compare(0, 5, "some "))
+				continue;
+			const size_t	p = line.find("avg10=");
+			if(p == std::string::npos)
+				return -1.0;
+			return std::atof(line.c_str() + p + 6);
+		}
+		return -1.0;
+	}
+
+	// memory cgroup directory of this process, the v1
+	// memory controller if mounted, else the v2 one;
+	// empty if not found
+	std::string cgroup_dir(void) {
+		std::ifstream	istr("/proc/self/cgroup");
+		std::string	line,
+				v2;
+		while(std::getline(istr, line)) {
+			const size_t	p = line.find(':');
+			if(p == std::string::npos)
+				continue;
+			if(line.compare(p, 8, ":memory:") == 0)
+				return "/sys/fs/cgroup/memory" + line.substr(p + 8);
+			if(line.compare(0, 3, "0::") == 0)
+				v2 = "/sys/fs/cgroup" + line.substr(3);
+		}
+		return v2;
+	}
+
+	int64_t read_int64(const std::string& file) {
+		std::ifstream	istr(file);
+		std::string	v;
+		if(!(istr >> v) || v == "max")
+			return -1;
+		return std::atoll(v.c_str());
+	}
+
+	// percentage of the memory limit in use, -1 if unlimited
+	int cgroup_mem_pct(const std::string& dir) {
+		if(dir.empty())
+			return -1;
+		int64_t	max = read_int64(dir + "/memory.max"),
+			cur = read_int64(dir + "/memory.current");
+		if(max < 0 && cur < 0) {
+			// v1, 'unlimited' is a huge value
+			max = read_int64(dir + "/memory.limit_in_bytes");
+			cur = read_int64(dir + "/memory.usage_in_bytes");
+			if(max >= (1LL << 60))
+				max = -1;
+		}
+		if(max <= 0 || cur < 0)
+			return -1;
+		return (int)(100*cur/max);
+	}
+}
+
+pressure::monitor::monitor(utils::frame_buffers& pool, writer::controls& ctl) : pool_(pool), ctl_(ctl), cg_dir_(cgroup_dir()), mem_high_(false), io_high_(false), th_(0), run_(false) {
+	if(psi_some_avg10("/proc/pressure/memory") < 0.0)
+		std::cerr << "PSI not available (kernel without CONFIG_PSI?), only cgroup limits are watched" << std::endl;
+}
+
+void pressure::monitor::add_memory_callback(const memory_callback& cb) {
+	mem_cbs_.push_back(cb);
+}
+
+void pressure::monitor::sample(void) {
+	static stats::value	&s_mem = stats::get("pressure.memory_avg10_pct"),
+				&s_io = stats::get("pressure.io_avg10_pct"),
+				&s_cg = stats::get("pressure.cgroup_memory_pct"),
+				&s_limit = stats::get("pressure.pool_limit"),
+				&s_buffering = stats::get("pressure.buffering_packets"),
+				&s_bitrate = stats::get("pressure.bitrate_pct"),
+				&s_decisions = stats::get("pressure.decisions");
+	const double	mem = psi_some_avg10("/proc/pressure/memory"),
+			io = psi_some_avg10("/proc/pressure/io");
+	const int	cg = cgroup_mem_pct(cg_dir_);
+	s_mem.set(mem);
+	s_io.set(io);
+	s_cg.set(cg);
+	// memory
+	const bool	mem_high = mem_high_ ? (mem > MEM_THRESHOLD/2 || cg > CGROUP_MEM_THRESHOLD - 5)
+					: (mem > MEM_THRESHOLD || cg > CGROUP_MEM_THRESHOLD);
+	const size_t	limit = pool_.limit();
+	if(mem_high) {
+		// also trims frames which were busy last time
+		pool_.set_limit(std::max(std::min((size_t)MIN_POOL, limit), limit/2));
+		if(pool_.limit() != limit)
+			s_decisions.add();
+	} else if(limit < pool_.size()) {
+		pool_.set_limit(std::min(pool_.size(), limit*2));
+		s_decisions.add();
+	}
+	s_limit.set(pool_.limit());
+	if(mem_high != mem_high_)
+		for(auto& cb : mem_cbs_)
+			cb(mem_high);
+	// io, don't buffer in memory if
+	// memory is short as well
+	const bool	io_high = io_high_ ? (io > IO_THRESHOLD/2) : (io > IO_THRESHOLD),
+			buffering = io_high && !mem_high;
+	if(io_high != io_high_ || mem_high != mem_high_) {
+		ctl_.bitrate_pct = io_high ? IO_BITRATE_PCT : 100;
+		ctl_.buffer_packets = buffering;
+		s_decisions.add();
+		std::cerr << "Pressure: memory " << (mem_high ? "high" : "ok") << ", io " << (io_high ? "high" : "ok")
+			<< " (pool " << pool_.limit() << ", bitrate " << ctl_.bitrate_pct << "%"
+			<< (buffering ? ", buffering packets" : "") << ")" << std::endl;
+	}
+	s_buffering.set(ctl_.buffer_packets);
+	s_bitrate.set(ctl_.bitrate_pct);
+	mem_high_ = mem_high;
+	io_high_ = io_high;
+}
+
+void pressure::monitor::loop(void) {
+	std::unique_lock<std::mutex>	ul(mtx_);
+	while(run_) {
+		if(cv_.wait_for(ul, std::chrono::seconds(1), [this](){ return !run_; }))
+			break;
+		sample();
+	}
+}
+
+void pressure::monitor::start(void) {
+	if(th_)
+		throw std::runtime_error("already running");
+	run_ = true;
+	th_ = new std::thread(&pressure::monitor::loop, this);
+}
+
+void pressure::monitor::stop(void) {
+	if(!th_)
+		return;
+	{
+		std::lock_guard<std::mutex>	lg(mtx_);
+		run_ = false;
+		cv_.notify_all();
+	}
+	th_->join();
+	delete th_;
+	th_ = 0;
+}
+
+pressure::monitor::~monitor() {
+	stop();
+}
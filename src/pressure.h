@@ -0,0 +1,87 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+#ifndef _PRESSURE_H_
+#define _PRESSURE_H_
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "utils.h"
+#include "writer.h"
+
+/* Host pressure adaptation
+ * Samples Linux PSI (/proc/pressure/memory and io, 'some'
+ * avg10) and the memory limit of our cgroup (v1 or v2)
+ * every second and reacts:
+ * - memory pressure: halves the frame pool limit (down to
+ *   a minimum) and frees the trimmed frames, grows it back
+ *   once pressure is gone; other memory holders (i.e. the
+ *   replay ring) are told through callbacks
+ * - io pressure: lowers the encoder bitrate and, unless
+ *   memory is constrained too, keeps packets in memory
+ *   instead of writing them to disk
+ * States have hysteresis: entered above the threshold,
+ * left below half of it. Decisions go to 'pressure.*'
+ * stats.
+ */
+namespace pressure {
+	// called on the monitor thread when memory
+	// pressure starts (true) and ends (false)
+	typedef std::function<void(const bool)>	memory_callback;
+
+	class monitor {
+		utils::frame_buffers&	pool_;
+		writer::controls&	ctl_;
+		std::vector<memory_callback>	mem_cbs_;
+		std::string		cg_dir_;
+		bool			mem_high_,
+					io_high_;
+		std::thread		*th_;
+		std::mutex		mtx_;
+		std::condition_variable	cv_;
+		bool			run_;
+
+		void sample(void);
+		void loop(void);
+	public:
+		// thresholds, % of time some task stalled (avg10)
+		static const int	MEM_THRESHOLD = 10,
+					IO_THRESHOLD = 20,
+		// % of the cgroup memory.max in use
+					CGROUP_MEM_THRESHOLD = 90,
+		// the pool is never shrunk below this
+					MIN_POOL = 4,
+		// bitrate under io pressure, % of nominal
+					IO_BITRATE_PCT = 50;
+
+		monitor(utils::frame_buffers& pool, writer::controls& ctl);
+
+		// must be called before start
+		void add_memory_callback(const memory_callback& cb);
+
+		void start(void);
+		void stop(void);
+
+		~monitor();
+	};
+}
+
+#endif //_PRESSURE_H_
@@ -0,0 +1,275 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+
+#include "replay.h"
+#include "stats.h"
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <string>
+#include <stdexcept>
+#include <iostream>
+extern "C" {
+	#include <libavutil/time.h>
+}
+
+namespace {
+	typedef std::shared_ptr<AVPacket>		shared_packet;
+	typedef std::vector<shared_packet>		gop;
+	typedef std::shared_ptr<const gop>		shared_gop;
+
+	// set from signal handlers, hence a lock free
+	// counter not tied to any instance
+	std::atomic<int>	save_requests(0);
+
+	// references the encoder buffer, no copy
+	shared_packet make_shared_packet(const AVPacket* pkt) {
+		AVPacket	*p = av_packet_clone(pkt);
+		if(!p)
+			throw std::runtime_error("av_packet_clone failed");
+		return shared_packet(p, [](AVPacket* p){ av_packet_free(&p); });
+	}
+
+	struct clip {
+		std::vector<shared_gop>	gops;
+		// references of the GOP growing
+		// when the save was requested
+		gop			tail;
+		uint64_t		n;
+		int64_t			requested_us;
+	};
+
+	class impl : public replay::iface {
+		// requests beyond this are dropped, each
+		// queued clip holds its GOPs in memory
+		static const size_t	MAX_QUEUED = 32;
+
+		const std::string	prefix_;
+		const int		secs_;
+		// writer thread only
+		std::deque<shared_gop>	ring_;
+		gop			cur_;
+		size_t			ring_bytes_;
+		// set by the pressure monitor
+		std::atomic<bool>	low_memory_;
+		uint64_t		n_clips_;
+		int64_t			window_;
+		// set by on_stream, before any clip is queued
+		std::unique_ptr<AVCodecParameters, void(*)(AVCodecParameters*)>	par_;
+		AVRational		tb_;
+		// protected by mtx_
+		std::mutex		mtx_;
+		std::condition_variable	cv_;
+		std::deque<std::unique_ptr<clip> >	queue_;
+		bool			ended_;
+		std::vector<std::thread>	workers_;
+		stats::value		&saved_,
+					&dropped_,
+					&in_flight_,
+					&ring_bytes_stat_,
+					&trimmed_;
+		stats::histogram	&save_ms_;
+
+		static size_t gop_bytes(const gop& g) {
+			size_t	rv = 0;
+			for(const auto& p : g)
+				rv += p->size;
+			return rv;
+		}
+
+		void close_gop(void) {
+			if(cur_.empty())
+				return;
+			ring_.push_back(std::make_shared<const gop>(std::move(cur_)));
+			cur_.clear();
+		}
+
+		// drops the oldest GOPs as long as the
+		// rest still covers the window, or while
+		// over budget when memory is short
+		void trim(const int64_t latest_pts) {
+			while(ring_.size() > 1 && latest_pts - (*ring_[1])[0]->pts >= window_) {
+				ring_bytes_ -= gop_bytes(*ring_.front());
+				ring_.pop_front();
+			}
+			if(low_memory_.load(std::memory_order_relaxed)) {
+				while(!ring_.empty() && ring_bytes_ > replay::LOW_MEMORY_BYTES) {
+					ring_bytes_ -= gop_bytes(*ring_.front());
+					ring_.pop_front();
+					trimmed_.add();
+				}
+			}
+			ring_bytes_stat_.set(ring_bytes_);
+		}
+
+		void take_requests(void) {
+			const int	n = save_requests.exchange(0);
+			for(int i = 0; i < n; ++i) {
+				std::unique_ptr<clip>	c(new clip());
+				c->gops.assign(ring_.begin(), ring_.end());
+				c->tail = cur_;
+				c->n = n_clips_++;
+				c->requested_us = av_gettime_relative();
+				{
+					std::lock_guard<std::mutex>	lg(mtx_);
+					if(queue_.size() >= MAX_QUEUED) {
+						dropped_.add();
+						continue;
+					}
+					queue_.push_back(std::move(c));
+					in_flight_.add();
+				}
+				cv_.notify_one();
+			}
+		}
+
+		void write_clip(const clip& c) {
+			using namespace utils;
+
+			const std::string	outfile = prefix_ + "-" + std::to_string(c.n) + ".mkv";
+			AVFormatContext		*octx_ = 0;
+			averror(avformat_alloc_output_context2(&octx_, 0, 0, outfile.c_str()));
+			std::unique_ptr<AVFormatContext, void(*)(AVFormatContext*)>	octx(octx_, [](AVFormatContext* p){ if(p) { if(p->pb) avio_closep(&p->pb); avformat_free_context(p); } });
+			AVStream	*strm = avformat_new_stream(octx.get(), 0);
+			if(!strm)
+				throw std::runtime_error("avformat_new_stream");
+			averror(avcodec_parameters_copy(strm->codecpar, par_.get()));
+			strm->codecpar->codec_tag = 0;
+			strm->time_base = tb_;
+			if(!(octx->oformat->flags & AVFMT_NOFILE))
+				averror(avio_open2(&octx->pb, outfile.c_str(), AVIO_FLAG_WRITE, 0, 0));
+			averror(avformat_write_header(octx.get(), 0));
+			// clips start at 0, the first packet (a
+			// keyframe) has the lowest timestamps
+			const AVPacket	*first = c.gops.empty() ? (c.tail.empty() ? 0 : c.tail[0].get()) : (*c.gops[0])[0].get();
+			const int64_t	base = !first ? 0 : ((first->dts != AV_NOPTS_VALUE) ? std::min(first->dts, first->pts) : first->pts);
+			std::unique_ptr<AVPacket, void(*)(AVPacket*)>	pkt(av_packet_alloc(), [](AVPacket* p){ if(p) av_packet_free(&p); });
+			int64_t		n_packets = 0;
+			auto	write = [&](const AVPacket* src) {
+				// one more reference, the muxer
+				// may modify the packet fields
+				averror(av_packet_ref(pkt.get(), src));
+				if(pkt->pts != AV_NOPTS_VALUE)
+					pkt->pts -= base;
+				if(pkt->dts != AV_NOPTS_VALUE)
+					pkt->dts -= base;
+				pkt->stream_index = strm->index;
+				av_packet_rescale_ts(pkt.get(), tb_, strm->time_base);
+				const int	rv = av_write_frame(octx.get(), pkt.get());
+				av_packet_unref(pkt.get());
+				averror(rv);
+				++n_packets;
+			};
+			for(const auto& g : c.gops)
+				for(const auto& p : *g)
+					write(p.get());
+			for(const auto& p : c.tail)
+				write(p.get());
+			averror(av_write_trailer(octx.get()));
+			save_ms_.record((av_gettime_relative() - c.requested_us)/1000);
+			saved_.add();
+			std::cout << "Saved replay clip '" << outfile << "' (" << n_packets << " packets)" << std::endl;
+		}
+
+		void loop(void) {
+			while(true) {
+				std::unique_ptr<clip>	c;
+				{
+					std::unique_lock<std::mutex>	ul(mtx_);
+					cv_.wait(ul, [this](){ return !queue_.empty() || ended_; });
+					if(queue_.empty())
+						return;
+					c = std::move(queue_.front());
+					queue_.pop_front();
+				}
+				// a failed clip doesn't stop the others
+				try {
+					write_clip(*c);
+				} catch(const std::exception& e) {
+					std::cerr << "[replay] Can't save clip " << c->n << ": " << e.what() << std::endl;
+				}
+				in_flight_.add(-1);
+			}
+		}
+	public:
+		impl(const char* prefix, const int secs, const int n_workers) : prefix_(prefix), secs_(secs), ring_bytes_(0), low_memory_(false), n_clips_(0), window_(0),
+		par_(avcodec_parameters_alloc(), [](AVCodecParameters* p){ if(p) avcodec_parameters_free(&p); }), tb_((AVRational){1, 1}), ended_(false),
+		saved_(stats::get("replay.saved")), dropped_(stats::get("replay.dropped")), in_flight_(stats::get("replay.in_flight")),
+		ring_bytes_stat_(stats::get("replay.ring_bytes")), trimmed_(stats::get("replay.trimmed_gops")), save_ms_(stats::get_histogram("replay.save_ms")) {
+			if(!par_)
+				throw std::runtime_error("avcodec_parameters_alloc");
+			for(int i = 0; i < std::max(1, n_workers); ++i)
+				workers_.push_back(std::thread([this](){ loop(); }));
+		}
+
+		void set_low_memory(const bool on) {
+			low_memory_.store(on, std::memory_order_relaxed);
+		}
+
+		void on_stream(const AVCodecContext* ocodec, const AVRational& time_base) {
+			utils::averror(avcodec_parameters_from_context(par_.get(), ocodec));
+			tb_ = time_base;
+			window_ = av_rescale_q(secs_, (AVRational){1, 1}, time_base);
+		}
+
+		void on_packet(const AVPacket* pkt) {
+			// the encoder uses closed GOPs, a clip
+			// can start at any keyframe
+			if(pkt->flags & AV_PKT_FLAG_KEY)
+				close_gop();
+			// the first packets may precede any keyframe
+			if(!cur_.empty() || (pkt->flags & AV_PKT_FLAG_KEY)) {
+				cur_.push_back(make_shared_packet(pkt));
+				ring_bytes_ += pkt->size;
+			}
+			if(pkt->pts != AV_NOPTS_VALUE)
+				trim(pkt->pts);
+			take_requests();
+		}
+
+		void on_end(void) {
+			take_requests();
+			{
+				std::lock_guard<std::mutex>	lg(mtx_);
+				ended_ = true;
+			}
+			cv_.notify_all();
+		}
+
+		~impl() {
+			on_end();
+			// queued clips are written before leaving
+			for(auto& w : workers_)
+				w.join();
+			if(saved_.get() || dropped_.get())
+				std::cout << "Saved " << saved_.get() << " replay clips (" << dropped_.get() << " dropped, too many in flight)" << std::endl;
+		}
+	};
+}
+
+replay::iface* replay::init(const char* prefix, const int secs, const int n_workers) {
+	return new impl(prefix, secs, n_workers);
+}
+
+void replay::request_save(void) {
+	save_requests.fetch_add(1, std::memory_order_relaxed);
+}
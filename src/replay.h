@@ -0,0 +1,58 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+#include "writer.h"
+
+/* Instant replay
+ * Keeps the last 'secs' seconds of the encoded stream
+ * as whole GOPs of refcounted packets. Saving a clip
+ * only takes references: the closed GOPs are shared
+ * (immutable) between the ring and all the clips being
+ * written, the growing one has its packet references
+ * copied; packet data is never copied.
+ * Saves are requested with request_save (async signal
+ * safe, i.e. from a SIGUSR1 handler), picked up by the
+ * writer on its next packet and written by a small pool
+ * of I/O threads, hence saves in quick succession are
+ * all in flight at once, each one covering its own
+ * window, and the writer never waits for them.
+ * Clips are written as '<prefix>-<n>.mkv'.
+ * Under memory pressure (see pressure.h) the ring is
+ * capped to LOW_MEMORY_BYTES, dropping the oldest GOPs,
+ * hence clips may be shorter than 'secs'.
+ */
+namespace replay {
+	const size_t	LOW_MEMORY_BYTES = 32*1024*1024;
+
+	class iface : public writer::packet_sink {
+	public:
+		// thread safe, applied by the writer
+		// on its next packet
+		virtual void set_low_memory(const bool on) = 0;
+	};
+
+	extern iface* init(const char* prefix, const int secs, const int n_workers);
+
+	// async signal safe
+	extern void request_save(void);
+}
+
+#endif //_REPLAY_H_
@@ -0,0 +1,308 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+
+#include "review.h"
+#include "stats.h"
+#include <list>
+#include <unordered_map>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+extern "C" {
+	#include <libavutil/time.h>
+}
+
+namespace {
+	typedef std::unique_ptr<AVFrame, void(*)(AVFrame*)>	frame_ptr;
+
+	frame_ptr make_frame(void) {
+		frame_ptr	f(av_frame_alloc(), [](AVFrame* p){ if(p) av_frame_free(&p); });
+		if(!f)
+			throw std::runtime_error("av_frame_alloc");
+		return f;
+	}
+
+	class impl : public review::iface {
+		struct entry {
+			int64_t		pts;
+			frame_ptr	frame;
+		};
+		typedef std::list<entry>	lru_list;
+
+		std::unique_ptr<AVFormatContext, void(*)(AVFormatContext*)>	fctx_;
+		std::unique_ptr<AVCodecContext, void(*)(AVCodecContext*)>	dec_;
+		SwsContext		*sws_;
+		int			vstream_,
+					out_w_,
+					out_h_;
+		AVRational		time_base_;
+		// frames in presentation order and index
+		// of the keyframe each one depends on
+		std::vector<int64_t>	pts_;
+		std::vector<size_t>	key_of_;
+		// most recently used first
+		const size_t		max_cached_;
+		lru_list		lru_;
+		std::unordered_map<int64_t, lru_list::iterator>	cache_;
+		frame_ptr		dec_frame_;
+		AVPacket		pkt_;
+		// last frame out of the decoder, -1 after a seek
+		int64_t			last_idx_;
+		bool			eof_;
+		stats::value		&hits_,
+					&misses_,
+					&decoded_,
+					&seeks_;
+		stats::histogram	&miss_us_;
+
+		void build_index(void) {
+			using namespace utils;
+
+			std::vector<std::pair<int64_t, bool> >	idx;
+			while(1) {
+				const int	rv = av_read_frame(fctx_.get(), &pkt_);
+				if(AVERROR_EOF == rv)
+					break;
+				averror(rv);
+				if(pkt_.stream_index == vstream_)
+					idx.push_back(std::make_pair((pkt_.pts != AV_NOPTS_VALUE) ? pkt_.pts : pkt_.dts, (pkt_.flags & AV_PKT_FLAG_KEY) != 0));
+				av_packet_unref(&pkt_);
+			}
+			if(idx.empty())
+				throw std::runtime_error("No video frames in the recording");
+			std::sort(idx.begin(), idx.end());
+			pts_.resize(idx.size());
+			key_of_.resize(idx.size());
+			size_t	cur_key = 0;
+			for(size_t i = 0; i < idx.size(); ++i) {
+				pts_[i] = idx[i].first;
+				if(idx[i].second)
+					cur_key = i;
+				key_of_[i] = cur_key;
+			}
+		}
+
+		void seek(const size_t key) {
+			utils::averror(av_seek_frame(fctx_.get(), vstream_, pts_[key], AVSEEK_FLAG_BACKWARD));
+			avcodec_flush_buffers(dec_.get());
+			last_idx_ = -1;
+			eof_ = false;
+			seeks_.add();
+		}
+
+		// converts the decoded frame into the cache,
+		// reusing the least recently used entry when full
+		lru_list::iterator cache(const int64_t pts) {
+			auto	it = cache_.find(pts);
+			if(it != cache_.end()) {
+				lru_.splice(lru_.begin(), lru_, it->second);
+				return lru_.begin();
+			}
+			if(lru_.size() >= max_cached_) {
+				lru_.splice(lru_.begin(), lru_, std::prev(lru_.end()));
+				cache_.erase(lru_.front().pts);
+			} else {
+				lru_.push_front(entry{ 0, make_frame() });
+				AVFrame	*f = lru_.front().frame.get();
+				f->format = AV_PIX_FMT_RGB24;
+				f->width = out_w_;
+				f->height = out_h_;
+				utils::averror(av_frame_get_buffer(f, 32));
+			}
+			AVFrame	*src = dec_frame_.get(),
+				*dst = lru_.front().frame.get();
+			sws_ = sws_getCachedContext(sws_, src->width, src->height, (AVPixelFormat)src->format, out_w_, out_h_, AV_PIX_FMT_RGB24, SWS_BILINEAR, 0, 0, 0);
+			if(!sws_)
+				throw std::runtime_error("sws_getCachedContext");
+			sws_scale(sws_, src->data, src->linesize, 0, src->height, dst->data, dst->linesize);
+			dst->pts = pts;
+			lru_.front().pts = pts;
+			cache_[pts] = lru_.begin();
+			return lru_.begin();
+		}
+
+		// decodes forward until frame 'idx' (or the
+		// first one past it) comes out of the decoder
+		AVFrame* decode_until(const size_t idx) {
+			using namespace utils;
+
+			while(1) {
+				int	rv = avcodec_receive_frame(dec_.get(), dec_frame_.get());
+				if(!rv) {
+					decoded_.add();
+					const int64_t	pts = dec_frame_->best_effort_timestamp;
+					const auto	it = std::lower_bound(pts_.begin(), pts_.end(), pts);
+					av_frame_unref(dec_frame_.get());
+					if(it == pts_.end() || *it != pts)
+						continue;
+					last_idx_ = it - pts_.begin();
+					AVFrame	*f = cache(pts)->frame.get();
+					if(last_idx_ >= (int64_t)idx)
+						return f;
+					continue;
+				}
+				if(AVERROR_EOF == rv)
+					throw std::runtime_error("Frame not found in the recording");
+				if(AVERROR(EAGAIN) != rv)
+					averror(rv);
+				rv = av_read_frame(fctx_.get(), &pkt_);
+				if(AVERROR_EOF == rv) {
+					// drain the decoder
+					eof_ = true;
+					averror(avcodec_send_packet(dec_.get(), 0));
+					continue;
+				}
+				averror(rv);
+				if(pkt_.stream_index == vstream_)
+					rv = avcodec_send_packet(dec_.get(), &pkt_);
+				av_packet_unref(&pkt_);
+				averror(rv);
+			}
+		}
+	public:
+		impl(const char* infile, const int out_w, const int out_h, const size_t cache_frames) : fctx_(0, [](AVFormatContext* p){ if(p) avformat_close_input(&p); }),
+		dec_(0, [](AVCodecContext* p){ if(p) avcodec_free_context(&p); }), sws_(0), vstream_(-1), out_w_(out_w), out_h_(out_h), max_cached_(std::max((size_t)1, cache_frames)),
+		dec_frame_(make_frame()), last_idx_(-1), eof_(false), hits_(stats::get("review.cache_hits")), misses_(stats::get("review.cache_misses")),
+		decoded_(stats::get("review.decoded_frames")), seeks_(stats::get("review.seeks")), miss_us_(stats::get_histogram("review.miss_us")) {
+			using namespace utils;
+
+			av_init_packet(&pkt_);
+			pkt_.data = 0;
+			pkt_.size = 0;
+			AVFormatContext	*fctx = 0;
+			averror(avformat_open_input(&fctx, infile, 0, 0));
+			fctx_.reset(fctx);
+			averror(avformat_find_stream_info(fctx, 0));
+			vstream_ = av_find_best_stream(fctx, AVMEDIA_TYPE_VIDEO, -1, -1, 0, 0);
+			averror(vstream_);
+			const AVStream	*st = fctx->streams[vstream_];
+			time_base_ = st->time_base;
+			auto*	dec = avcodec_find_decoder(st->codecpar->codec_id);
+			if(!dec)
+				throw std::runtime_error("Can't find decoder");
+			dec_.reset(avcodec_alloc_context3(dec));
+			if(!dec_)
+				throw std::runtime_error("avcodec_alloc_context3");
+			averror(avcodec_parameters_to_context(dec_.get(), st->codecpar));
+			// frame threading, as many threads as CPUs
+			dec_->thread_count = 0;
+			dec_->thread_type = FF_THREAD_FRAME;
+			averror(avcodec_open2(dec_.get(), dec, 0));
+			if(out_w_ <= 0 || out_h_ <= 0) {
+				out_w_ = st->codecpar->width;
+				out_h_ = st->codecpar->height;
+			}
+			cache_.reserve(max_cached_);
+			build_index();
+			seek(0);
+		}
+
+		virtual size_t size(void) const {
+			return pts_.size();
+		}
+
+		virtual double time_of(const size_t idx) const {
+			return (pts_[std::min(idx, pts_.size() - 1)] - pts_[0])*av_q2d(time_base_);
+		}
+
+		virtual size_t find(const double secs) const {
+			const int64_t	pts = pts_[0] + (int64_t)(secs/av_q2d(time_base_));
+			const auto	it = std::upper_bound(pts_.begin(), pts_.end(), pts);
+			return (it == pts_.begin()) ? 0 : (it - pts_.begin()) - 1;
+		}
+
+		virtual const AVFrame* get(const size_t idx) {
+			if(idx >= pts_.size())
+				throw std::runtime_error("Frame index out of range");
+			const auto	it = cache_.find(pts_[idx]);
+			if(it != cache_.end()) {
+				hits_.add();
+				lru_.splice(lru_.begin(), lru_, it->second);
+				return lru_.front().frame.get();
+			}
+			misses_.add();
+			const int64_t	start = av_gettime_relative();
+			// going forward within the same GOP (or
+			// to the next one) keeps on decoding,
+			// anything else restarts from the keyframe
+			if(eof_ || last_idx_ < 0 || (int64_t)idx <= last_idx_ || (int64_t)key_of_[idx] > last_idx_ + 1)
+				seek(key_of_[idx]);
+			const AVFrame	*f = decode_until(idx);
+			miss_us_.record(av_gettime_relative() - start);
+			return f;
+		}
+
+		~impl() {
+			av_packet_unref(&pkt_);
+			sws_freeContext(sws_);
+		}
+	};
+
+	void ppm_write(const AVFrame* f, const std::string& fname) {
+		std::ofstream	ppm(fname.c_str(), std::ios_base::binary);
+		ppm << "P6\n" << f->width << " " << f->height << "\n255\n";
+		for(int i = 0; i < f->height; ++i)
+			ppm.write((const char*)f->data[0] + i*f->linesize[0], f->width*3);
+		if(!ppm)
+			throw std::runtime_error("Can't write " + fname);
+	}
+}
+
+review::iface* review::init(const char* infile, const int out_w, const int out_h, const size_t cache_frames) {
+	return new impl(infile, out_w, out_h, cache_frames);
+}
+
+void review::run(const char* infile, const int out_w, const int out_h, const size_t cache_frames) {
+	std::unique_ptr<review::iface>	r(review::init(infile, out_w, out_h, cache_frames));
+	std::cout <<	"Reviewing '" << infile << "', " << r->size() << " frames, " << r->time_of(r->size() - 1) << " s\n"
+			"Commands: n (or empty) next, p previous, +N/-N step N frames,\n"
+			"g N go to frame N, t S go to S seconds, w [file] write frame\n"
+			"as PPM (default frame_N.ppm), q quit" << std::endl;
+	size_t		cur = 0;
+	std::string	line;
+	while(1) {
+		const int64_t	start = av_gettime_relative();
+		const AVFrame	*f = r->get(cur);
+		std::cout << "Frame " << cur << "/" << r->size() << " at " << r->time_of(cur) << " s, " << f->width << "x" << f->height
+			<< " (" << (av_gettime_relative() - start)/1000.0 << " ms)" << std::endl;
+		if(!std::getline(std::cin, line))
+			break;
+		std::istringstream	istr(line);
+		std::string		cmd;
+		istr >> cmd;
+		int64_t			next = cur;
+		if(cmd.empty() || cmd == "n") ++next;
+		else if(cmd == "p") --next;
+		else if(cmd[0] == '+' || cmd[0] == '-') next += std::atoll(cmd.c_str());
+		else if(cmd == "g") istr >> next;
+		else if(cmd == "t") {
+			double	secs = 0.0;
+			istr >> secs;
+			next = r->find(secs);
+		} else if(cmd == "w") {
+			std::string	fname = "frame_" + std::to_string(cur) + ".ppm";
+			istr >> fname;
+			ppm_write(f, fname);
+			std::cout << "Written " << fname << std::endl;
+		} else if(cmd == "q") break;
+		else std::cout << "Unknown command '" << cmd << "'" << std::endl;
+		cur = std::max((int64_t)0, std::min(next, (int64_t)r->size() - 1));
+	}
+	stats::report(std::cout);
+}
@@ -0,0 +1,55 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+
+#ifndef _REVIEW_H_
+#define _REVIEW_H_
+
+#include "utils.h"
+
+/* Random access to the frames of a recording
+ * On open the packets are scanned once (demux only) to
+ * build an index of the frames in presentation order and
+ * of their keyframes. A frame is then decoded seeking to
+ * its keyframe, or continuing from the last decoded frame
+ * when that is closer; every frame decoded on the way is
+ * converted to RGB24 (optionally downscaled) and kept in
+ * an LRU cache keyed by pts, hence stepping backwards
+ * within a GOP doesn't decode it again.
+ */
+namespace review {
+	class iface {
+	public:
+		// number of frames, in presentation order
+		virtual size_t size(void) const = 0;
+		// seconds from the start of frame 'idx'
+		virtual double time_of(const size_t idx) const = 0;
+		// index of the frame shown at 'secs'
+		virtual size_t find(const double secs) const = 0;
+		// RGB24 frame 'idx', valid until the next call
+		virtual const AVFrame* get(const size_t idx) = 0;
+		virtual ~iface() {}
+	};
+
+	// out_w/out_h 0 keep the recording size
+	extern iface* init(const char* infile, const int out_w, const int out_h, const size_t cache_frames);
+
+	// interactive stepping through 'infile' on stdin
+	extern void run(const char* infile, const int out_w, const int out_h, const size_t cache_frames);
+}
+
+#endif //_REVIEW_H_
@@ -0,0 +1,334 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+#include "scaler.h"
+#include "utils.h"
+#include "execpool.h"
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+	struct band_job {
+		virtual void rows(const int band, const int y0, const int y1) = 0;
+		virtual ~band_job() {}
+	};
+
+	class base_impl : public scaler::iface, public band_job {
+	protected:
+		// bands run on the shared pool
+		execpool::client	*pool_;
+		const int	n_bands_,
+				src_w_,
+				src_h_,
+				dst_w_,
+				dst_h_;
+		const uint8_t	*src_;
+		int		src_linesize_;
+		uint8_t		*dst_;
+		int		dst_linesize_;
+
+		static void run_band(void* p, const int b) {
+			base_impl	*s = (base_impl*)p;
+			const int	y0 = (int64_t)s->dst_h_*b/s->n_bands_,
+					y1 = (int64_t)s->dst_h_*(b+1)/s->n_bands_;
+			if(y0 < y1)
+				s->rows(b, y0, y1);
+		}
+	public:
+		base_impl(const int src_w, const int src_h, const int dst_w, const int dst_h, const int n_bands, execpool::client* pool) :
+			pool_(pool), n_bands_(std::min(std::max(n_bands, 1), dst_h)), src_w_(src_w), src_h_(src_h), dst_w_(dst_w), dst_h_(dst_h),
+			src_(0), src_linesize_(0), dst_(0), dst_linesize_(0) {
+		}
+
+		void scale(const uint8_t* src, const int src_linesize, uint8_t* dst, const int dst_linesize) {
+			src_ = src;
+			src_linesize_ = src_linesize;
+			dst_ = dst;
+			dst_linesize_ = dst_linesize;
+			pool_->run(n_bands_, &base_impl::run_band, this);
+		}
+	};
+
+	template<int K>
+	class box_impl : public base_impl {
+		void rows_generic(const int y0, const int y1) {
+			for(int y = y0; y < y1; ++y) {
+				const uint8_t * __restrict__	s = src_ + y*K*src_linesize_;
+				uint8_t * __restrict__		d = dst_ + y*dst_linesize_;
+				for(int x = 0; x < dst_w_; ++x) {
+					uint32_t	acc[4] = {0, 0, 0, 0};
+					for(int j = 0; j < K; ++j) {
+						const uint8_t	*p = s + j*src_linesize_ + x*K*4;
+						for(int i = 0; i < K*4; ++i)
+							acc[i&3] += p[i];
+					}
+					for(int c = 0; c < 4; ++c)
+						d[x*4 + c] = (acc[c] + K*K/2)/(K*K);
+				}
+			}
+		}
+
+#ifdef __SSE2__
+		// 2 destination pixels per iteration
+		void rows_sse2_2x(const int y0, const int y1) {
+			const __m128i	zero = _mm_setzero_si128(),
+					round = _mm_set1_epi16(2);
+			for(int y = y0; y < y1; ++y) {
+				const uint8_t	*s0 = src_ + y*2*src_linesize_,
+						*s1 = s0 + src_linesize_;
+				uint8_t		*d = dst_ + y*dst_linesize_;
+				int		x = 0;
+				for(; x + 2 <= dst_w_; x += 2) {
+					const __m128i	r0 = _mm_loadu_si128((const __m128i*)(s0 + x*8)),
+							r1 = _mm_loadu_si128((const __m128i*)(s1 + x*8)),
+							lo = _mm_add_epi16(_mm_unpacklo_epi8(r0, zero), _mm_unpacklo_epi8(r1, zero)),
+							hi = _mm_add_epi16(_mm_unpackhi_epi8(r0, zero), _mm_unpackhi_epi8(r1, zero)),
+							sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi)),
+							avg = _mm_srli_epi16(_mm_add_epi16(sum, round), 2);
+					_mm_storel_epi64((__m128i*)(d + x*4), _mm_packus_epi16(avg, zero));
+				}
+				for(; x < dst_w_; ++x) {
+					for(int c = 0; c < 4; ++c)
+						d[x*4 + c] = (s0[x*8 + c] + s0[x*8 + 4 + c] + s1[x*8 + c] + s1[x*8 + 4 + c] + 2) >> 2;
+				}
+			}
+		}
+
+		// 1 destination pixel per iteration
+		void rows_sse2_4x(const int y0, const int y1) {
+			const __m128i	zero = _mm_setzero_si128(),
+					round = _mm_set1_epi16(8);
+			for(int y = y0; y < y1; ++y) {
+				const uint8_t	*s = src_ + y*4*src_linesize_;
+				uint8_t		*d = dst_ + y*dst_linesize_;
+				for(int x = 0; x < dst_w_; ++x) {
+					__m128i	lo = zero,
+						hi = zero;
+					for(int j = 0; j < 4; ++j) {
+						const __m128i	r = _mm_loadu_si128((const __m128i*)(s + j*src_linesize_ + x*16));
+						lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(r, zero));
+						hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(r, zero));
+					}
+					__m128i	sum = _mm_add_epi16(lo, hi);
+					sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+					const __m128i	avg = _mm_srli_epi16(_mm_add_epi16(sum, round), 4);
+					const int	px = _mm_cvtsi128_si32(_mm_packus_epi16(avg, zero));
+					std::memcpy(d + x*4, &px, 4);
+				}
+			}
+		}
+
+		// 1 destination pixel per iteration, the last
+		// column is done in scalar code not to read
+		// past the end of the row
+		void rows_sse2_3x(const int y0, const int y1) {
+			const __m128i	zero = _mm_setzero_si128(),
+					round = _mm_set1_epi16(4),
+					// 65536/9 rounded up, exact for 0-2299
+					div9 = _mm_set1_epi16(7282),
+					mask_lo = _mm_set_epi32(0, 0, -1, -1);
+			for(int y = y0; y < y1; ++y) {
+				const uint8_t	*s = src_ + y*3*src_linesize_;
+				uint8_t		*d = dst_ + y*dst_linesize_;
+				for(int x = 0; x < dst_w_ - 1; ++x) {
+					__m128i	lo = zero,
+						hi = zero;
+					for(int j = 0; j < 3; ++j) {
+						const __m128i	r = _mm_loadu_si128((const __m128i*)(s + j*src_linesize_ + x*12));
+						lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(r, zero));
+						hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(r, zero));
+					}
+					__m128i	sum = _mm_add_epi16(lo, _mm_and_si128(hi, mask_lo));
+					sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+					const __m128i	avg = _mm_mulhi_epu16(_mm_add_epi16(sum, round), div9);
+					const int	px = _mm_cvtsi128_si32(_mm_packus_epi16(avg, zero));
+					std::memcpy(d + x*4, &px, 4);
+				}
+				const int	x = dst_w_ - 1;
+				for(int c = 0; c < 4; ++c) {
+					uint32_t	acc = 0;
+					for(int j = 0; j < 3; ++j)
+						for(int i = 0; i < 3; ++i)
+							acc += s[j*src_linesize_ + (x*3 + i)*4 + c];
+					d[x*4 + c] = (acc + 4)/9;
+				}
+			}
+		}
+#endif //__SSE2__
+	public:
+		box_impl(const int src_w, const int src_h, const int n_bands, execpool::client* pool) : base_impl(src_w, src_h, src_w/K, src_h/K, n_bands, pool) {
+		}
+
+		void rows(const int band, const int y0, const int y1) {
+#ifdef __SSE2__
+			if(K == 2) {
+				rows_sse2_2x(y0, y1);
+				return;
+			} else if(K == 3) {
+				rows_sse2_3x(y0, y1);
+				return;
+			} else if(K == 4) {
+				rows_sse2_4x(y0, y1);
+				return;
+			}
+#endif //__SSE2__
+			rows_generic(y0, y1);
+		}
+
+		const char* name(void) const {
+			static const char	n[] = { 'b', 'o', 'x', ' ', '0' + K, 'x', '\0' };
+			return n;
+		}
+	};
+
+	// fixed point (8 bits fraction) bilinear
+	// done in two passes: first each destination
+	// row is blended vertically in a per band
+	// temporary row, then horizontally
+	class bilinear_impl : public base_impl {
+		std::vector<int>			x0_,
+							fx_,
+							y0_,
+							y1_,
+							fy_;
+		std::vector<std::vector<uint8_t> >	tmp_;
+#ifdef __SSE2__
+		std::vector<int16_t>			wx_;
+#endif //__SSE2__
+
+		static void setup_axis(const int src, const int dst, std::vector<int>& v0, std::vector<int>* v1, std::vector<int>& f) {
+			v0.resize(dst);
+			f.resize(dst);
+			if(v1)
+				v1->resize(dst);
+			for(int i = 0; i < dst; ++i) {
+				// sample at pixel centers
+				const int64_t	pos = std::max((int64_t)0, ((2*i + 1)*(int64_t)src*256)/(2*dst) - 128);
+				v0[i] = std::min((int)(pos >> 8), src - 1);
+				f[i] = pos & 0xFF;
+				if(v1)
+					(*v1)[i] = std::min(v0[i] + 1, src - 1);
+			}
+		}
+
+		void vertical(const uint8_t* __restrict__ s0, const uint8_t* __restrict__ s1, const uint32_t fy, uint8_t* __restrict__ t) {
+			const int	n = src_w_*4;
+			int		i = 0;
+#ifdef __SSE2__
+			const __m128i	zero = _mm_setzero_si128(),
+					w0 = _mm_set1_epi16(256 - fy),
+					w1 = _mm_set1_epi16(fy),
+					round = _mm_set1_epi16(128);
+			for(; i + 16 <= n; i += 16) {
+				const __m128i	a = _mm_loadu_si128((const __m128i*)(s0 + i)),
+						b = _mm_loadu_si128((const __m128i*)(s1 + i)),
+						lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), w0), _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), w1)), round),
+						hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), w0), _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), w1)), round);
+				_mm_storeu_si128((__m128i*)(t + i), _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+			}
+#endif //__SSE2__
+			for(; i < n; ++i)
+				t[i] = (s0[i]*(256 - fy) + s1[i]*fy + 128) >> 8;
+			// replicate last pixel, so that horizontal
+			// pass can always read 2 adjacent pixels
+			std::memcpy(t + n, t + n - 4, 4);
+		}
+
+		void horizontal(const uint8_t* __restrict__ t, uint8_t* __restrict__ d) {
+#ifdef __SSE2__
+			const __m128i	zero = _mm_setzero_si128(),
+					round = _mm_set1_epi16(128);
+			for(int x = 0; x < dst_w_; ++x) {
+				const __m128i	p = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(t + x0_[x]*4)), zero),
+						m = _mm_mullo_epi16(p, _mm_loadu_si128((const __m128i*)&wx_[x*8])),
+						sum = _mm_add_epi16(_mm_add_epi16(m, _mm_srli_si128(m, 8)), round);
+				const int	px = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_srli_epi16(sum, 8), zero));
+				std::memcpy(d + x*4, &px, 4);
+			}
+#else
+			for(int x = 0; x < dst_w_; ++x) {
+				const uint32_t	fx = fx_[x];
+				const uint8_t	*p = t + x0_[x]*4;
+				for(int c = 0; c < 4; ++c)
+					d[x*4 + c] = (p[c]*(256 - fx) + p[4 + c]*fx + 128) >> 8;
+			}
+#endif //__SSE2__
+		}
+	public:
+		bilinear_impl(const int src_w, const int src_h, const int dst_w, const int dst_h, const int n_bands, execpool::client* pool) : base_impl(src_w, src_h, dst_w, dst_h, n_bands, pool) {
+			setup_axis(src_w, dst_w, x0_, 0, fx_);
+			setup_axis(src_h, dst_h, y0_, &y1_, fy_);
+#ifdef __SSE2__
+			// per column weights, 4 for left
+			// pixel and 4 for right one
+			for(const auto& fx : fx_)
+				for(int c = 0; c < 8; ++c)
+					wx_.push_back((c < 4) ? 256 - fx : fx);
+#endif //__SSE2__
+			// 1 pixel more for the replicated last one
+			// plus 8 bytes for the 64 bits loads
+			tmp_.resize(n_bands_, std::vector<uint8_t>((src_w + 1)*4 + 8));
+		}
+
+		void rows(const int band, const int y0, const int y1) {
+			uint8_t	*t = &tmp_[band][0];
+			for(int y = y0; y < y1; ++y) {
+				vertical(src_ + y0_[y]*src_linesize_, src_ + y1_[y]*src_linesize_, fy_[y], t);
+				horizontal(t, dst_ + y*dst_linesize_);
+			}
+		}
+
+		const char* name(void) const {
+			return "bilinear";
+		}
+	};
+}
+
+scaler::iface* scaler::init(const int src_w, const int src_h, const int dst_w, const int dst_h, const int n_bands, execpool::client* pool) {
+	if(src_w <= 0 || src_h <= 0 || dst_w <= 0 || dst_h <= 0)
+		throw std::runtime_error("Invalid scaler size");
+	if(dst_w > src_w || dst_h > src_h)
+		throw std::runtime_error("Scaler can only downscale");
+	if(dst_w*2 == src_w && dst_h*2 == src_h)
+		return new box_impl<2>(src_w, src_h, n_bands, pool);
+	if(dst_w*3 == src_w && dst_h*3 == src_h)
+		return new box_impl<3>(src_w, src_h, n_bands, pool);
+	if(dst_w*4 == src_w && dst_h*4 == src_h)
+		return new box_impl<4>(src_w, src_h, n_bands, pool);
+	return new bilinear_impl(src_w, src_h, dst_w, dst_h, n_bands, pool);
+}
+
+bool scaler::is_supported(const int pix_fmt) {
+	switch(pix_fmt) {
+	case AV_PIX_FMT_RGBA:
+	case AV_PIX_FMT_BGRA:
+	case AV_PIX_FMT_ARGB:
+	case AV_PIX_FMT_ABGR:
+	case AV_PIX_FMT_RGB0:
+	case AV_PIX_FMT_BGR0:
+	case AV_PIX_FMT_0RGB:
+	case AV_PIX_FMT_0BGR:
+		return true;
+	default:
+		break;
+	}
+	return false;
+}
@@ -0,0 +1,52 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+#ifndef _SCALER_H_
+#define _SCALER_H_
+
+#include <cstdint>
+
+namespace execpool {
+	class client;
+}
+
+/* CPU downscalers for packed 4 bytes per pixel
+ * frames (RGBA, BGR0, ...), channel order doesn't
+ * matter.
+ * When the source size is an exact 2x, 3x or 4x
+ * multiple of the destination a box (area) filter
+ * is used, otherwise a fixed point bilinear one.
+ * Work is split in horizontal bands, run on the
+ * shared execution pool.
+ */
+namespace scaler {
+	class iface {
+	public:
+		virtual void scale(const uint8_t* src, const int src_linesize, uint8_t* dst, const int dst_linesize) = 0;
+		virtual const char* name(void) const = 0;
+		virtual ~iface() {}
+	};
+
+	// bands are run as jobs of 'pool' (not owned), n_bands <= 1
+	// means scaling happens on the calling thread
+	extern iface* init(const int src_w, const int src_h, const int dst_w, const int dst_h, const int n_bands, execpool::client* pool);
+
+	// returns true if pix_fmt can be scaled by this module
+	extern bool is_supported(const int pix_fmt);
+}
+
+#endif //_SCALER_H_
@@ -0,0 +1,190 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+#include "soak.h"
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <stdexcept>
+#include <dirent.h>
+#include <unistd.h>
+
+namespace {
+	int64_t rss_kb(void) {
+		std::ifstream	statm("/proc/self/statm");
+		int64_t		size = 0,
+				resident = 0;
+		if(!(statm >> size >> resident))
+			return -1;
+		return resident*(sysconf(_SC_PAGESIZE)/1024);
+	}
+
+	int64_t open_fds(void) {
+		DIR	*d = opendir("/proc/self/fd");
+		if(!d)
+			return -1;
+		int64_t	rv = 0;
+		while(readdir(d))
+			++rv;
+		closedir(d);
+		// '.', '..' and the fd of opendir itself
+		return rv - 3;
+	}
+
+	double mean(const std::vector<int64_t>& v, const size_t from, const size_t to) {
+		if(to <= from)
+			return 0.0;
+		double	sum = 0.0;
+		for(size_t i = from; i < to; ++i)
+			sum += v[i];
+		return sum/(to - from);
+	}
+
+	// least squares slope of v over t
+	double slope(const std::vector<double>& t, const std::vector<int64_t>& v, const size_t from, const size_t to) {
+		const size_t	n = to - from;
+		if(n < 2)
+			return 0.0;
+		double	st = 0.0,
+			sv = 0.0,
+			stt = 0.0,
+			stv = 0.0;
+		for(size_t i = from; i < to; ++i) {
+			st += t[i];
+			sv += v[i];
+			stt += t[i]*t[i];
+			stv += t[i]*v[i];
+		}
+		const double	den = n*stt - st*st;
+		return (den > 0.0) ? (n*stv - st*sv)/den : 0.0;
+	}
+}
+
+soak::monitor::monitor(const int interval_s, const char* csv_file) : interval_s_(interval_s), th_(0), run_(false) {
+	if(interval_s_ <= 0)
+		throw std::runtime_error("Invalid soak sampling interval");
+	if(csv_file && *csv_file) {
+		csv_.open(csv_file);
+		if(!csv_)
+			throw std::runtime_error((std::string("Can't open soak csv file ") + csv_file).c_str());
+	}
+	add_probe("rss_kb", rss_kb);
+	add_probe("open_fds", open_fds);
+}
+
+void soak::monitor::add_probe(const std::string& name, const probe& p) {
+	if(th_)
+		throw std::runtime_error("soak::monitor probes have to be added before start");
+	metrics_.push_back(metric{name, p, std::vector<int64_t>()});
+}
+
+void soak::monitor::add_histogram(const std::string& name) {
+	stats::histogram	*h = &stats::get_histogram(name.c_str());
+	add_probe(name + ".p50", [h]() -> int64_t { return h->percentile(0.5); });
+	add_probe(name + ".p99", [h]() -> int64_t { return h->percentile(0.99); });
+	add_probe(name + ".max", [h]() -> int64_t { return h->max(); });
+	hists_.push_back(h);
+}
+
+void soak::monitor::sample(const double t) {
+	times_.push_back(t);
+	for(auto& m : metrics_)
+		m.samples.push_back(m.p());
+	// histograms are windowed
+	for(auto& h : hists_)
+		h->reset();
+	if(csv_.is_open()) {
+		csv_ << t;
+		for(const auto& m : metrics_)
+			csv_ << ',' << m.samples.back();
+		csv_ << std::endl;
+	}
+}
+
+void soak::monitor::loop(void) {
+	const auto	start = std::chrono::steady_clock::now();
+	std::unique_lock<std::mutex>	ul(mtx_);
+	while(run_) {
+		if(cv_.wait_for(ul, std::chrono::seconds(interval_s_), [this](){ return !run_; }))
+			break;
+		sample(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+	}
+}
+
+void soak::monitor::start(void) {
+	if(th_)
+		throw std::runtime_error("already running");
+	if(csv_.is_open()) {
+		csv_ << "time_s";
+		for(const auto& m : metrics_)
+			csv_ << ',' << m.name;
+		csv_ << std::endl;
+	}
+	run_ = true;
+	th_ = new std::thread(&soak::monitor::loop, this);
+}
+
+void soak::monitor::stop(void) {
+	if(!th_)
+		return;
+	{
+		std::lock_guard<std::mutex>	lg(mtx_);
+		run_ = false;
+		cv_.notify_all();
+	}
+	th_->join();
+	delete th_;
+	th_ = 0;
+}
+
+int soak::monitor::report(std::ostream& ostr) {
+	const size_t	n = times_.size();
+	if(n < 8) {
+		ostr << "Soak: only " << n << " samples, at least 8 are needed to evaluate drift" << std::endl;
+		return 0;
+	}
+	// first quarter is warm-up
+	const size_t	q1 = n/4,
+			q2 = n/2,
+			q3 = n - n/4;
+	int		drifting = 0;
+	ostr << "Soak: " << n << " samples over " << (int64_t)times_.back() << " s (warm-up " << (int64_t)times_[q1] << " s)\n";
+	ostr << std::setw(36) << std::left << "  metric" << std::setw(14) << std::right << "2nd quarter" << std::setw(14) << "last quarter"
+		<< std::setw(14) << "slope/hour" << std::setw(12) << "max" << '\n';
+	for(const auto& m : metrics_) {
+		const double	early = mean(m.samples, q1, q2),
+				late = mean(m.samples, q3, n),
+				slope_h = slope(times_, m.samples, q1, n)*3600.0;
+		int64_t		mx = m.samples[0];
+		for(const auto& s : m.samples)
+			if(s > mx) mx = s;
+		// drifting if it keeps growing and the last
+		// quarter is more than 10% above the second
+		const bool	drift = (slope_h > 0.0) && (late - early >= 1.0) && (late > early*1.1);
+		if(drift)
+			++drifting;
+		ostr << "  " << std::setw(34) << std::left << m.name << std::right << std::fixed << std::setprecision(1)
+			<< std::setw(14) << early << std::setw(14) << late << std::setw(14) << slope_h << std::setw(12) << mx
+			<< (drift ? "  DRIFT" : "") << '\n';
+	}
+	ostr << std::flush;
+	return drifting;
+}
+
+soak::monitor::~monitor() {
+	stop();
+}
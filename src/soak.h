@@ -0,0 +1,84 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+#ifndef _SOAK_H_
+#define _SOAK_H_
+
+#include <functional>
+#include <string>
+#include <vector>
+#include <ostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
+#include "stats.h"
+
+/* Long run monitor
+ * Samples process metrics (RSS, open fds), the
+ * registered probes (queue depths, pool usage, ...)
+ * and the windowed percentiles of the registered
+ * histograms every 'interval' seconds.
+ * At the end it reports how each metric drifted
+ * over the run; the first quarter of the samples is
+ * considered warm-up, then the least squares slope
+ * and the second vs last quarter averages are used.
+ */
+namespace soak {
+	typedef std::function<int64_t(void)>	probe;
+
+	class monitor {
+		struct metric {
+			std::string		name;
+			probe			p;
+			std::vector<int64_t>	samples;
+		};
+
+		const int		interval_s_;
+		std::ofstream		csv_;
+		std::vector<metric>	metrics_;
+		std::vector<stats::histogram*>	hists_;
+		std::vector<double>	times_;
+		std::thread		*th_;
+		std::mutex		mtx_;
+		std::condition_variable	cv_;
+		bool			run_;
+
+		void sample(const double t);
+		void loop(void);
+	public:
+		monitor(const int interval_s, const char* csv_file);
+
+		// must be called before start
+		void add_probe(const std::string& name, const probe& p);
+
+		// adds p50, p99 and max of the named
+		// stats histogram, reset at each sample
+		void add_histogram(const std::string& name);
+
+		void start(void);
+		void stop(void);
+
+		// returns the number of metrics which
+		// are considered drifting
+		int report(std::ostream& ostr);
+
+		~monitor();
+	};
+}
+
+#endif //_SOAK_H_
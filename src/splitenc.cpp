@@ -0,0 +1,622 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+
+#include "splitenc.h"
+#include "execpool.h"
+#include "numa_utils.h"
+#include "stats.h"
+#include "alloc_check.h"
+#include <thread>
+#include <iostream>
+#include <deque>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <climits>
+extern "C" {
+	#include <libavutil/time.h>
+	#include <libavutil/pixdesc.h>
+	#include <libavutil/opt.h>
+}
+
+namespace {
+	typedef std::unique_ptr<AVCodecContext, void(*)(AVCodecContext*)>	codec_ptr;
+	typedef std::unique_ptr<AVFrame, void(*)(AVFrame*)>			frame_ptr;
+	typedef std::unique_ptr<AVPacket, void(*)(AVPacket*)>			packet_ptr;
+
+	frame_ptr make_frame(void) {
+		frame_ptr	f(av_frame_alloc(), [](AVFrame* p){ if(p) av_frame_free(&p); });
+		if(!f)
+			throw std::runtime_error("av_frame_alloc");
+		return f;
+	}
+
+	frame_ptr make_yuv_frame(const int w, const int h) {
+		frame_ptr	f(make_frame());
+		f->width = w;
+		f->height = h;
+		f->format = AV_PIX_FMT_YUV420P;
+		utils::averror(av_frame_get_buffer(f.get(), 32));
+		return f;
+	}
+
+	// the region is cropped with pointer
+	// arithmetic, hence packed formats only
+	int packed_bpp(const AVPixelFormat pix_fmt) {
+		const AVPixFmtDescriptor	*desc = av_pix_fmt_desc_get(pix_fmt);
+		if(!desc || !(desc->flags & AV_PIX_FMT_FLAG_RGB) || (desc->flags & (AV_PIX_FMT_FLAG_PLANAR | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM)) || av_get_bits_per_pixel(desc)%8)
+			throw std::runtime_error("Split encoding supports only packed RGB formats");
+		return av_get_bits_per_pixel(desc)/8;
+	}
+
+	// same multiply/xor hash as the tile codec,
+	// only used to spot changed blocks
+	inline uint64_t block_hash(const uint8_t* data, const int linesize, const size_t row_bytes, const int h) {
+		uint64_t	hash = 0xcbf29ce484222325ULL;
+		for(int j = 0; j < h; ++j) {
+			const uint8_t	*row = data + j*linesize;
+			size_t		i = 0;
+			for(; i + 8 <= row_bytes; i += 8) {
+				uint64_t	v;
+				std::memcpy(&v, row + i, 8);
+				hash = (hash ^ v) * 0x9e3779b97f4a7c15ULL;
+				hash ^= hash >> 32;
+			}
+			for(; i < row_bytes; ++i)
+				hash = (hash ^ row[i]) * 0x100000001b3ULL;
+		}
+		return hash;
+	}
+
+	// fills the rectangle of a YUV420P frame with black
+	void blank(AVFrame* f, const splitenc::region& r) {
+		for(int j = 0; j < r.h; ++j)
+			std::memset(f->data[0] + (r.y + j)*f->linesize[0] + r.x, 16, r.w);
+		for(int p = 1; p < 3; ++p)
+			for(int j = 0; j < r.h/2; ++j)
+				std::memset(f->data[p] + (r.y/2 + j)*f->linesize[p] + r.x/2, 128, r.w/2);
+	}
+
+	// copies a YUV420P frame into 'dst' at r.x, r.y
+	void overlay(AVFrame* dst, const AVFrame* src, const splitenc::region& r) {
+		av_image_copy_plane(dst->data[0] + r.y*dst->linesize[0] + r.x, dst->linesize[0], src->data[0], src->linesize[0], r.w, r.h);
+		for(int p = 1; p < 3; ++p)
+			av_image_copy_plane(dst->data[p] + (r.y/2)*dst->linesize[p] + r.x/2, dst->linesize[p], src->data[p], src->linesize[p], r.w/2, r.h/2);
+	}
+
+	// one of the two streams of a split
+	// recording, frames in presentation order
+	struct input_stream {
+		int			idx;
+		codec_ptr		dec;
+		AVRational		time_base;
+		std::deque<frame_ptr>	frames;
+		bool			eof;
+
+		input_stream() : idx(-1), dec(0, [](AVCodecContext* p){ if(p) avcodec_free_context(&p); }), time_base((AVRational){1, 1}), eof(false) {
+		}
+
+		void open(AVFormatContext* fctx, const int i, execpool::client* pool) {
+			using namespace utils;
+
+			const AVStream	*st = fctx->streams[i];
+			auto*		d = avcodec_find_decoder(st->codecpar->codec_id);
+			if(!d)
+				throw std::runtime_error("Can't find decoder");
+			dec.reset(avcodec_alloc_context3(d));
+			if(!dec)
+				throw std::runtime_error("avcodec_alloc_context3");
+			averror(avcodec_parameters_to_context(dec.get(), st->codecpar));
+			execpool::bind(dec.get(), d, pool);
+			averror(avcodec_open2(dec.get(), d, 0));
+			idx = i;
+			time_base = st->time_base;
+		}
+
+		// gets all the available frames, timestamps
+		// become frame indices at 'fps'
+		void receive(const int fps, const int w, const int h) {
+			while(true) {
+				frame_ptr	f(make_frame());
+				const int	rv = avcodec_receive_frame(dec.get(), f.get());
+				if(AVERROR(EAGAIN) == rv)
+					return;
+				if(AVERROR_EOF == rv) {
+					eof = true;
+					return;
+				}
+				utils::averror(rv);
+				if(f->format != AV_PIX_FMT_YUV420P || f->width != w || f->height != h)
+					throw std::runtime_error("Unexpected frame format in split recording");
+				f->pts = av_rescale_q(f->best_effort_timestamp, time_base, (AVRational){1, fps});
+				frames.push_back(std::move(f));
+			}
+		}
+	};
+
+	class impl : public writer::iface {
+		// nominal bitrate of a full frame at full fps,
+		// each stream gets its share of it
+		static const int64_t	BIT_RATE = 40*1000*1000;
+		static const int64_t	MIN_BIT_RATE = 1000*1000;
+		// max frames taken from the queue at once
+		static const size_t	MAX_BATCH = 16;
+		// a larger region isn't worth the split
+		static const int	MAX_REGION_PCT = 50;
+
+		writer::params		params_;
+		splitenc::region	region_;
+		const int		bg_fps_;
+		writer::frame_queue&	fq_;
+		std::thread		*th_;
+
+		int64_t bit_rate(const int w, const int h, const int fps) const {
+			return std::max(MIN_BIT_RATE, (int64_t)(BIT_RATE*((double)w*h/(params_.width*params_.height))*fps/params_.fps));
+		}
+
+		codec_ptr open_encoder(AVFormatContext* octx, const AVCodec* penc, const int w, const int h, const int fps, const int gop, execpool::client* pool, AVStream*& strm) const {
+			using namespace utils;
+
+			strm = avformat_new_stream(octx, penc);
+			if(!strm)
+				throw std::runtime_error("avformat_new_stream");
+			strm->time_base = (AVRational){1, params_.fps};
+			strm->avg_frame_rate = (AVRational){fps, 1};
+			codec_ptr	c(avcodec_alloc_context3(penc), [](AVCodecContext* p){ if(p) avcodec_free_context(&p); });
+			if(!c)
+				throw std::runtime_error("avcodec_alloc_context3");
+			c->pix_fmt = AV_PIX_FMT_YUV420P;
+			c->bit_rate = bit_rate(w, h, fps);
+			c->width = w;
+			c->height = h;
+			// timestamps are always capture frame indices,
+			// the background just skips some
+			c->time_base = (AVRational){1, params_.fps};
+			c->framerate = (AVRational){fps, 1};
+			c->gop_size = gop;
+			c->max_b_frames = 1;
+			if(octx->oformat->flags & AVFMT_GLOBALHEADER)
+				c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+			AVDictionary	*param = 0;
+			av_dict_set(&param, "preset", "ultrafast", 0);
+			execpool::bind(c.get(), penc, pool);
+			const int	rv = avcodec_open2(c.get(), penc, &param);
+			av_dict_free(&param);
+			averror(rv);
+			averror(avcodec_parameters_from_context(strm->codecpar, c.get()));
+			return c;
+		}
+
+		// bounding box of the blocks which changed in
+		// at least half of the frames, all zeros if none
+		splitenc::region detect(const std::vector<int>& changes, const int blocks_x, const int64_t n_frames) const {
+			int	x0 = INT_MAX,
+				y0 = INT_MAX,
+				x1 = -1,
+				y1 = -1;
+			for(size_t i = 0; i < changes.size(); ++i) {
+				if(!changes[i] || 2*changes[i] < n_frames - 1)
+					continue;
+				x0 = std::min(x0, (int)i%blocks_x);
+				y0 = std::min(y0, (int)i/blocks_x);
+				x1 = std::max(x1, (int)i%blocks_x);
+				y1 = std::max(y1, (int)i/blocks_x);
+			}
+			splitenc::region	r = { 0, 0, 0, 0 };
+			if(x1 < 0)
+				return r;
+			r.x = x0*splitenc::BLOCK_SIZE;
+			r.y = y0*splitenc::BLOCK_SIZE;
+			r.w = (std::min((x1 + 1)*splitenc::BLOCK_SIZE, params_.width) - r.x) & ~1;
+			r.h = (std::min((y1 + 1)*splitenc::BLOCK_SIZE, params_.height) - r.y) & ~1;
+			if(r.w < 2 || r.h < 2 || 100LL*r.w*r.h > (int64_t)MAX_REGION_PCT*params_.width*params_.height)
+				r = splitenc::region{ 0, 0, 0, 0 };
+			return r;
+		}
+
+		void run(void) {
+			using namespace utils;
+
+			numa_utils::run_on_node(params_.numa_node);
+			alloc_check::set_stage(alloc_check::WRITER);
+			// this recording's slice of the process pool,
+			// counts both encoders from the start (the
+			// region one is opened later)
+			std::unique_ptr<execpool::client>	pool(execpool::attach(2, params_.numa_node));
+			const char	*outfile = params_.outfile;
+			const int	fps = params_.fps,
+					bpp = packed_bpp(params_.pix_fmt),
+					bg_every = std::max(1, fps/bg_fps_);
+			AVOutputFormat  *ofmt = av_guess_format(0, outfile, 0);
+			if(!ofmt)
+				throw std::runtime_error("av_guess_format");
+			AVFormatContext	*octx_ = 0;
+			averror(avformat_alloc_output_context2(&octx_, ofmt, 0, outfile));
+			std::unique_ptr<AVFormatContext, void(*)(AVFormatContext*)>	octx(octx_, [](AVFormatContext* p){ if(p) avformat_free_context(p); });
+			auto		*penc = avcodec_find_encoder(AV_CODEC_ID_H264);
+			if(!penc)
+				throw std::runtime_error("avcodec_find_encoder");
+			// background first, a player unaware of the
+			// split at least shows the whole UI
+			AVStream	*bg_strm = 0,
+					*rg_strm = 0;
+			codec_ptr	bg_codec(open_encoder(octx.get(), penc, params_.width, params_.height, bg_fps_, 2*bg_fps_, pool.get(), bg_strm)),
+					rg_codec(0, [](AVCodecContext* p){ if(p) avcodec_free_context(&p); });
+			frame_ptr	bg_frame(make_yuv_frame(params_.width, params_.height)),
+					rg_frame(make_frame());
+			SwsContext	*bg_sws = sws_getContext(params_.width, params_.height, params_.pix_fmt, params_.width, params_.height, AV_PIX_FMT_YUV420P, SWS_BICUBIC, 0, 0, 0),
+					*rg_sws = 0;
+			if(!bg_sws)
+				throw std::runtime_error("sws_getContext");
+			// while detecting, the background carries
+			// every frame
+			if(!region_.w)
+				bg_codec->bit_rate = BIT_RATE;
+			stats::value		&rg_frames = stats::get("split.region_frames"),
+						&bg_frames = stats::get("split.background_frames");
+			stats::histogram	&latency = stats::get_histogram("latency.capture_to_encode_us");
+			// packets are kept until the region is known,
+			// the header can't be written before
+			std::deque<packet_ptr>	pending;
+			bool			decided = false;
+			std::unique_ptr<AVPacket, void(*)(AVPacket*)>	opkt(av_packet_alloc(), [](AVPacket* p){ if(p) av_packet_free(&p); });
+			auto	write_packet = [&](AVPacket* pkt, const AVCodecContext* c, const AVStream* st) {
+				av_packet_rescale_ts(pkt, c->time_base, st->time_base);
+				averror(av_interleaved_write_frame(octx.get(), pkt));
+			};
+			auto	drain = [&](AVCodecContext* c, AVStream* st) {
+				int	rv = 0;
+				while(!(rv = avcodec_receive_packet(c, opkt.get()))) {
+					opkt->stream_index = st->index;
+					if(decided) {
+						write_packet(opkt.get(), c, st);
+						continue;
+					}
+					packet_ptr	p(av_packet_alloc(), [](AVPacket* p){ if(p) av_packet_free(&p); });
+					if(!p)
+						throw std::runtime_error("av_packet_alloc");
+					av_packet_move_ref(p.get(), opkt.get());
+					pending.push_back(std::move(p));
+				}
+				if(rv != AVERROR(EAGAIN) && rv != AVERROR_EOF)
+					averror(rv);
+			};
+			// opens the region encoder, if any, then
+			// writes the header and what's pending
+			auto	decide = [&](const splitenc::region& r) {
+				region_ = r;
+				if(region_.w > 0) {
+					rg_codec = open_encoder(octx.get(), penc, region_.w, region_.h, fps, 12, pool.get(), rg_strm);
+					const std::string	layout = std::to_string(region_.x) + "," + std::to_string(region_.y) + "," + std::to_string(region_.w) + "," + std::to_string(region_.h);
+					av_dict_set(&rg_strm->metadata, splitenc::REGION_TAG, layout.c_str(), 0);
+					av_dict_set(&octx->metadata, splitenc::REGION_TAG, layout.c_str(), 0);
+					av_dict_set(&rg_strm->metadata, "title", "region", 0);
+					av_dict_set(&bg_strm->metadata, "title", "background", 0);
+					rg_frame = make_yuv_frame(region_.w, region_.h);
+					rg_sws = sws_getContext(region_.w, region_.h, params_.pix_fmt, region_.w, region_.h, AV_PIX_FMT_YUV420P, SWS_BICUBIC, 0, 0, 0);
+					if(!rg_sws)
+						throw std::runtime_error("sws_getContext");
+					// libx264 reconfigures itself when
+					// bit_rate changes between frames
+					bg_codec->bit_rate = bit_rate(params_.width, params_.height, bg_fps_);
+					stats::get("split.region_pct").set(100LL*region_.w*region_.h/(params_.width*params_.height));
+					std::cout << "Split encoding: region " << region_.w << "x" << region_.h << "+" << region_.x << "+" << region_.y
+						<< " at " << fps << " fps, background at " << fps/bg_every << " fps" << std::endl;
+				} else {
+					bg_strm->avg_frame_rate = (AVRational){fps, 1};
+					std::cout << "Split encoding: no high motion region, single stream at " << fps << " fps" << std::endl;
+				}
+				av_dict_set(&octx->metadata, splitenc::FPS_TAG, std::to_string(fps).c_str(), 0);
+				if(!(octx->oformat->flags & AVFMT_NOFILE))
+					averror(avio_open2(&octx->pb , outfile , AVIO_FLAG_WRITE, 0, 0));
+				// mov and mp4 drop custom tags otherwise
+				AVDictionary	*opts = 0;
+				if(octx->oformat->priv_class && av_opt_find(&octx->oformat->priv_class, "movflags", 0, 0, AV_OPT_SEARCH_FAKE_OBJ))
+					av_dict_set(&opts, "movflags", "use_metadata_tags", 0);
+				const int	rv = avformat_write_header(octx.get(), &opts);
+				av_dict_free(&opts);
+				averror(rv);
+				decided = true;
+				for(auto& p : pending)
+					write_packet(p.get(), bg_codec.get(), bg_strm);
+				pending.clear();
+			};
+			auto	encode_bg = [&](const AVFrame* in, const int64_t pts) {
+				alloc_check::scope	as(alloc_check::LIBAV);
+				averror(av_frame_make_writable(bg_frame.get()));
+				sws_scale(bg_sws, in->data, in->linesize, 0, in->height, bg_frame->data, bg_frame->linesize);
+				if(decided && region_.w > 0)
+					blank(bg_frame.get(), region_);
+				bg_frame->pts = pts;
+				averror(avcodec_send_frame(bg_codec.get(), bg_frame.get()));
+				drain(bg_codec.get(), bg_strm);
+				bg_frames.add();
+			};
+			auto	encode_region = [&](const AVFrame* in, const int64_t pts) {
+				alloc_check::scope	as(alloc_check::LIBAV);
+				averror(av_frame_make_writable(rg_frame.get()));
+				const uint8_t	*src[4] = { in->data[0] + region_.y*in->linesize[0] + region_.x*bpp, 0, 0, 0 };
+				sws_scale(rg_sws, src, in->linesize, 0, region_.h, rg_frame->data, rg_frame->linesize);
+				rg_frame->pts = pts;
+				averror(avcodec_send_frame(rg_codec.get(), rg_frame.get()));
+				drain(rg_codec.get(), rg_strm);
+				rg_frames.add();
+			};
+			// per block change counts, for detection
+			const int		blocks_x = (params_.width + splitenc::BLOCK_SIZE - 1)/splitenc::BLOCK_SIZE,
+						blocks_y = (params_.height + splitenc::BLOCK_SIZE - 1)/splitenc::BLOCK_SIZE;
+			const int64_t		detect_frames = splitenc::DETECT_SECS*fps;
+			std::vector<uint64_t>	hashes;
+			std::vector<int>	changes;
+			if(region_.w > 0) {
+				decide(region_);
+			} else {
+				hashes.resize(blocks_x*blocks_y, 0);
+				changes.resize(blocks_x*blocks_y, 0);
+			}
+			int64_t		pts = 0;
+			frame_holder	*batch[MAX_BATCH];
+			size_t		n_batch = 0,
+					i_batch = 0;
+			while(true) {
+				if(i_batch == n_batch) {
+					i_batch = 0;
+					if(!(n_batch = fq_.pop_n(batch, MAX_BATCH)))
+						break;
+				}
+				frame_holder*	fh = batch[i_batch++];
+				const AVFrame	*in = fh->frame.get();
+				if(!decided) {
+					for(int by = 0; by < blocks_y; ++by) {
+						for(int bx = 0; bx < blocks_x; ++bx) {
+							const int	x = bx*splitenc::BLOCK_SIZE,
+									y = by*splitenc::BLOCK_SIZE,
+									w = std::min(splitenc::BLOCK_SIZE, params_.width - x),
+									h = std::min(splitenc::BLOCK_SIZE, params_.height - y),
+									i = by*blocks_x + bx;
+							const uint64_t	hash = block_hash(in->data[0] + y*in->linesize[0] + x*bpp, in->linesize[0], w*bpp, h);
+							if(pts > 0 && hash != hashes[i])
+								++changes[i];
+							hashes[i] = hash;
+						}
+					}
+					// whole frames at full fps meanwhile
+					encode_bg(in, pts);
+					if(pts + 1 == detect_frames)
+						decide(detect(changes, blocks_x, pts + 1));
+				} else if(region_.w > 0) {
+					encode_region(in, pts);
+					if(!(pts%bg_every))
+						encode_bg(in, pts);
+				} else {
+					encode_bg(in, pts);
+				}
+				latency.record(av_gettime_relative() - fh->ts);
+				++pts;
+				fh->release();
+			}
+			// shorter than the detection
+			if(!decided)
+				decide(detect(changes, blocks_x, pts));
+			averror(avcodec_send_frame(bg_codec.get(), 0));
+			drain(bg_codec.get(), bg_strm);
+			if(rg_codec) {
+				averror(avcodec_send_frame(rg_codec.get(), 0));
+				drain(rg_codec.get(), rg_strm);
+			}
+			averror(av_write_trailer(octx.get()));
+			if(!(octx->oformat->flags & AVFMT_NOFILE))
+				avio_closep(&octx->pb);
+			sws_freeContext(bg_sws);
+			sws_freeContext(rg_sws);
+			std::cout << "Written " << pts << " frames (" << rg_frames.get() << " region, " << bg_frames.get() << " background)" << std::endl;
+		}
+	public:
+		impl(const writer::params& p, const splitenc::region& r, const int bg_fps, writer::frame_queue& fq) : params_(p), region_(r), bg_fps_(std::max(1, std::min(bg_fps, p.fps))), fq_(fq), th_(0) {
+			packed_bpp(params_.pix_fmt);
+			if(params_.out_width != params_.width || params_.out_height != params_.height)
+				throw std::runtime_error("Split encoding doesn't downscale");
+			if(region_.w > 0) {
+				// YUV420P wants even coordinates and sizes
+				region_.x &= ~1;
+				region_.y &= ~1;
+				region_.w = std::min(region_.w, params_.width - region_.x) & ~1;
+				region_.h = std::min(region_.h, params_.height - region_.y) & ~1;
+				if(region_.w < 2 || region_.h < 2)
+					throw std::runtime_error("Split region is outside of the frame");
+			}
+		}
+
+		void start(void) {
+			if(th_)
+				throw std::runtime_error("already running");
+			th_ = new std::thread(
+				[this]() -> void {
+					try {
+						run();
+					} catch(const std::exception& e) {
+						std::cerr << "[split_writer] Exception: " <<  e.what() << std::endl;
+						std::exit(-1);
+					} catch(...) {
+						std::cerr << "[split_writer] Unknown exception" << std::endl;
+						std::exit(-1);
+					}
+				}
+			);
+		}
+
+		void stop(void) {
+			if(!th_)
+				return;
+			// the writer drains what's left, then exits
+			fq_.close();
+			th_->join();
+			delete th_;
+			th_ = 0;
+		}
+
+		~impl() {
+			stop();
+		}
+	};
+}
+
+splitenc::region splitenc::parse_region(const char* s) {
+	splitenc::region	r = { 0, 0, 0, 0 };
+	if(std::string("auto") == s)
+		return r;
+	if(std::sscanf(s, "%dx%d+%d+%d", &r.w, &r.h, &r.x, &r.y) != 4 || r.w <= 0 || r.h <= 0 || r.x < 0 || r.y < 0)
+		throw std::runtime_error("Invalid split region, please specify as WxH+X+Y or 'auto'");
+	return r;
+}
+
+writer::iface* splitenc::init(const writer::params& p, const region& r, const int bg_fps, writer::frame_queue& fq) {
+	return new impl(p, r, bg_fps, fq);
+}
+
+void splitenc::convert(const char* infile, const char* outfile) {
+	using namespace utils;
+
+	AVFormatContext	*fctx_ = 0;
+	averror(avformat_open_input(&fctx_, infile, 0, 0));
+	std::unique_ptr<AVFormatContext, void(*)(AVFormatContext*)>	fctx(fctx_, [](AVFormatContext* p){ if(p) avformat_close_input(&p); });
+	averror(avformat_find_stream_info(fctx.get(), 0));
+	const AVDictionaryEntry	*fps_tag = av_dict_get(fctx->metadata, FPS_TAG, 0, 0);
+	const int		fps = fps_tag ? std::atoi(fps_tag->value) : 0;
+	if(fps <= 0)
+		throw std::runtime_error("Not a split recording (no layout metadata)");
+	// both decoders
+	std::unique_ptr<execpool::client>	pool(execpool::attach(2));
+	input_stream	bg,
+			rg;
+	region		r = { 0, 0, 0, 0 };
+	for(unsigned int i = 0; i < fctx->nb_streams; ++i) {
+		const AVStream	*st = fctx->streams[i];
+		if(st->codecpar->codec_type != AVMEDIA_TYPE_VIDEO)
+			continue;
+		const AVDictionaryEntry	*layout = av_dict_get(st->metadata, REGION_TAG, 0, 0);
+		if(layout && rg.idx < 0) {
+			if(std::sscanf(layout->value, "%d,%d,%d,%d", &r.x, &r.y, &r.w, &r.h) != 4)
+				throw std::runtime_error("Invalid split region metadata");
+			rg.open(fctx.get(), i, pool.get());
+		} else if(!layout && bg.idx < 0) {
+			bg.open(fctx.get(), i, pool.get());
+		}
+	}
+	// stream tags lost, the layout is in the file tags
+	const AVDictionaryEntry	*file_layout = av_dict_get(fctx->metadata, REGION_TAG, 0, 0);
+	if(rg.idx < 0 && bg.idx >= 0 && file_layout) {
+		if(std::sscanf(file_layout->value, "%d,%d,%d,%d", &r.x, &r.y, &r.w, &r.h) != 4)
+			throw std::runtime_error("Invalid split region metadata");
+		for(unsigned int i = bg.idx + 1; i < fctx->nb_streams && rg.idx < 0; ++i) {
+			if(fctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+				rg.open(fctx.get(), i, pool.get());
+		}
+		if(rg.idx < 0)
+			throw std::runtime_error("Can't find the region stream");
+	}
+	if(bg.idx < 0)
+		throw std::runtime_error("Can't find the background stream");
+	const int	W = fctx->streams[bg.idx]->codecpar->width,
+			H = fctx->streams[bg.idx]->codecpar->height;
+	// region frames start after the detection, background
+	// ones before that don't have to wait for them
+	int64_t		rg_start = INT64_MAX;
+	if(rg.idx >= 0) {
+		if(r.x < 0 || r.y < 0 || r.w <= 0 || r.h <= 0 || r.x + r.w > W || r.y + r.h > H)
+			throw std::runtime_error("Split region is outside of the frame");
+		const AVStream	*st = fctx->streams[rg.idx];
+		rg_start = (st->start_time != AV_NOPTS_VALUE) ? av_rescale_q(st->start_time, st->time_base, (AVRational){1, fps}) : INT64_MIN;
+	} else {
+		rg.eof = true;
+	}
+	frame_ptr	canvas(make_yuv_frame(W, H)),
+			last_rg(0, [](AVFrame* p){ if(p) av_frame_free(&p); });
+	for(int p = 0; p < 3; ++p)
+		std::memset(canvas->data[p], p ? 128 : 16, canvas->linesize[p]*(p ? (H + 1)/2 : H));
+	writer::frame_queue	fq;
+	frame_buffers		frame_bufs(16, W, H, AV_PIX_FMT_YUV420P);
+	std::unique_ptr<writer::iface>	w(writer::init(writer::params{fps, W, H, AV_PIX_FMT_YUV420P, outfile, W, H, 1, -1, {}, 0, 0}, fq));
+	w->start();
+	int64_t		n_out = 0;
+	// both decoders output in presentation order, hence
+	// the earliest queued frame can go as soon as the
+	// other stream can't have an earlier one
+	auto	emit = [&]() {
+		while(true) {
+			int64_t	next = 0;
+			if(!bg.frames.empty() && !rg.frames.empty())
+				next = std::min(bg.frames.front()->pts, rg.frames.front()->pts);
+			else if(!bg.frames.empty() && (rg.eof || bg.frames.front()->pts < rg_start))
+				next = bg.frames.front()->pts;
+			else if(!rg.frames.empty() && bg.eof)
+				next = rg.frames.front()->pts;
+			else
+				return;
+			while(!bg.frames.empty() && bg.frames.front()->pts <= next) {
+				averror(av_frame_copy(canvas.get(), bg.frames.front().get()));
+				bg.frames.pop_front();
+				// the region is blank in the background
+				if(last_rg)
+					overlay(canvas.get(), last_rg.get(), r);
+			}
+			while(!rg.frames.empty() && rg.frames.front()->pts <= next) {
+				last_rg = std::move(rg.frames.front());
+				rg.frames.pop_front();
+				overlay(canvas.get(), last_rg.get(), r);
+			}
+			auto*	cur_fh = frame_bufs.wait_one();
+			averror(av_frame_copy(cur_fh->frame.get(), canvas.get()));
+			cur_fh->frame->pts = next;
+			fq.push(cur_fh);
+			++n_out;
+		}
+	};
+	AVPacket	pkt;
+	av_init_packet(&pkt);
+	pkt.data = 0;
+	pkt.size = 0;
+	while(true) {
+		const int	rv = av_read_frame(fctx.get(), &pkt);
+		if(AVERROR_EOF == rv)
+			break;
+		averror(rv);
+		input_stream	*in = (pkt.stream_index == bg.idx) ? &bg : ((pkt.stream_index == rg.idx) ? &rg : 0);
+		const int	src = in ? avcodec_send_packet(in->dec.get(), &pkt) : 0;
+		av_packet_unref(&pkt);
+		averror(src);
+		if(!in)
+			continue;
+		if(in == &bg)
+			bg.receive(fps, W, H);
+		else
+			rg.receive(fps, r.w, r.h);
+		emit();
+	}
+	// drain the decoders
+	averror(avcodec_send_packet(bg.dec.get(), 0));
+	bg.receive(fps, W, H);
+	if(rg.idx >= 0) {
+		averror(avcodec_send_packet(rg.dec.get(), 0));
+		rg.receive(fps, r.w, r.h);
+	}
+	bg.eof = rg.eof = true;
+	emit();
+	w->stop();
+	std::cout << "Recombined " << n_out << " frames (" << (rg.idx >= 0 ? "region and background" : "single stream") << ")" << std::endl;
+}
@@ -0,0 +1,74 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+
+#ifndef _SPLITENC_H_
+#define _SPLITENC_H_
+
+#include "writer.h"
+
+/* Mixed content split encoding
+ * Screen recordings often have a small high motion
+ * area (video player, game viewport) inside a large
+ * mostly static UI. Such area (the region) is encoded
+ * as its own H.264 stream at full fps, while the whole
+ * frame, with the region blanked, is encoded at a low
+ * fps (the background). Both streams go in the same
+ * file, hence encoding cost and bitrate follow the
+ * moving area instead of the full frame.
+ * The region is either given or detected over the first
+ * DETECT_SECS seconds as the bounding box of the blocks
+ * which change in at least half of the frames. Without
+ * such blocks, or when they cover most of the frame,
+ * the background alone is encoded at full fps.
+ * Layout metadata, the REGION_TAG stream tag ("x,y,w,h")
+ * of the region stream and the FPS_TAG file tag, lets
+ * convert recombine the two streams into a standard
+ * recording. Containers dropping stream tags (mp4/mov,
+ * which keep custom file tags with movflags
+ * use_metadata_tags) get REGION_TAG as a file tag too,
+ * the region stream being then the second video one.
+ * Only packed RGB formats are supported (i.e. RGBA from
+ * xcompgrab, BGR0 from x11grab and xshmgrab).
+ */
+namespace splitenc {
+	const int	DETECT_SECS = 2;
+	const int	BLOCK_SIZE = 64;
+	const char	REGION_TAG[] = "replayer_region";
+	const char	FPS_TAG[] = "replayer_fps";
+
+	struct region {
+		int	x,
+			y,
+			w,
+			h;
+	};
+
+	// parses "WxH+X+Y", or "auto" (all zeros)
+	extern region parse_region(const char* s);
+
+	// writer replacement encoding the region and the
+	// background in separate streams, 'r' all zeros
+	// means detect it
+	extern writer::iface* init(const writer::params& p, const region& r, const int bg_fps, writer::frame_queue& fq);
+
+	// recombines a split recording into a standard
+	// video file using the default writer
+	extern void convert(const char* infile, const char* outfile);
+}
+
+#endif //_SPLITENC_H_
@@ -0,0 +1,109 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+
+#include "stage.h"
+#include "alloc_check.h"
+#include <iostream>
+
+void stage::task::promise_type::final_awaiter::await_suspend(handle h) noexcept {
+	executor	*ex = h.promise().ex;
+	std::latch	*done = h.promise().done;
+	h.destroy();
+	if(done)
+		done->count_down();
+	ex->finished();
+}
+
+void stage::task::promise_type::unhandled_exception(void) {
+	try {
+		throw;
+	} catch(const std::exception& e) {
+		std::cerr << "[stage] Exception: " << e.what() << std::endl;
+	} catch(...) {
+		std::cerr << "[stage] Unknown exception" << std::endl;
+	}
+	std::exit(-1);
+}
+
+stage::executor::executor(const int n_threads, const int n_io_threads) : live_(0) {
+	for(int i = 0; i < std::max(1, n_threads); ++i)
+		th_.push_back(std::thread(&executor::worker, this));
+	for(int i = 0; i < std::max(1, n_io_threads); ++i)
+		th_.push_back(std::thread(&executor::io_worker, this));
+}
+
+void stage::executor::worker(void) {
+	// stages are consumers of the capture
+	alloc_check::set_stage(alloc_check::WRITER);
+	std::coroutine_handle<>	batch[16];
+	while(const size_t n = ready_.pop_n(batch, sizeof(batch)/sizeof(batch[0]))) {
+		for(size_t i = 0; i < n; ++i)
+			batch[i].resume();
+	}
+}
+
+void stage::executor::io_worker(void) {
+	io_op	*batch[16];
+	while(const size_t n = io_.pop_n(batch, sizeof(batch)/sizeof(batch[0]))) {
+		for(size_t i = 0; i < n; ++i) {
+			try {
+				batch[i]->run(batch[i]);
+			} catch(...) {
+				batch[i]->err = std::current_exception();
+			}
+			post(batch[i]->h);
+		}
+	}
+}
+
+void stage::executor::spawn(task t, std::latch* done) {
+	{
+		std::unique_lock<std::mutex>	ul(mtx_);
+		++live_;
+	}
+	t.h_.promise().ex = this;
+	t.h_.promise().done = done;
+	post(t.h_);
+	t.h_ = task::handle();
+}
+
+void stage::executor::finished(void) {
+	std::unique_lock<std::mutex>	ul(mtx_);
+	if(!--live_)
+		cv_.notify_all();
+}
+
+void stage::executor::wait(void) {
+	std::unique_lock<std::mutex>	ul(mtx_);
+	cv_.wait(ul, [this](){ return !live_; });
+}
+
+stage::executor::~executor() {
+	wait();
+	ready_.close();
+	io_.close();
+	for(auto& t : th_)
+		t.join();
+}
+
+stage::executor& stage::shared(void) {
+	// the I/O thread is mostly idle, two threads run
+	// all the stages; lives as long as the process
+	static executor	*ex = new executor(2, 1);
+	return *ex;
+}
@@ -0,0 +1,276 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+
+#ifndef _STAGE_H_
+#define _STAGE_H_
+
+#include <coroutine>
+#include <exception>
+#include <latch>
+#include <thread>
+#include "utils.h"
+
+/* Coroutine pipeline stages
+ * A stage is a coroutine returning stage::task, run by an
+ * executor (a few threads shared by all the stages of the
+ * process). Instead of blocking it awaits:
+ * - the next element of a queue (stage::pop)
+ * - a holder from a frame pool (stage::get_buffer)
+ * - a blocking call, run on the executor I/O thread (stage::io)
+ * A suspended stage doesn't hold any thread, hence new stages
+ * (hashing, snapshots, sinks, ...) cost no threads of their
+ * own nor timed polling. Stages may resume on any executor
+ * thread: thread local state (i.e. alloc_check) is per executor.
+ */
+namespace stage {
+	class executor;
+
+	class task {
+	public:
+		struct promise_type;
+		typedef std::coroutine_handle<promise_type>	handle;
+
+		struct promise_type {
+			executor	*ex;
+			std::latch	*done;
+
+			promise_type() : ex(0), done(0) {
+			}
+
+			task get_return_object(void) {
+				return task(handle::from_promise(*this));
+			}
+
+			// started by executor::spawn
+			std::suspend_always initial_suspend(void) noexcept {
+				return {};
+			}
+
+			struct final_awaiter {
+				bool await_ready(void) noexcept {
+					return false;
+				}
+
+				void await_suspend(handle h) noexcept;
+
+				void await_resume(void) noexcept {
+				}
+			};
+
+			final_awaiter final_suspend(void) noexcept {
+				return {};
+			}
+
+			void return_void(void) {
+			}
+
+			void unhandled_exception(void);
+		};
+	private:
+		handle	h_;
+
+		explicit task(handle h) : h_(h) {
+		}
+
+		friend class executor;
+	public:
+		task(task&& rhs) : h_(rhs.h_) {
+			rhs.h_ = handle();
+		}
+
+		task(const task&) = delete;
+
+		task& operator=(const task&) = delete;
+
+		// never spawned
+		~task() {
+			if(h_)
+				h_.destroy();
+		}
+	};
+
+	// blocking call handed to the I/O thread
+	struct io_op {
+		void			(*run)(io_op*);
+		std::coroutine_handle<>	h;
+		executor		*ex;
+		std::exception_ptr	err;
+	};
+
+	class executor {
+		utils::concurrent_deque<std::coroutine_handle<>>	ready_;
+		utils::concurrent_deque<io_op*>				io_;
+		std::vector<std::thread>				th_;
+		std::mutex						mtx_;
+		std::condition_variable					cv_;
+		int							live_;
+
+		void worker(void);
+
+		void io_worker(void);
+	public:
+		executor(const int n_threads, const int n_io_threads = 1);
+
+		// starts 't', if not null 'done' is counted
+		// down once the stage is over
+		void spawn(task t, std::latch* done = 0);
+
+		// resumes 'h' on one of the threads
+		inline void post(std::coroutine_handle<> h) {
+			ready_.push(h);
+		}
+
+		inline void post_io(io_op* op) {
+			io_.push(op);
+		}
+
+		// called by the stages' final suspend
+		void finished(void);
+
+		// waits for all the spawned stages
+		void wait(void);
+
+		~executor();
+	};
+
+	// process wide executor
+	extern executor& shared(void);
+
+	// co_await pop(q, out) is false once
+	// the queue is closed and empty
+	template<typename T>
+	class pop_awaiter {
+		typedef typename utils::concurrent_deque<T>::waiter	waiter;
+
+		struct node : waiter {
+			executor		*ex;
+			std::coroutine_handle<>	h;
+		};
+
+		utils::concurrent_deque<T>&	q_;
+		T				&out_;
+		node				w_;
+
+		static void wake(waiter* w) {
+			node	*n = static_cast<node*>(w);
+			n->ex->post(n->h);
+		}
+	public:
+		pop_awaiter(utils::concurrent_deque<T>& q, T& out) : q_(q), out_(out) {
+			w_.wake = &pop_awaiter::wake;
+		}
+
+		bool await_ready(void) const {
+			return false;
+		}
+
+		bool await_suspend(task::handle h) {
+			w_.ex = h.promise().ex;
+			w_.h = h;
+			return !q_.pop_or_wait(out_, &w_);
+		}
+
+		bool await_resume(void) const {
+			return w_.ok;
+		}
+	};
+
+	template<typename T>
+	inline pop_awaiter<T> pop(utils::concurrent_deque<T>& q, T& out) {
+		return pop_awaiter<T>(q, out);
+	}
+
+	// co_await get_buffer(fb) returns a locked holder
+	class get_buffer {
+		typedef utils::frame_buffers::waiter	waiter;
+
+		struct node : waiter {
+			executor		*ex;
+			std::coroutine_handle<>	h;
+		};
+
+		utils::frame_buffers&	fb_;
+		utils::frame_holder	*fh_;
+		node			w_;
+
+		static void wake(waiter* w) {
+			node	*n = static_cast<node*>(w);
+			n->ex->post(n->h);
+		}
+	public:
+		get_buffer(utils::frame_buffers& fb) : fb_(fb), fh_(0) {
+			w_.wake = &get_buffer::wake;
+		}
+
+		bool await_ready(void) const {
+			return false;
+		}
+
+		bool await_suspend(task::handle h) {
+			w_.ex = h.promise().ex;
+			w_.h = h;
+			return !fb_.get_or_wait(fh_, &w_);
+		}
+
+		// trimmed holders are allocated again
+		// here, not by the releasing thread
+		utils::frame_holder* await_resume(void) {
+			utils::frame_holder	*fh = fh_ ? fh_ : w_.fh;
+			if(!fb_.fill(fh))
+				throw std::runtime_error("Can't allocate frame buffers");
+			return fh;
+		}
+	};
+
+	// co_await io(f) runs f() on the I/O thread,
+	// its exceptions are thrown in the stage
+	template<typename F>
+	class io_awaiter : public io_op {
+		F	f_;
+
+		static void thunk(io_op* op) {
+			static_cast<io_awaiter*>(op)->f_();
+		}
+	public:
+		io_awaiter(F&& f) : f_(std::forward<F>(f)) {
+			run = &io_awaiter::thunk;
+		}
+
+		bool await_ready(void) const {
+			return false;
+		}
+
+		void await_suspend(task::handle h) {
+			this->h = h;
+			ex = h.promise().ex;
+			ex->post_io(this);
+		}
+
+		void await_resume(void) const {
+			if(err)
+				std::rethrow_exception(err);
+		}
+	};
+
+	template<typename F>
+	inline io_awaiter<F> io(F&& f) {
+		return io_awaiter<F>(std::forward<F>(f));
+	}
+}
+
+#endif //_STAGE_H_
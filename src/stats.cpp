@@ -0,0 +1,57 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+#include "stats.h"
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace {
+	std::mutex							values_mtx;
+	std::map<std::string, std::unique_ptr<stats::value> >	values;
+	std::map<std::string, std::unique_ptr<stats::histogram> >	histograms;
+}
+
+stats::value& stats::get(const char* name) {
+	std::lock_guard<std::mutex>	lg(values_mtx);
+	auto&	v = values[name];
+	if(!v)
+		v.reset(new stats::value());
+	return *v;
+}
+
+stats::histogram& stats::get_histogram(const char* name) {
+	std::lock_guard<std::mutex>	lg(values_mtx);
+	auto&	h = histograms[name];
+	if(!h)
+		h.reset(new stats::histogram());
+	return *h;
+}
+
+void stats::report(std::ostream& ostr) {
+	std::lock_guard<std::mutex>	lg(values_mtx);
+	if(values.empty() && histograms.empty())
+		return;
+	ostr << "Stats:\n";
+	for(const auto& v : values)
+		ostr << "  " << v.first << ": " << v.second->get() << '\n';
+	for(const auto& h : histograms)
+		ostr << "  " << h.first << ": n " << h.second->count() << ", p50 " << h.second->percentile(0.5)
+			<< ", p99 " << h.second->percentile(0.99) << ", max " << h.second->max() << '\n';
+	ostr << std::flush;
+}
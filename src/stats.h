@@ -0,0 +1,137 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+/* Process wide named statistics
+ * Lookup by name takes a lock, hence hot paths
+ * should get the reference once and keep it,
+ * updates are then just atomic operations.
+ */
+namespace stats {
+	class value {
+		std::atomic<int64_t>	v_;
+	public:
+		value() : v_(0) {
+		}
+
+		inline void add(const int64_t n = 1) {
+			v_.fetch_add(n, std::memory_order_relaxed);
+		}
+
+		inline void set(const int64_t n) {
+			v_.store(n, std::memory_order_relaxed);
+		}
+
+		// keeps the high water mark
+		inline void max(const int64_t n) {
+			int64_t	cur = v_.load(std::memory_order_relaxed);
+			while(n > cur && !v_.compare_exchange_weak(cur, n, std::memory_order_relaxed));
+		}
+
+		inline int64_t get(void) const {
+			return v_.load(std::memory_order_relaxed);
+		}
+	};
+
+	// lock free log-linear histogram, 4 sub buckets
+	// per power of 2, hence ~20% max relative error
+	class histogram {
+		static const int		N_BUCKETS = 64*4;
+		std::atomic<uint64_t>		buckets_[N_BUCKETS];
+		std::atomic<int64_t>		max_;
+
+		static inline int bucket(const uint64_t v) {
+			if(v < 4)
+				return v;
+			const int	l2 = 63 - __builtin_clzll(v);
+			return l2*4 + ((v >> (l2 - 2)) & 3);
+		}
+
+		static inline uint64_t bucket_value(const int b) {
+			if(b < 4)
+				return b;
+			const int	l2 = b/4;
+			return (1ULL << l2) + ((uint64_t)(b & 3) << (l2 - 2));
+		}
+	public:
+		histogram() : max_(0) {
+			reset();
+		}
+
+		inline void record(const int64_t v) {
+			const uint64_t	uv = (v < 0) ? 0 : v;
+			buckets_[bucket(uv)].fetch_add(1, std::memory_order_relaxed);
+			int64_t	cur = max_.load(std::memory_order_relaxed);
+			while((int64_t)uv > cur && !max_.compare_exchange_weak(cur, uv, std::memory_order_relaxed));
+		}
+
+		// p in [0, 1], returns lower bound
+		// of the bucket, 0 if empty
+		inline int64_t percentile(const double p) const {
+			uint64_t	total = 0;
+			for(int i = 0; i < N_BUCKETS; ++i)
+				total += buckets_[i].load(std::memory_order_relaxed);
+			if(!total)
+				return 0;
+			const uint64_t	target = (uint64_t)(p*(total - 1)) + 1;
+			uint64_t	cur = 0;
+			for(int i = 0; i < N_BUCKETS; ++i) {
+				cur += buckets_[i].load(std::memory_order_relaxed);
+				if(cur >= target)
+					return bucket_value(i);
+			}
+			return max_.load(std::memory_order_relaxed);
+		}
+
+		inline uint64_t count(void) const {
+			uint64_t	total = 0;
+			for(int i = 0; i < N_BUCKETS; ++i)
+				total += buckets_[i].load(std::memory_order_relaxed);
+			return total;
+		}
+
+		inline int64_t max(void) const {
+			return max_.load(std::memory_order_relaxed);
+		}
+
+		// not atomic with respect to concurrent
+		// record calls, fine for windowed sampling
+		inline void reset(void) {
+			for(int i = 0; i < N_BUCKETS; ++i)
+				buckets_[i].store(0, std::memory_order_relaxed);
+			max_.store(0, std::memory_order_relaxed);
+		}
+	};
+
+	// returned reference is valid for the
+	// whole life of the process
+	extern value& get(const char* name);
+
+	// same as above, for histograms
+	extern histogram& get_histogram(const char* name);
+
+	// prints all the values sorted by name
+	extern void report(std::ostream& ostr);
+}
+
+#endif //_STATS_H_
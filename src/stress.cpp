@@ -0,0 +1,559 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+
+#include "stress.h"
+#include "utils.h"
+#include "stats.h"
+#include "xcompgrab.h"
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <string>
+#include <iomanip>
+
+namespace {
+	typedef std::unique_ptr<std::atomic<int64_t>[]>	counters;
+
+	inline int64_t now_ns(void) {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	counters make_counters(const size_t n, const int64_t v) {
+		counters	rv(new std::atomic<int64_t>[n]);
+		for(size_t i = 0; i < n; ++i)
+			rv[i] = v;
+		return rv;
+	}
+
+	void report(std::ostream& ostr, const char* name, const int64_t ops, const double secs, const stats::histogram& lat, const int errors) {
+		ostr << "  " << std::left << std::setw(24) << name << std::right << std::setw(12) << (int64_t)(ops/secs) << " ops/s, latency ns p50 "
+			<< lat.percentile(0.5) << " p99 " << lat.percentile(0.99) << " max " << lat.max() << ", "
+			<< (errors ? "FAIL " : "OK ") << errors << " errors" << std::endl;
+	}
+
+	// latency is push to pop
+	int queue_test(const int secs, const int n_threads, std::ostream& ostr) {
+		struct item {
+			int		producer;
+			int64_t		seq;
+			int64_t		ts;
+		};
+		// producers are throttled so that the
+		// queue doesn't grow without bound
+		const int64_t			MAX_IN_FLIGHT = 1024;
+		const int			n_prod = std::max(1, n_threads/2),
+						n_cons = std::max(1, n_threads - n_prod);
+		utils::concurrent_deque<item>	q(64);
+		std::atomic<bool>		stop(false),
+						closed(false);
+		std::atomic<int64_t>		in_flight(0),
+						ops(0),
+						errors(0);
+		counters			pushed = make_counters(n_prod, 0),
+						popped = make_counters(n_prod, 0),
+						seq_sum = make_counters(n_prod, 0);
+		stats::histogram		lat;
+		std::vector<std::thread>	prod,
+						cons;
+		for(int p = 0; p < n_prod; ++p) {
+			prod.push_back(std::thread([&, p]() {
+				int64_t	seq = 0;
+				item	batch[4];
+				while(!stop.load(std::memory_order_relaxed)) {
+					if(in_flight.load(std::memory_order_relaxed) > MAX_IN_FLIGHT) {
+						std::this_thread::yield();
+						continue;
+					}
+					// mix single and batched pushes
+					if(seq%3) {
+						in_flight += 1;
+						q.push(item{ p, seq++, now_ns() });
+					} else {
+						for(int i = 0; i < 4; ++i)
+							batch[i] = item{ p, seq++, now_ns() };
+						in_flight += 4;
+						q.push_n(batch, 4);
+					}
+				}
+				pushed[p] = seq;
+			}));
+		}
+		for(int c = 0; c < n_cons; ++c) {
+			cons.push_back(std::thread([&, c]() {
+				// per producer order as seen by this consumer
+				std::vector<int64_t>	last(n_prod, -1);
+				item			buf[16];
+				size_t			n = 0;
+				while(true) {
+					if(c%2) {
+						if(!(n = q.pop_n(buf, 16)))
+							break;
+					} else {
+						n = q.pop(buf[0]) ? 1 : 0;
+						if(!n) {
+							// timeout or closed and empty
+							if(closed && !q.size())
+								break;
+							continue;
+						}
+					}
+					const int64_t	t = now_ns();
+					for(size_t i = 0; i < n; ++i) {
+						const item&	it = buf[i];
+						lat.record(t - it.ts);
+						if(it.seq <= last[it.producer])
+							++errors;
+						last[it.producer] = it.seq;
+						popped[it.producer] += 1;
+						seq_sum[it.producer] += it.seq;
+					}
+					in_flight -= n;
+					ops += n;
+				}
+			}));
+		}
+		const int64_t	start = now_ns();
+		std::this_thread::sleep_for(std::chrono::seconds(secs));
+		stop = true;
+		for(auto& t : prod)
+			t.join();
+		q.close();
+		closed = true;
+		for(auto& t : cons)
+			t.join();
+		const double	elapsed = (now_ns() - start)/1e9;
+		// nothing lost nor duplicated
+		for(int p = 0; p < n_prod; ++p) {
+			if(popped[p] != pushed[p] || seq_sum[p] != pushed[p]*(pushed[p] - 1)/2) {
+				ostr << "  producer " << p << ": pushed " << pushed[p] << ", popped " << popped[p] << std::endl;
+				++errors;
+			}
+		}
+		const std::string	name = "concurrent_deque " + std::to_string(n_prod) + "p/" + std::to_string(n_cons) + "c";
+		report(ostr, name.c_str(), ops, elapsed, lat, errors);
+		return errors;
+	}
+
+	// waiter woken by the pushing/closing or releasing
+	// thread, 'w' first so that wake can cast back
+	template<typename W>
+	struct async_waiter {
+		W			w;
+		std::atomic<int>	woken;
+
+		static void wake(W* w) {
+			// last access of the waking thread
+			reinterpret_cast<async_waiter*>(w)->woken.fetch_add(1, std::memory_order_release);
+		}
+
+		async_waiter() : w(), woken(0) {
+			w.wake = &async_waiter::wake;
+		}
+
+		// spins until woken, false if woken twice
+		bool wait(void) {
+			int	n = 0;
+			while(!(n = woken.load(std::memory_order_acquire)))
+				std::this_thread::yield();
+			return n == 1;
+		}
+	};
+
+	// pop_or_wait racing push, push_n and close: short
+	// rounds, each closed while producers still push; what
+	// is pushed after the close is drained at the end of
+	// the round. Latency is push to pop
+	int queue_async_test(const int secs, const int n_threads, std::ostream& ostr) {
+		struct item {
+			int		producer;
+			int64_t		seq;
+			int64_t		ts;
+		};
+		typedef utils::concurrent_deque<item>	queue;
+		const int64_t			ITEMS_PER_ROUND = 2048;
+		const int			n_prod = std::max(1, n_threads/2),
+						n_cons = std::max(1, n_threads - n_prod);
+		std::atomic<int64_t>		ops(0),
+						errors(0),
+						rounds(0),
+						waits(0),
+						after_close(0);
+		stats::histogram		lat;
+		const int64_t			start = now_ns(),
+						end = start + secs*1000000000LL;
+		while(now_ns() < end) {
+			queue				q(16);
+			std::atomic<int64_t>		n_pushed(0);
+			counters			pushed = make_counters(n_prod, 0),
+							popped = make_counters(n_prod, 0),
+							seq_sum = make_counters(n_prod, 0);
+			std::vector<std::thread>	prod,
+							cons;
+			auto	check = [&](std::vector<int64_t>& last, const item& it) {
+				lat.record(now_ns() - it.ts);
+				if(it.seq <= last[it.producer])
+					++errors;
+				last[it.producer] = it.seq;
+				popped[it.producer] += 1;
+				seq_sum[it.producer] += it.seq;
+				++ops;
+			};
+			for(int p = 0; p < n_prod; ++p) {
+				prod.push_back(std::thread([&, p]() {
+					int64_t	seq = 0;
+					item	batch[3];
+					while(seq < ITEMS_PER_ROUND) {
+						if(seq%2) {
+							q.push(item{ p, seq++, now_ns() });
+							n_pushed += 1;
+						} else {
+							for(int i = 0; i < 3; ++i)
+								batch[i] = item{ p, seq++, now_ns() };
+							q.push_n(batch, 3);
+							n_pushed += 3;
+						}
+					}
+					pushed[p] = seq;
+				}));
+			}
+			for(int c = 0; c < n_cons; ++c) {
+				cons.push_back(std::thread([&]() {
+					std::vector<int64_t>	last(n_prod, -1);
+					while(true) {
+						item				it;
+						async_waiter<queue::waiter>	aw;
+						if(!q.pop_or_wait(it, &aw.w)) {
+							++waits;
+							if(!aw.wait())
+								++errors;
+						}
+						// closed and empty
+						if(!aw.w.ok)
+							break;
+						check(last, it);
+					}
+				}));
+			}
+			// close before, while and after the producers
+			// push, depending on the round
+			const int64_t	close_at = n_prod*ITEMS_PER_ROUND*(rounds%5)/4;
+			while(n_pushed.load(std::memory_order_relaxed) < close_at)
+				std::this_thread::yield();
+			q.close();
+			for(auto& t : cons)
+				t.join();
+			for(auto& t : prod)
+				t.join();
+			// pushed after the close, nobody waits anymore
+			std::vector<int64_t>	last(n_prod, -1);
+			while(true) {
+				item				it;
+				async_waiter<queue::waiter>	aw;
+				if(!q.pop_or_wait(it, &aw.w))
+					++errors;
+				if(!aw.w.ok)
+					break;
+				++after_close;
+				check(last, it);
+			}
+			for(int p = 0; p < n_prod; ++p) {
+				if(popped[p] != pushed[p] || seq_sum[p] != pushed[p]*(pushed[p] - 1)/2) {
+					ostr << "  round " << rounds << " producer " << p << ": pushed " << pushed[p] << ", popped " << popped[p] << std::endl;
+					++errors;
+				}
+			}
+			++rounds;
+		}
+		const double		elapsed = (now_ns() - start)/1e9;
+		const std::string	name = "deque async " + std::to_string(n_prod) + "p/" + std::to_string(n_cons) + "c";
+		report(ostr, name.c_str(), ops, elapsed, lat, errors);
+		ostr << "    " << rounds << " rounds, " << waits << " waits, " << after_close << " popped after close" << std::endl;
+		return errors;
+	}
+
+	// latency is the time to acquire a holder
+	int pool_test(const int secs, const int n_threads, std::ostream& ostr) {
+		const size_t				N_HOLDERS = 8;
+		const int				n_cap = std::max(1, n_threads/2),
+							n_rel = std::max(1, n_threads - n_cap);
+		utils::frame_buffers			pool(N_HOLDERS, 16, 16, AV_PIX_FMT_RGBA);
+		utils::concurrent_deque<utils::frame_holder*>	q(N_HOLDERS);
+		std::atomic<bool>			stop(false);
+		std::atomic<int64_t>			acquired(0),
+							released(0),
+							errors(0);
+		// who owns each holder, -1 when free
+		counters				owner = make_counters(N_HOLDERS, -1);
+		stats::histogram			lat;
+		std::vector<std::thread>		cap,
+							rel;
+		for(int c = 0; c < n_cap; ++c) {
+			cap.push_back(std::thread([&, c]() {
+				while(!stop.load(std::memory_order_relaxed)) {
+					const int64_t		t = now_ns();
+					utils::frame_holder	*fh = 0;
+					if(c%2) {
+						fh = pool.wait_one();
+					} else {
+						while(!(fh = pool.get_one()) && !stop.load(std::memory_order_relaxed))
+							std::this_thread::yield();
+						if(!fh)
+							break;
+					}
+					lat.record(now_ns() - t);
+					int64_t		exp = -1;
+					if(!owner[fh - pool.fh_].compare_exchange_strong(exp, c))
+						++errors;
+					// trimmed frames have to be back
+					if(!fh->frame->buf[0])
+						++errors;
+					++acquired;
+					q.push(fh);
+				}
+			}));
+		}
+		for(int r = 0; r < n_rel; ++r) {
+			rel.push_back(std::thread([&]() {
+				utils::frame_holder	*buf[N_HOLDERS];
+				size_t			n = 0;
+				while((n = q.pop_n(buf, N_HOLDERS))) {
+					for(size_t i = 0; i < n; ++i) {
+						if(owner[buf[i] - pool.fh_].exchange(-1) < 0)
+							++errors;
+						try {
+							buf[i]->release();
+						} catch(const std::runtime_error&) {
+							// double release
+							++errors;
+						}
+						++released;
+					}
+				}
+			}));
+		}
+		// trims and restores half of the pool
+		std::thread	limiter([&]() {
+			size_t	i = 0;
+			while(!stop.load(std::memory_order_relaxed)) {
+				pool.set_limit((++i%2) ? N_HOLDERS/2 : N_HOLDERS);
+				std::this_thread::sleep_for(std::chrono::microseconds(500));
+			}
+			pool.set_limit(N_HOLDERS);
+		});
+		const int64_t	start = now_ns();
+		std::this_thread::sleep_for(std::chrono::seconds(secs));
+		stop = true;
+		limiter.join();
+		// waiters in wait_one are woken by the releasers
+		for(auto& t : cap)
+			t.join();
+		q.close();
+		for(auto& t : rel)
+			t.join();
+		const double	elapsed = (now_ns() - start)/1e9;
+		if(acquired != released || pool.in_use()) {
+			ostr << "  pool: acquired " << acquired << ", released " << released << ", in use " << pool.in_use() << std::endl;
+			++errors;
+		}
+		const std::string	name = "frame_buffers " + std::to_string(n_cap) + "a/" + std::to_string(n_rel) + "r";
+		report(ostr, name.c_str(), acquired, elapsed, lat, errors);
+		return errors;
+	}
+
+	// get_or_wait racing releases (and set_limit), half
+	// of the acquirers wait with wait_one. Latency is the
+	// time to acquire a holder
+	int pool_async_test(const int secs, const int n_threads, std::ostream& ostr) {
+		typedef utils::frame_buffers::waiter	waiter;
+		const size_t				N_HOLDERS = 4;
+		const int				n_cap = std::max(2, n_threads/2),
+							n_rel = std::max(1, n_threads - n_cap);
+		utils::frame_buffers			pool(N_HOLDERS, 16, 16, AV_PIX_FMT_RGBA);
+		utils::concurrent_deque<utils::frame_holder*>	q(N_HOLDERS);
+		std::atomic<bool>			stop(false);
+		std::atomic<int64_t>			acquired(0),
+							released(0),
+							waits(0),
+							errors(0);
+		counters				owner = make_counters(N_HOLDERS, -1);
+		stats::histogram			lat;
+		std::vector<std::thread>		cap,
+							rel;
+		for(int c = 0; c < n_cap; ++c) {
+			cap.push_back(std::thread([&, c]() {
+				while(!stop.load(std::memory_order_relaxed)) {
+					const int64_t		t = now_ns();
+					utils::frame_holder	*fh = 0;
+					if(c%2) {
+						fh = pool.wait_one();
+					} else {
+						async_waiter<waiter>	aw;
+						if(!pool.get_or_wait(fh, &aw.w)) {
+							++waits;
+							if(!aw.wait())
+								++errors;
+							fh = aw.w.fh;
+						}
+						// as stage::get_buffer
+						if(!fh || !pool.fill(fh)) {
+							++errors;
+							continue;
+						}
+					}
+					lat.record(now_ns() - t);
+					int64_t		exp = -1;
+					if(!owner[fh - pool.fh_].compare_exchange_strong(exp, c))
+						++errors;
+					if(!fh->frame->buf[0])
+						++errors;
+					++acquired;
+					q.push(fh);
+				}
+			}));
+		}
+		for(int r = 0; r < n_rel; ++r) {
+			// one at a time, more releases to race with
+			rel.push_back(std::thread([&]() {
+				utils::frame_holder	*fh = 0;
+				while(q.pop_n(&fh, 1)) {
+					if(owner[fh - pool.fh_].exchange(-1) < 0)
+						++errors;
+					try {
+						fh->release();
+					} catch(const std::runtime_error&) {
+						++errors;
+					}
+					++released;
+				}
+			}));
+		}
+		std::thread	limiter([&]() {
+			size_t	i = 0;
+			while(!stop.load(std::memory_order_relaxed)) {
+				pool.set_limit((++i%2) ? N_HOLDERS/2 : N_HOLDERS);
+				std::this_thread::sleep_for(std::chrono::microseconds(300));
+			}
+			pool.set_limit(N_HOLDERS);
+		});
+		const int64_t	start = now_ns();
+		std::this_thread::sleep_for(std::chrono::seconds(secs));
+		stop = true;
+		limiter.join();
+		for(auto& t : cap)
+			t.join();
+		q.close();
+		for(auto& t : rel)
+			t.join();
+		const double	elapsed = (now_ns() - start)/1e9;
+		if(acquired != released || pool.in_use()) {
+			ostr << "  async pool: acquired " << acquired << ", released " << released << ", in use " << pool.in_use() << std::endl;
+			++errors;
+		}
+		const std::string	name = "frame_buffers async " + std::to_string(n_cap) + "a/" + std::to_string(n_rel) + "r";
+		report(ostr, name.c_str(), acquired, elapsed, lat, errors);
+		ostr << "    " << waits << " waits on get_or_wait" << std::endl;
+		return errors;
+	}
+
+	// latency is get plus put, when get succeeds
+	int slices_test(const int secs, const int n_threads, const int type, const char* name, std::ostream& ostr) {
+		const int	N_SLICES = 8;
+		std::unique_ptr<XCompGrabPool, void(*)(XCompGrabPool*)>	pool(xcompgrab_pool_create(type, N_SLICES, 64), xcompgrab_pool_destroy);
+		if(!pool)
+			throw std::runtime_error("xcompgrab_pool_create failed");
+		// slice pointers, to index the owners
+		void	*slices[N_SLICES];
+		for(int i = 0; i < N_SLICES; ++i)
+			if(!(slices[i] = xcompgrab_pool_get(pool.get())))
+				throw std::runtime_error("xcompgrab pool is short of slices");
+		if(xcompgrab_pool_get(pool.get()))
+			throw std::runtime_error("xcompgrab pool has too many slices");
+		for(int i = 0; i < N_SLICES; ++i)
+			xcompgrab_pool_put(pool.get(), slices[i]);
+		auto	index_of = [&slices](void* p) -> int {
+			for(int i = 0; i < N_SLICES; ++i)
+				if(slices[i] == p)
+					return i;
+			return -1;
+		};
+		std::atomic<bool>		stop(false);
+		std::atomic<int64_t>		ops(0),
+						misses(0),
+						errors(0);
+		counters			owner = make_counters(N_SLICES, -1);
+		stats::histogram		lat;
+		std::vector<std::thread>	th;
+		for(int t = 0; t < n_threads; ++t) {
+			th.push_back(std::thread([&, t]() {
+				while(!stop.load(std::memory_order_relaxed)) {
+					const int64_t	start = now_ns();
+					void		*p = xcompgrab_pool_get(pool.get());
+					if(!p) {
+						++misses;
+						std::this_thread::yield();
+						continue;
+					}
+					const int	idx = index_of(p);
+					int64_t		exp = -1;
+					if(idx < 0 || !owner[idx].compare_exchange_strong(exp, t)) {
+						++errors;
+						continue;
+					}
+					if(owner[idx].exchange(-1) != t)
+						++errors;
+					xcompgrab_pool_put(pool.get(), p);
+					lat.record(now_ns() - start);
+					++ops;
+				}
+			}));
+		}
+		const int64_t	start = now_ns();
+		std::this_thread::sleep_for(std::chrono::seconds(secs));
+		stop = true;
+		for(auto& t : th)
+			t.join();
+		const double	elapsed = (now_ns() - start)/1e9;
+		// all slices have to be free again
+		int	n_free = 0;
+		while(n_free <= N_SLICES && xcompgrab_pool_get(pool.get()))
+			++n_free;
+		if(n_free != N_SLICES) {
+			ostr << "  " << name << ": " << n_free << " free slices out of " << N_SLICES << std::endl;
+			++errors;
+		}
+		const std::string	full = std::string(name) + " " + std::to_string(n_threads) + "t";
+		report(ostr, full.c_str(), ops, elapsed, lat, errors);
+		ostr << "    " << misses << " gets found the pool empty" << std::endl;
+		return errors;
+	}
+}
+
+int stress::run(const int secs, const int n_threads, std::ostream& ostr) {
+	ostr << "Stress, " << secs << " s per structure, " << n_threads << " threads" << std::endl;
+	int	errors = 0;
+	errors += queue_test(secs, n_threads, ostr);
+	errors += queue_async_test(secs, n_threads, ostr);
+	errors += pool_test(secs, n_threads, ostr);
+	errors += pool_async_test(secs, n_threads, ostr);
+	errors += slices_test(secs, n_threads, 1, "xcompgrab internal", ostr);
+	errors += slices_test(secs, n_threads, 2, "xcompgrab GL PBO", ostr);
+	ostr << (errors ? "FAIL: " : "OK: ") << errors << " invariant violations" << std::endl;
+	return errors;
+}
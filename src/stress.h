@@ -0,0 +1,51 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+
+#ifndef _STRESS_H_
+#define _STRESS_H_
+
+#include <ostream>
+
+/* Concurrency stress harness
+ * Hammers the hand-rolled concurrent structures with
+ * many threads for 'secs' seconds each:
+ *  - utils::concurrent_deque, producers and consumers
+ *    with push/push_n and pop/pop_n
+ *  - the same with non blocking consumers (pop_or_wait,
+ *    as stage::pop), closed while producers still push
+ *  - utils::frame_buffers and frame_holder, capture
+ *    threads (get_one/wait_one) handing holders over
+ *    a queue to releasing threads, while the limit is
+ *    changed (set_limit trims and reallocates frames)
+ *  - the same with non blocking waits (get_or_wait and
+ *    fill, as stage::get_buffer) racing the releases
+ *  - the xcompgrab internal and GL PBO slice pools
+ * For each it reports ops/sec and the p50/p99/max latency
+ * and checks invariants: FIFO order per producer, nothing
+ * lost or duplicated, no holder or slice owned twice, no
+ * double release, no waiter woken twice, everything
+ * released at the end.
+ * Meant to be run both optimised (make release) and
+ * under ThreadSanitizer (make tsan).
+ */
+namespace stress {
+	// returns the number of invariant violations
+	extern int run(const int secs, const int n_threads, std::ostream& ostr);
+}
+
+#endif //_STRESS_H_
@@ -0,0 +1,284 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+#include "tilecodec.h"
+#include "stage.h"
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <lz4.h> // liblz4-dev
+#include "stats.h"
+extern "C" {
+	#include <libavutil/time.h>
+}
+
+namespace {
+	inline void tile_rect(const tilecodec::file_header& hdr, const int tiles_x, const uint32_t idx, int& x, int& y, int& w, int& h) {
+		x = (idx%tiles_x)*hdr.tile_size;
+		y = (idx/tiles_x)*hdr.tile_size;
+		w = std::min(hdr.tile_size, hdr.width - x);
+		h = std::min(hdr.tile_size, hdr.height - y);
+	}
+
+	// simple multiply/xor hash, good enough
+	// to spot changed tiles and quite fast
+	inline uint64_t tile_hash(const uint8_t* data, const int linesize, const int x, const int y, const int w, const int h) {
+		uint64_t	hash = 0xcbf29ce484222325ULL;
+		const size_t	row_bytes = w*4;
+		for(int j = 0; j < h; ++j) {
+			const uint8_t	*row = data + (y+j)*linesize + x*4;
+			size_t		i = 0;
+			for(; i + 8 <= row_bytes; i += 8) {
+				uint64_t	v;
+				std::memcpy(&v, row + i, 8);
+				hash = (hash ^ v) * 0x9e3779b97f4a7c15ULL;
+				hash ^= hash >> 32;
+			}
+			for(; i < row_bytes; ++i)
+				hash = (hash ^ row[i]) * 0x100000001b3ULL;
+		}
+		return hash;
+	}
+
+	void check_pix_fmt(const AVPixelFormat pix_fmt) {
+		switch(pix_fmt) {
+		case AV_PIX_FMT_RGBA:
+		case AV_PIX_FMT_BGRA:
+		case AV_PIX_FMT_RGB0:
+		case AV_PIX_FMT_BGR0:
+			break;
+		default:
+			throw std::runtime_error("tilecodec supports only 4 bytes per pixel formats");
+		}
+	}
+
+	// runs on the shared executor, no thread of its own
+	class impl : public writer::iface {
+		writer::params		params_;
+		writer::frame_queue&	fq_;
+		std::latch		*done_;
+
+		// hashing and compression run on the executor,
+		// file operations on the I/O thread
+		stage::task run(void) {
+			using namespace utils;
+
+			std::unique_ptr<tilecodec::encoder>	enc;
+			co_await stage::io([&]() { enc.reset(new tilecodec::encoder(params_.outfile, params_.width, params_.height, params_.pix_fmt, params_.fps)); });
+			int64_t			written_frames = 0,
+						written_tiles = 0;
+			stats::histogram	&latency = stats::get_histogram("latency.capture_to_encode_us");
+			frame_holder		*fh = 0;
+			while(co_await stage::pop(fq_, fh)) {
+				written_tiles += enc->compress(fh->frame->data[0], fh->frame->linesize[0], fh->frame->pts);
+				latency.record(av_gettime_relative() - fh->ts);
+				++written_frames;
+				fh->release();
+				co_await stage::io([&]() { enc->write(); });
+			}
+			co_await stage::io([&]() { enc.reset(); });
+			std::cout << "Written " << written_frames << " frames (" << written_tiles << " tiles)" << std::endl;
+		}
+	public:
+		impl(const writer::params& p, writer::frame_queue& fq) : params_(p), fq_(fq), done_(0) {
+			check_pix_fmt(params_.pix_fmt);
+		}
+
+		void start(void) {
+			if(done_)
+				throw std::runtime_error("already running");
+			done_ = new std::latch(1);
+			stage::shared().spawn(run(), done_);
+		}
+
+		void stop(void) {
+			if(!done_)
+				return;
+			// the writer drains what's left, then exits
+			fq_.close();
+			done_->wait();
+			delete done_;
+			done_ = 0;
+		}
+
+		~impl() {
+			stop();
+		}
+	};
+
+	// reads and decompresses on the I/O thread, then fills
+	// a pool frame with the canvas on the executor
+	stage::task decode(tilecodec::decoder& dec, utils::frame_buffers& frame_bufs, writer::frame_queue& fq) {
+		const auto&		hdr = dec.header();
+		const int		linesize = hdr.width*4;
+		std::vector<uint8_t>	canvas(linesize*hdr.height, 0);
+		int64_t			pts = 0;
+		bool			key = false,
+					first = true,
+					more = false;
+		while(true) {
+			co_await stage::io([&]() { more = dec.decode(&canvas[0], linesize, pts, key); });
+			if(!more)
+				break;
+			if(first && !key)
+				throw std::runtime_error("tilecodec stream doesn't start with a key frame");
+			first = false;
+			utils::frame_holder	*cur_fh = co_await stage::get_buffer(frame_bufs);
+			AVFrame			*f = cur_fh->frame.get();
+			av_image_copy_plane(f->data[0], f->linesize[0], &canvas[0], linesize, linesize, hdr.height);
+			f->pts = pts;
+			fq.push(cur_fh);
+		}
+	}
+}
+
+tilecodec::encoder::encoder(const char* outfile, const int w, const int h, const AVPixelFormat pix_fmt, const int fps) : ostr_(outfile, std::ios_base::binary), n_frames_(0) {
+	check_pix_fmt(pix_fmt);
+	if(!ostr_)
+		throw std::runtime_error((std::string("Can't open tilecodec output file ") + outfile).c_str());
+	hdr_.magic = MAGIC;
+	hdr_.version = VERSION;
+	hdr_.width = w;
+	hdr_.height = h;
+	hdr_.pix_fmt = pix_fmt;
+	hdr_.fps = fps;
+	hdr_.tile_size = TILE_SIZE;
+	hdr_.keyint = KEYFRAME_SECS*fps;
+	tiles_x_ = (w + TILE_SIZE - 1)/TILE_SIZE;
+	tiles_y_ = (h + TILE_SIZE - 1)/TILE_SIZE;
+	hashes_.resize(tiles_x_*tiles_y_, 0);
+	changed_.reserve(tiles_x_*tiles_y_);
+	tile_buf_.resize(TILE_SIZE*TILE_SIZE*4);
+	comp_buf_.resize(LZ4_compressBound(tile_buf_.size()));
+	// tiles are stored raw when they don't compress
+	out_.resize(sizeof(tilecodec::frame_header) + hashes_.size()*(sizeof(tilecodec::tile_header) + tile_buf_.size()));
+	out_n_ = 0;
+	ostr_.write((const char*)&hdr_, sizeof(hdr_));
+}
+
+int tilecodec::encoder::compress(const uint8_t* data, const int linesize, const int64_t pts) {
+	const bool	key = !(n_frames_++ % hdr_.keyint);
+	int		x, y, w, h;
+	// 1. find out changed tiles
+	changed_.clear();
+	for(uint32_t i = 0; i < hashes_.size(); ++i) {
+		tile_rect(hdr_, tiles_x_, i, x, y, w, h);
+		const uint64_t	cur_hash = tile_hash(data, linesize, x, y, w, h);
+		if(key || cur_hash != hashes_[i]) {
+			hashes_[i] = cur_hash;
+			changed_.push_back(i);
+		}
+	}
+	// 2. compress those
+	const tilecodec::frame_header	fhdr = { pts, key ? 1U : 0U, (uint32_t)changed_.size() };
+	out_n_ = 0;
+	append(&fhdr, sizeof(fhdr));
+	for(const auto& i : changed_) {
+		tile_rect(hdr_, tiles_x_, i, x, y, w, h);
+		const int	row_bytes = w*4;
+		for(int j = 0; j < h; ++j)
+			std::memcpy(&tile_buf_[j*row_bytes], data + (y+j)*linesize + x*4, row_bytes);
+		const int	raw_size = row_bytes*h;
+		const int	csize = LZ4_compress_default(&tile_buf_[0], &comp_buf_[0], raw_size, comp_buf_.size());
+		if(csize > 0 && csize < raw_size) {
+			const tilecodec::tile_header	thdr = { i, csize };
+			append(&thdr, sizeof(thdr));
+			append(&comp_buf_[0], csize);
+		} else {
+			const tilecodec::tile_header	thdr = { i, -raw_size };
+			append(&thdr, sizeof(thdr));
+			append(&tile_buf_[0], raw_size);
+		}
+	}
+	return changed_.size();
+}
+
+void tilecodec::encoder::write(void) {
+	ostr_.write(&out_[0], out_n_);
+	out_n_ = 0;
+	if(!ostr_)
+		throw std::runtime_error("Can't write tilecodec frame");
+}
+
+int tilecodec::encoder::encode(const uint8_t* data, const int linesize, const int64_t pts) {
+	const int	rv = compress(data, linesize, pts);
+	write();
+	return rv;
+}
+
+tilecodec::decoder::decoder(const char* infile) : istr_(infile, std::ios_base::binary) {
+	if(!istr_)
+		throw std::runtime_error((std::string("Can't open tilecodec input file ") + infile).c_str());
+	if(!istr_.read((char*)&hdr_, sizeof(hdr_)) || hdr_.magic != MAGIC)
+		throw std::runtime_error("Invalid tilecodec file");
+	if(hdr_.version != VERSION)
+		throw std::runtime_error("Unsupported tilecodec version");
+	if(hdr_.width <= 0 || hdr_.height <= 0 || hdr_.tile_size <= 0 || hdr_.fps <= 0)
+		throw std::runtime_error("Invalid tilecodec header");
+	tiles_x_ = (hdr_.width + hdr_.tile_size - 1)/hdr_.tile_size;
+	tiles_y_ = (hdr_.height + hdr_.tile_size - 1)/hdr_.tile_size;
+	tile_buf_.resize(hdr_.tile_size*hdr_.tile_size*4);
+	comp_buf_.resize(LZ4_compressBound(tile_buf_.size()));
+}
+
+bool tilecodec::decoder::decode(uint8_t* data, const int linesize, int64_t& pts, bool& key) {
+	tilecodec::frame_header	fhdr;
+	if(!istr_.read((char*)&fhdr, sizeof(fhdr)))
+		return false;
+	pts = fhdr.pts;
+	key = fhdr.key;
+	int	x, y, w, h;
+	for(uint32_t i = 0; i < fhdr.n_tiles; ++i) {
+		tilecodec::tile_header	thdr;
+		if(!istr_.read((char*)&thdr, sizeof(thdr)) || thdr.idx >= (uint32_t)(tiles_x_*tiles_y_))
+			throw std::runtime_error("Invalid tilecodec tile header");
+		tile_rect(hdr_, tiles_x_, thdr.idx, x, y, w, h);
+		const int	row_bytes = w*4,
+				raw_size = row_bytes*h;
+		if(thdr.csize < 0) {
+			if(-thdr.csize != raw_size || !istr_.read(&tile_buf_[0], raw_size))
+				throw std::runtime_error("Invalid tilecodec raw tile");
+		} else {
+			if(thdr.csize > (int)comp_buf_.size() || !istr_.read(&comp_buf_[0], thdr.csize))
+				throw std::runtime_error("Invalid tilecodec compressed tile");
+			if(LZ4_decompress_safe(&comp_buf_[0], &tile_buf_[0], thdr.csize, tile_buf_.size()) != raw_size)
+				throw std::runtime_error("Can't decompress tilecodec tile");
+		}
+		for(int j = 0; j < h; ++j)
+			std::memcpy(data + (y+j)*linesize + x*4, &tile_buf_[j*row_bytes], row_bytes);
+	}
+	return true;
+}
+
+writer::iface* tilecodec::init(const writer::params& p, writer::frame_queue& fq) {
+	return new impl(p, fq);
+}
+
+void tilecodec::convert(const char* infile, const char* outfile) {
+	using namespace utils;
+
+	tilecodec::decoder	dec(infile);
+	const auto&		hdr = dec.header();
+	writer::frame_queue	fq;
+	frame_buffers		frame_bufs(16, hdr.width, hdr.height, (AVPixelFormat)hdr.pix_fmt);
+	std::unique_ptr<writer::iface>	w(writer::init(writer::params{hdr.fps, hdr.width, hdr.height, (AVPixelFormat)hdr.pix_fmt, outfile, hdr.width, hdr.height, 1, -1, {}, 0, 0}, fq));
+	w->start();
+	std::latch		done(1);
+	stage::shared().spawn(decode(dec, frame_bufs, fq), &done);
+	done.wait();
+	w->stop();
+}
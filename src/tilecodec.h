@@ -0,0 +1,127 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+#ifndef _TILECODEC_H_
+#define _TILECODEC_H_
+
+#include "writer.h"
+#include <fstream>
+#include <vector>
+#include <cstring>
+
+/* Lightweight incremental screen codec
+ * The frame is split in square tiles, each tile is
+ * hashed and only the tiles whose hash differs from
+ * the previous frame are LZ4 compressed and stored.
+ * Every 'keyint' frames all tiles are stored (key frame)
+ * so that a reader can start decoding from there.
+ * Only packed 4 bytes per pixel formats are supported
+ * (i.e. RGBA from xcompgrab, BGR0 from x11grab).
+ *
+ * File layout (native endianness):
+ *   file_header
+ *   [frame_header [tile_header data]*n_tiles]*
+ */
+namespace tilecodec {
+	const uint32_t	MAGIC = 0x43545052; // "RPTC"
+	const uint32_t	VERSION = 1;
+	const int	TILE_SIZE = 64;
+	const int	KEYFRAME_SECS = 2;
+
+	struct file_header {
+		uint32_t	magic;
+		uint32_t	version;
+		int32_t		width;
+		int32_t		height;
+		int32_t		pix_fmt;
+		int32_t		fps;
+		int32_t		tile_size;
+		int32_t		keyint;
+	};
+
+	struct frame_header {
+		int64_t		pts;
+		uint32_t	key;
+		uint32_t	n_tiles;
+	};
+
+	struct tile_header {
+		uint32_t	idx;
+		// < 0 means tile is stored uncompressed
+		// with -csize bytes
+		int32_t		csize;
+	};
+
+	class encoder {
+		std::ofstream		ostr_;
+		file_header		hdr_;
+		int			tiles_x_,
+					tiles_y_;
+		std::vector<uint64_t>	hashes_;
+		std::vector<char>	tile_buf_,
+					comp_buf_;
+		std::vector<uint32_t>	changed_;
+		// one encoded frame, sized for the worst case
+		std::vector<char>	out_;
+		size_t			out_n_;
+		int64_t			n_frames_;
+
+		inline void append(const void* p, const size_t n) {
+			std::memcpy(&out_[out_n_], p, n);
+			out_n_ += n;
+		}
+	public:
+		encoder(const char* outfile, const int w, const int h, const AVPixelFormat pix_fmt, const int fps);
+
+		// encodes a frame in memory (the source can be
+		// released afterwards), returns number of tiles
+		int compress(const uint8_t* data, const int linesize, const int64_t pts);
+
+		// writes the last compressed frame to the file
+		void write(void);
+
+		// compress and write, returns number of tiles
+		int encode(const uint8_t* data, const int linesize, const int64_t pts);
+	};
+
+	class decoder {
+		std::ifstream		istr_;
+		file_header		hdr_;
+		int			tiles_x_,
+					tiles_y_;
+		std::vector<char>	comp_buf_,
+					tile_buf_;
+	public:
+		decoder(const char* infile);
+
+		inline const file_header& header(void) const { return hdr_; }
+
+		// applies next frame changes on 'data'
+		// returns false on end of stream
+		bool decode(uint8_t* data, const int linesize, int64_t& pts, bool& key);
+	};
+
+	// writer replacement which encodes frames
+	// with this codec instead of libavcodec
+	extern writer::iface* init(const writer::params& p, writer::frame_queue& fq);
+
+	// converts a tile codec file into a standard
+	// video file using the default writer
+	extern void convert(const char* infile, const char* outfile);
+}
+
+#endif //_TILECODEC_H_
@@ -19,10 +19,13 @@
 #define _UTILS_H_
 
 #include <memory>
-#include <deque>
+#include <vector>
+#include <algorithm>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
+#include <stdexcept>
+#include "numa_utils.h"
 // needed because of C libraries
 extern "C" {
 	#include <libavformat/avformat.h> // libavcodec-dev libavformat-dev libavutil-dev
@@ -32,34 +35,185 @@ extern "C" {
 }
 
 namespace utils {
+	// FIFO on a ring buffer, it only allocates
+	// when full (doubling), never in steady state.
+	// Once closed, pops fail as soon as it's empty.
 	template<typename T>
 	class concurrent_deque {
+	public:
+		// consumer which doesn't block (i.e. a coroutine),
+		// 'wake' is called by the pushing (or closing) thread
+		// once 'out' has been set ('ok' false when closed)
+		struct waiter {
+			T		*out;
+			bool		ok;
+			waiter		*next;
+			void		(*wake)(waiter*);
+		};
+	private:
 		std::mutex		mtx_;
 		std::condition_variable	cv_;
-		std::deque<T>		d_;
+		std::vector<T>		buf_;
+		size_t			head_,
+					n_;
+		bool			closed_;
+		// FIFO, only when the buffer is empty
+		waiter			*w_head_,
+					*w_tail_;
+
+		// under lock, hands 'in' to the first waiter
+		// which is then woken up by the caller
+		inline waiter* deliver(const T& in) {
+			waiter	*w = w_head_;
+			if(!(w_head_ = w->next))
+				w_tail_ = 0;
+			*w->out = in;
+			w->ok = true;
+			return w;
+		}
+
+		void grow(void) {
+			std::vector<T>	nb(buf_.size()*2);
+			for(size_t i = 0; i < n_; ++i)
+				nb[i] = buf_[(head_ + i)%buf_.size()];
+			buf_.swap(nb);
+			head_ = 0;
+		}
 	public:
+		concurrent_deque(const size_t capacity = 256) : buf_(capacity ? capacity : 1), head_(0), n_(0), closed_(false), w_head_(0), w_tail_(0) {
+		}
+
 		inline void push(const T& in) {
 			std::unique_lock<std::mutex>	ul(mtx_);
-			d_.push_back(in);
+			if(w_head_) {
+				waiter	*w = deliver(in);
+				ul.unlock();
+				w->wake(w);
+				return;
+			}
+			if(n_ == buf_.size())
+				grow();
+			buf_[(head_ + n_)%buf_.size()] = in;
+			++n_;
 			cv_.notify_all();
 		}
 
+		// one wakeup for the whole batch
+		inline void push_n(const T* in, const size_t n) {
+			if(!n)
+				return;
+			std::unique_lock<std::mutex>	ul(mtx_);
+			waiter	*woken = 0,
+				**w_last = &woken;
+			size_t	i = 0;
+			for(; i < n && w_head_; ++i) {
+				*w_last = deliver(in[i]);
+				w_last = &(*w_last)->next;
+			}
+			*w_last = 0;
+			while(n_ + n - i > buf_.size())
+				grow();
+			for(size_t j = i; j < n; ++j)
+				buf_[(head_ + n_ + j - i)%buf_.size()] = in[j];
+			n_ += n - i;
+			if(n_)
+				cv_.notify_all();
+			ul.unlock();
+			wake_all(woken);
+		}
+
+		// pops right away when possible (returns true),
+		// otherwise 'w' gets the next element
+		inline bool pop_or_wait(T& out, waiter* w) {
+			std::unique_lock<std::mutex>	ul(mtx_);
+			if(!n_ && !closed_) {
+				w->out = &out;
+				w->next = 0;
+				if(w_tail_)
+					w_tail_->next = w;
+				else
+					w_head_ = w;
+				w_tail_ = w;
+				return false;
+			}
+			if((w->ok = n_ > 0)) {
+				out = buf_[head_];
+				head_ = (head_ + 1)%buf_.size();
+				--n_;
+			}
+			return true;
+		}
+
 		inline bool pop(T& out, size_t tmout_ms = 100) {
 			std::unique_lock<std::mutex>	ul(mtx_);
-			if(!cv_.wait_for(ul, std::chrono::milliseconds(tmout_ms), [this](){ return !d_.empty(); }))
+			if(!cv_.wait_for(ul, std::chrono::milliseconds(tmout_ms), [this](){ return n_ > 0 || closed_; }) || !n_)
 				return false;
-			out = *d_.begin();
-			d_.pop_front();
+			out = buf_[head_];
+			head_ = (head_ + 1)%buf_.size();
+			--n_;
 			return true;
 		}
+
+		// blocks (no timeout) until at least one element
+		// is available, then takes up to 'max' of them;
+		// returns 0 only once closed and empty
+		inline size_t pop_n(T* out, const size_t max) {
+			std::unique_lock<std::mutex>	ul(mtx_);
+			cv_.wait(ul, [this](){ return n_ > 0 || closed_; });
+			const size_t	n = std::min(n_, max);
+			for(size_t i = 0; i < n; ++i) {
+				out[i] = buf_[head_];
+				head_ = (head_ + 1)%buf_.size();
+			}
+			n_ -= n;
+			return n;
+		}
+
+		// wakes up all the consumers, no more
+		// elements are expected
+		inline void close(void) {
+			std::unique_lock<std::mutex>	ul(mtx_);
+			closed_ = true;
+			cv_.notify_all();
+			waiter	*woken = w_head_;
+			w_head_ = w_tail_ = 0;
+			for(waiter* w = woken; w; w = w->next)
+				w->ok = false;
+			ul.unlock();
+			wake_all(woken);
+		}
+
+		// 'next' is read before waking, the
+		// waiter may be gone right after
+		static inline void wake_all(waiter* w) {
+			while(w) {
+				waiter	*next = w->next;
+				w->wake(w);
+				w = next;
+			}
+		}
+
+		inline size_t size(void) {
+			std::unique_lock<std::mutex>	ul(mtx_);
+			return n_;
+		}
 	};
 
+	class frame_buffers;
+
 	struct frame_holder {
 		std::unique_ptr<AVFrame, void(*)(AVFrame*)>	frame;
 		std::atomic<bool>				used;
-		uint8_t						padding[40];
+		// frame buffers belong to the pool and
+		// are kept across uses
+		bool						pooled;
+		// capture time (av_gettime_relative)
+		int64_t						ts;
+		// pool to notify on release, if any
+		frame_buffers					*owner;
+		uint8_t						padding[24];
 
-		frame_holder() : frame(av_frame_alloc(), [](AVFrame* p){ if(p) av_frame_free(&p); }), used(false) {
+		frame_holder() : frame(av_frame_alloc(), [](AVFrame* p){ if(p) av_frame_free(&p); }), used(false), pooled(false), ts(0), owner(0) {
 		}
 
 		inline bool try_lock(void) {
@@ -69,37 +223,226 @@ namespace utils {
 			return false;
 		}
 
-		inline void release(void) {
-			bool	v = true;
-			if(!used.compare_exchange_strong(v, false))
-				throw std::runtime_error("This is not possible!");
+		// drops the frame data reference, unless
+		// the buffer belongs to the pool
+		inline void release(void);
+
+		// as release, but nobody is notified
+		// (i.e. it was never handed out)
+		inline void unlock(void) {
+			used.store(false);
 		}
 	};
 
 	static_assert(sizeof(frame_holder) == 64, "frame_holder must be size of cacheline");
 
 	class frame_buffers {
+	public:
+		// as concurrent_deque::waiter, 'wake' is called
+		// by the releasing thread with 'fh' locked
+		struct waiter {
+			frame_holder	*fh;
+			waiter		*next;
+			void		(*wake)(waiter*);
+		};
+	private:
 		const size_t		n_;
+		// only the first limit_ holders are handed out
+		std::atomic<size_t>	limit_;
+		// preallocated frames properties
+		const int		width_,
+					height_,
+					numa_node_;
+		const AVPixelFormat	pix_fmt_;
+		// threads blocked in wait_one
+		std::mutex		wait_mtx_;
+		std::condition_variable	wait_cv_;
+		std::atomic<int>	waiters_;
+		// releases seen while waiters_ > 0
+		uint64_t		releases_;
+		// non blocking waiters, FIFO
+		waiter			*w_head_,
+					*w_tail_;
 	public:
 		frame_holder		*fh_;
+	private:
+		bool alloc_frame(frame_holder& fh) {
+			AVFrame	*f = fh.frame.get();
+			f->width = width_;
+			f->height = height_;
+			f->format = pix_fmt_;
+			if(av_frame_get_buffer(f, 64) < 0)
+				return false;
+			for(int j = 0; j < AV_NUM_DATA_POINTERS && f->buf[j]; ++j)
+				numa_utils::bind_memory(f->buf[j]->data, f->buf[j]->size, numa_node_);
+			fh.pooled = true;
+			return true;
+		}
 	public:
-		frame_buffers(const size_t n) : n_(n), fh_(new frame_holder[n]) {
+		frame_buffers(const size_t n) : n_(n), limit_(n), width_(0), height_(0), numa_node_(-1), pix_fmt_(AV_PIX_FMT_NONE), waiters_(0), releases_(0), w_head_(0), w_tail_(0), fh_(new frame_holder[n]) {
+			for(size_t i = 0; i < n_; ++i)
+				fh_[i].owner = this;
+		}
+
+		// preallocates all the frames, rows are padded
+		// to a multiple of 64 bytes (SIMD friendly for
+		// scaler and encoder) and bound to 'numa_node'
+		frame_buffers(const size_t n, const int width, const int height, const AVPixelFormat pix_fmt, const int numa_node = -1) : n_(n), limit_(n), width_(width), height_(height), numa_node_(numa_node), pix_fmt_(pix_fmt), waiters_(0), releases_(0), w_head_(0), w_tail_(0), fh_(new frame_holder[n]) {
+			for(size_t i = 0; i < n_; ++i) {
+				fh_[i].owner = this;
+				if(!alloc_frame(fh_[i])) {
+					delete [] fh_;
+					throw std::runtime_error("Can't allocate frame buffers pool");
+				}
+			}
 		}
 
 		~frame_buffers() {
 			delete [] fh_;
 		}
 
-		inline frame_holder* get_one(void) {
-			for(size_t i = 0; i < n_; ++i) {
-				if(fh_[i].try_lock()) {
+		// locks the first free holder, which may still
+		// have to be allocated again (see fill)
+		inline frame_holder* try_get(void) {
+			const size_t	limit = limit_.load(std::memory_order_relaxed);
+			for(size_t i = 0; i < limit; ++i) {
+				if(fh_[i].try_lock())
 					return &fh_[i];
-				}
 			}
 			return 0;
 		}
+
+		// allocates again a holder trimmed by set_limit,
+		// on failure the holder is unlocked
+		inline bool fill(frame_holder* fh) {
+			if(!fh->pooled || fh->frame->buf[0] || alloc_frame(*fh))
+				return true;
+			fh->unlock();
+			return false;
+		}
+
+		inline frame_holder* get_one(void) {
+			frame_holder	*rv = try_get();
+			if(rv && !fill(rv))
+				return 0;
+			return rv;
+		}
+
+		// as get_one, but sleeps until a
+		// holder is released instead of failing
+		frame_holder* wait_one(void) {
+			frame_holder	*rv = get_one();
+			if(rv)
+				return rv;
+			std::unique_lock<std::mutex>	ul(wait_mtx_);
+			++waiters_;
+			// a release between get_one and try_get either
+			// is seen here or sees the waiter. Allocations
+			// happen unlocked, releases meanwhile are counted
+			while(true) {
+				const uint64_t	releases = releases_;
+				if((rv = try_get())) {
+					ul.unlock();
+					const bool	ok = fill(rv);
+					ul.lock();
+					if(ok)
+						break;
+				}
+				wait_cv_.wait(ul, [this, releases](){ return releases_ != releases; });
+			}
+			--waiters_;
+			return rv;
+		}
+
+		// as try_get, otherwise 'w' gets the next holder
+		// released (returns false); either way the
+		// holder has to be filled by the caller
+		bool get_or_wait(frame_holder*& out, waiter* w) {
+			if((out = try_get()))
+				return true;
+			std::unique_lock<std::mutex>	ul(wait_mtx_);
+			++waiters_;
+			if((out = try_get())) {
+				--waiters_;
+				return true;
+			}
+			w->fh = 0;
+			w->next = 0;
+			if(w_tail_)
+				w_tail_->next = w;
+			else
+				w_head_ = w;
+			w_tail_ = w;
+			return false;
+		}
+
+		// called by frame_holder::release, cheap
+		// when nobody is waiting
+		inline void notify_release(void) {
+			if(!waiters_.load())
+				return;
+			std::unique_lock<std::mutex>	ul(wait_mtx_);
+			++releases_;
+			wait_cv_.notify_all();
+			if(!w_head_)
+				return;
+			// no allocations here, the waiter fills it
+			frame_holder	*fh = try_get();
+			if(!fh)
+				return;
+			waiter	*w = w_head_;
+			if(!(w_head_ = w->next))
+				w_tail_ = 0;
+			--waiters_;
+			w->fh = fh;
+			ul.unlock();
+			w->wake(w);
+		}
+
+		inline size_t in_use(void) const {
+			size_t	rv = 0;
+			for(size_t i = 0; i < n_; ++i)
+				if(fh_[i].used)
+					++rv;
+			return rv;
+		}
+
+		inline size_t size(void) const {
+			return n_;
+		}
+
+		inline size_t limit(void) const {
+			return limit_.load(std::memory_order_relaxed);
+		}
+
+		// restricts the holders handed out to the first 'n',
+		// the memory of the idle preallocated frames above
+		// it is given back (busy ones are left alone)
+		void set_limit(const size_t n) {
+			const size_t	limit = std::max((size_t)1, std::min(n, n_));
+			limit_.store(limit, std::memory_order_relaxed);
+			for(size_t i = limit; i < n_; ++i) {
+				// 'pooled' is owned by whoever holds
+				// the lock, check it only after taking it
+				if(!fh_[i].try_lock())
+					continue;
+				if(fh_[i].pooled)
+					av_frame_unref(fh_[i].frame.get());
+				fh_[i].release();
+			}
+		}
 	};
 
+	inline void frame_holder::release(void) {
+		if(!pooled)
+			av_frame_unref(frame.get());
+		bool	v = true;
+		if(!used.compare_exchange_strong(v, false))
+			throw std::runtime_error("This is not possible!");
+		if(owner)
+			owner->notify_release();
+	}
+
 	inline void averror(const int err) {
 		if(err < 0) {
 			char	buf[512];
@@ -16,20 +16,45 @@
  * */
 
 #include "writer.h"
+#include "scaler.h"
+#include "execpool.h"
+#include "numa_utils.h"
+#include "stats.h"
+#include "alloc_check.h"
+#include "phash.h"
 #include <thread>
 #include <iostream>
+#include <deque>
+#include <cstdlib>
+extern "C" {
+	#include <libavutil/time.h>
+}
 
 namespace {
 	class impl : public writer::iface {
+		// nominal encoder bitrate
+		static const int64_t	BIT_RATE = 40*1000*1000;
+		// packets kept in memory when asked to
+		static const size_t	MAX_BACKLOG = 256*1024*1024;
+		// max frames taken from the queue at once
+		static const size_t	MAX_BATCH = 16;
+
 		writer::params		params_;
 		writer::frame_queue&	fq_;
-		std::atomic<bool>	run_;
 		std::thread		*th_;
 
 		void run(void) {
 			using namespace utils;
 
-			const char	*outfile = "output.mkv";
+			// do this first, so that all the buffers
+			// are on this node (the scaler bands run on
+			// the pool of the same node)
+			numa_utils::run_on_node(params_.numa_node);
+			alloc_check::set_stage(alloc_check::WRITER);
+			// this recording's share of the process
+			// pool of our node, one encoder
+			std::unique_ptr<execpool::client>	pool(execpool::attach(1, params_.numa_node));
+			const char	*outfile = params_.outfile;
 			AVOutputFormat  *ofmt = av_guess_format(0, outfile, 0);
 			if(!ofmt)
 				throw std::runtime_error("av_guess_format");
@@ -46,26 +71,46 @@ namespace {
 			strm->avg_frame_rate = (AVRational){params_.fps, 1};
 			auto		*pc = avcodec_alloc_context3(penc);
 			std::unique_ptr<AVCodecContext, void(*)(AVCodecContext*)>	ocodec(pc, [](AVCodecContext* p){ if(p) avcodec_free_context(&p); });
+			// all the planes of our frames live on the node
+			auto	bind_frame = [this](const AVFrame* f) {
+				for(int i = 0; i < AV_NUM_DATA_POINTERS && f->buf[i]; ++i)
+					numa_utils::bind_memory(f->buf[i]->data, f->buf[i]->size, params_.numa_node);
+			};
 			// setup additinal info about codec
 			ocodec->pix_fmt  = AV_PIX_FMT_YUV420P;
-			ocodec->bit_rate = 40*1000*1000;
-			ocodec->width = params_.ccodec->width;
-			ocodec->height = params_.ccodec->height;
+			ocodec->bit_rate = BIT_RATE;
+			ocodec->width = params_.out_width;
+			ocodec->height = params_.out_height;
 			ocodec->time_base = (AVRational){1, params_.fps};
 			ocodec->framerate = (AVRational){params_.fps, 1};
 			ocodec->gop_size = 12;
 			ocodec->max_b_frames = 1;
+			// the sinks cut the stream at keyframes (the
+			// archive restores each GOP on its own), don't
+			// rely on the encoder default
+			if(!params_.sinks.empty())
+				ocodec->flags |= AV_CODEC_FLAG_CLOSED_GOP;
 			// fix about global headers
 			if(octx->oformat->flags & AVFMT_GLOBALHEADER)
 				octx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 			// codec params
 			AVDictionary *param = 0;
 			av_dict_set(&param, "preset", "ultrafast", 0);
+			execpool::bind(ocodec.get(), penc, pool.get());
 			// bind context codec
 			averror(avcodec_open2(ocodec.get(), penc, &param));
 			av_dict_free(&param);
 			// fill in the context parameters
 			averror(avcodec_parameters_from_context(strm->codecpar, ocodec.get()));
+			// audio is muxed as captured (PCM)
+			AVStream	*astrm = 0;
+			if(params_.audio) {
+				if(!(astrm = avformat_new_stream(octx.get(), 0)))
+					throw std::runtime_error("avformat_new_stream");
+				averror(avcodec_parameters_copy(astrm->codecpar, params_.audio->codecpar()));
+				astrm->codecpar->codec_tag = 0;
+				astrm->time_base = (AVRational){1, astrm->codecpar->sample_rate};
+			}
 			// in case we have to create a file, do it...
 			if(!(octx->flags & AVFMT_NOFILE)) {
 				averror(avio_open2(&octx->pb , outfile , AVIO_FLAG_WRITE, 0, 0));
@@ -75,71 +120,225 @@ namespace {
 				throw std::runtime_error("We have no output streams");
 			// write the header
 			averror(avformat_write_header(octx.get(), 0));
+			// if we have to downscale and we can, do it
+			// with our scaler first, then sws_scale has
+			// only to convert the pixel format
+			std::unique_ptr<scaler::iface>			scl;
+			std::unique_ptr<AVFrame, void(*)(AVFrame*)>	sframe(av_frame_alloc(), [](AVFrame* p){ if(p) av_frame_free(&p); });
+			if((ocodec->width != params_.width || ocodec->height != params_.height) && scaler::is_supported(params_.pix_fmt)) {
+				scl.reset(scaler::init(params_.width, params_.height, ocodec->width, ocodec->height, params_.scale_threads, pool.get()));
+				sframe->width = ocodec->width;
+				sframe->height = ocodec->height;
+				sframe->format = params_.pix_fmt;
+				averror(av_frame_get_buffer(sframe.get(), 32));
+				bind_frame(sframe.get());
+				std::cout << "Downscaling " << params_.width << "x" << params_.height << " -> " << ocodec->width << "x" << ocodec->height
+					<< " (" << scl->name() << ", " << params_.scale_threads << " bands)" << std::endl;
+			}
 			// add the context to convert frames...
-			SwsContext	*swsctx = sws_getContext(params_.ccodec->width,
-	                	params_.ccodec->height,
-	                	params_.ccodec->pix_fmt,
+			SwsContext	*swsctx = sws_getContext(scl ? ocodec->width : params_.width,
+	                	scl ? ocodec->height : params_.height,
+	                	params_.pix_fmt,
 	                	ocodec->width,
 				ocodec->height,
 	                	ocodec->pix_fmt,
-	                	SWS_BICUBIC, NULL, NULL, NULL);
+	                	scl ? SWS_POINT : SWS_BICUBIC, NULL, NULL, NULL);
 			// output frame
 			std::unique_ptr<AVFrame, void(*)(AVFrame*)>	oframe(av_frame_alloc(), [](AVFrame* p){ if(p) av_frame_free(&p); });
 			oframe->width = ocodec->width;
 			oframe->height = ocodec->height;
 			oframe->format = AV_PIX_FMT_YUV420P;
-			const int	nbytes = av_image_get_buffer_size(ocodec->pix_fmt, ocodec->width, ocodec->height, 32);
-			uint8_t		video_buffer[nbytes];
-			averror(av_image_fill_arrays(oframe->data, oframe->linesize, video_buffer, AV_PIX_FMT_YUV420P, ocodec->width, ocodec->height, 1));
+			averror(av_frame_get_buffer(oframe.get(), 32));
+			bind_frame(oframe.get());
+			// perceptual hashes of the luma plane
+			std::unique_ptr<phash::index_writer>	phash_idx(params_.phash_interval > 0 ? new phash::index_writer(outfile, ocodec->width, ocodec->height, params_.fps, params_.phash_interval) : 0);
+			// where the frames we receive and the
+			// ones we convert into actually are
+			stats::value	&numa_in_remote = stats::get("numa.writer_input_remote_pct"),
+					&numa_out_remote = stats::get("numa.writer_output_remote_pct");
+			const int	numa_node = (params_.numa_node >= 0) ? params_.numa_node : numa_utils::current_node();
+			stats::histogram	&latency = stats::get_histogram("latency.capture_to_encode_us");
 			// packet, reference
 			std::unique_ptr<AVPacket, void(*)(AVPacket*)>	opkt(av_packet_alloc(), [](AVPacket* p){ if(p) av_packet_free(&p); });
+			// packets kept in memory while the controls ask
+			// so, written in order as soon as they don't
+			typedef std::unique_ptr<AVPacket, void(*)(AVPacket*)>	packet_ptr;
+			std::deque<packet_ptr>	backlog;
+			size_t			backlog_bytes = 0;
+			stats::value		&backlog_stat = stats::get("writer.backlog_bytes"),
+						&backlog_hwm = stats::get("writer.backlog_bytes_hwm"),
+						&bitrate_kbps = stats::get("writer.bitrate_kbps");
+			bitrate_kbps.set(ocodec->bit_rate/1000);
+			// with audio the muxer has to interleave, it
+			// then takes the packet reference
+			auto	mux = [&](AVPacket* pkt) {
+				averror(astrm ? av_interleaved_write_frame(octx.get(), pkt) : av_write_frame(octx.get(), pkt));
+			};
+			auto	flush_backlog = [&]() {
+				while(!backlog.empty()) {
+					backlog_bytes -= backlog.front()->size;
+					mux(backlog.front().get());
+					backlog.pop_front();
+				}
+				backlog_stat.set(0);
+			};
+			auto	write_packet = [&](AVPacket* pkt) {
+				if(params_.ctl && params_.ctl->buffer_packets && backlog_bytes + pkt->size <= MAX_BACKLOG) {
+					// references the encoder buffer
+					packet_ptr	p(av_packet_clone(pkt), [](AVPacket* p){ if(p) av_packet_free(&p); });
+					if(!p)
+						throw std::runtime_error("av_packet_clone");
+					backlog_bytes += p->size;
+					backlog.push_back(std::move(p));
+					backlog_stat.set(backlog_bytes);
+					backlog_hwm.max(backlog_bytes);
+					return;
+				}
+				flush_backlog();
+				mux(pkt);
+			};
+			// gets all the available packets from the
+			// encoder, hands them to the sinks and writes
+			auto	drain = [&]() -> int {
+				int	rv = 0,
+					n = 0;
+				while(!(rv = avcodec_receive_packet(ocodec.get(), opkt.get()))) {
+					if(opkt->pts != AV_NOPTS_VALUE)
+						opkt->pts = av_rescale_q(opkt->pts, ocodec->pkt_timebase, strm->time_base);
+					if(opkt->dts != AV_NOPTS_VALUE)
+						opkt->dts = av_rescale_q(opkt->dts, ocodec->pkt_timebase, strm->time_base);
+					for(auto& sk : params_.sinks)
+						sk->on_packet(opkt.get());
+					write_packet(opkt.get());
+					av_packet_unref(opkt.get());
+					++n;
+				}
+				if(rv != AVERROR(EAGAIN) && rv != AVERROR_EOF)
+					averror(rv);
+				return n;
+			};
+			// audio chunks and video frames are timed against
+			// the capture time of the first frame, which has pts 1
+			const int		sample_rate = astrm ? astrm->codecpar->sample_rate : 1;
+			int64_t			audio_t0 = AV_NOPTS_VALUE,
+						audio_next = AV_NOPTS_VALUE;
+			AVPacket		apkt;
+			av_init_packet(&apkt);
+			stats::histogram	&audio_latency = stats::get_histogram("latency.audio_capture_to_mux_us");
+			stats::value		&audio_resyncs = stats::get("audio.resyncs");
+			auto	write_audio = [&]() {
+				const audio::chunk	*c = 0;
+				while((c = params_.audio->peek())) {
+					if(c->ts >= audio_t0) {
+						int64_t	pts = av_rescale(c->ts - audio_t0, sample_rate, 1000000) + av_rescale(1, sample_rate, params_.fps);
+						// samples are contiguous, unless the
+						// source skipped some (or we dropped)
+						if(audio_next == AV_NOPTS_VALUE || std::llabs(pts - audio_next) > sample_rate/20) {
+							if(audio_next != AV_NOPTS_VALUE)
+								audio_resyncs.add();
+						} else {
+							pts = audio_next;
+						}
+						audio_next = pts + c->nb_samples;
+						// not refcounted, the muxer copies it
+						apkt.data = (uint8_t*)c->data;
+						apkt.size = c->size;
+						apkt.stream_index = astrm->index;
+						apkt.flags = AV_PKT_FLAG_KEY;
+						apkt.pts = apkt.dts = av_rescale_q(pts, (AVRational){1, sample_rate}, astrm->time_base);
+						apkt.duration = av_rescale_q(c->nb_samples, (AVRational){1, sample_rate}, astrm->time_base);
+						audio_latency.record(av_gettime_relative() - c->ts);
+						write_packet(&apkt);
+						av_init_packet(&apkt);
+					}
+					params_.audio->pop();
+				}
+			};
+			for(auto& sk : params_.sinks)
+				sk->on_stream(ocodec.get(), strm->time_base);
 			// main loop
 			// write all frames
 			int	written_frames = 0;
 			int64_t	iter = 1;
+			// frames may be handed over in batches,
+			// take them all with a single wakeup
+			frame_holder	*batch[MAX_BATCH];
+			size_t		n_batch = 0,
+					i_batch = 0;
 			while(true) {
-				frame_holder*	fh = 0;
-				if(!fq_.pop(fh)) {
-					if(!run_)
+				if(i_batch == n_batch) {
+					i_batch = 0;
+					if(!(n_batch = fq_.pop_n(batch, MAX_BATCH)))
 						break;
-					continue;
 				}
-				// TODO Use newer API
-				sws_scale(swsctx, fh->frame->data, fh->frame->linesize, 0, ocodec->height, oframe->data, oframe->linesize);
+				frame_holder*	fh = batch[i_batch++];
+				// the encoder may still reference the
+				// previous frame, if so get a new buffer
+				// (and bind it, it's not from our pool)
+				{
+					const uint8_t		*prev = oframe->data[0];
+					alloc_check::scope	as(alloc_check::LIBAV);
+					averror(av_frame_make_writable(oframe.get()));
+					if(oframe->data[0] != prev)
+						bind_frame(oframe.get());
+				}
+				if(!(iter%64) && numa_node >= 0) {
+					const AVFrame	*f = fh->frame.get();
+					numa_in_remote.set(numa_utils::remote_pages_pct(f->data[0], f->linesize[0]*f->height, numa_node));
+					numa_out_remote.set(numa_utils::remote_pages_pct(oframe->data[0], oframe->linesize[0]*oframe->height, numa_node));
+				}
+				AVFrame	*sws_in = fh->frame.get();
+				if(scl) {
+					scl->scale(fh->frame->data[0], fh->frame->linesize[0], sframe->data[0], sframe->linesize[0]);
+					sws_in = sframe.get();
+				}
+				// with audio, video is timed on the same
+				// capture clock, so that dropped or late
+				// frames don't shift the sync
+				if(astrm) {
+					if(audio_t0 == AV_NOPTS_VALUE)
+						audio_t0 = fh->ts;
+					iter = std::max(iter, 1 + av_rescale(fh->ts - audio_t0, params_.fps, 1000000));
+				}
 				oframe->pts = iter++;
-				averror(avcodec_send_frame(ocodec.get(), oframe.get()));
-				const int	rv = avcodec_receive_packet(ocodec.get(), opkt.get());
-				if(rv == AVERROR(EAGAIN) || rv == AVERROR_EOF) {
-					av_frame_unref(fh->frame.get());
-					fh->release();
-           					continue;
-				} else if(rv < 0) {
-					averror(rv);
-				} else {
-					if(opkt->pts != AV_NOPTS_VALUE)
-						opkt->pts = av_rescale_q(opkt->pts, ocodec->pkt_timebase, strm->time_base);
-					if(opkt->dts != AV_NOPTS_VALUE)
-						opkt->dts = av_rescale_q(opkt->dts, ocodec->pkt_timebase, strm->time_base);
-					averror(av_write_frame(octx.get(), opkt.get()));
-					av_packet_unref(opkt.get());
-					++written_frames;
+				// libx264 reconfigures itself when
+				// bit_rate changes between frames
+				if(params_.ctl) {
+					const int64_t	br = BIT_RATE*params_.ctl->bitrate_pct/100;
+					if(br != ocodec->bit_rate) {
+						ocodec->bit_rate = br;
+						bitrate_kbps.set(br/1000);
+					}
+				}
+				{
+					alloc_check::scope	as(alloc_check::LIBAV);
+					// TODO Use newer API
+					sws_scale(swsctx, sws_in->data, sws_in->linesize, 0, sws_in->height, oframe->data, oframe->linesize);
+					averror(avcodec_send_frame(ocodec.get(), oframe.get()));
+					latency.record(av_gettime_relative() - fh->ts);
+					written_frames += drain();
+				}
+				// the encoder only reads oframe
+				if(phash_idx)
+					phash_idx->add(oframe->pts - 1, oframe->data[0], oframe->linesize[0], oframe->width, oframe->height);
+				if(astrm) {
+					alloc_check::scope	as(alloc_check::LIBAV);
+					write_audio();
 				}
-				av_frame_unref(fh->frame.get());
 				fh->release();
 			}
-			// one last step to close the file
-			if(written_frames) {
-				averror(avcodec_send_frame(ocodec.get(), 0));
-				avcodec_receive_packet(ocodec.get(), opkt.get());
-				averror(av_write_frame(octx.get(), opkt.get()));
-				av_packet_unref(opkt.get());
-			}
+			// one last step to flush the encoder
+			averror(avcodec_send_frame(ocodec.get(), 0));
+			written_frames += drain();
+			for(auto& sk : params_.sinks)
+				sk->on_end();
+			flush_backlog();
 			// close off all the streams
 			averror(av_write_trailer(octx.get()));
 			std::cout << "Written " << written_frames << " frames" << std::endl;
 		}
 	public:
-		impl(const writer::params& p, writer::frame_queue& fq) : params_(p), fq_(fq), run_(true), th_(0) {
+		impl(const writer::params& p, writer::frame_queue& fq) : params_(p), fq_(fq), th_(0) {
 		}
 
 		void start(void) {
@@ -163,11 +362,11 @@ namespace {
 		void stop(void) {
 			if(!th_)
 				return;
-			run_ = false;
+			// the writer drains what's left, then exits
+			fq_.close();
 			th_->join();
 			delete th_;
 			th_ = 0;
-			run_ = true;
 		}
 
 		~impl() {
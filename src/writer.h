@@ -19,13 +19,63 @@
 #define _WRITER_H_
 
 #include "utils.h"
+#include "audio.h"
+#include <vector>
 
 namespace writer {
 	typedef utils::concurrent_deque<utils::frame_holder*>	frame_queue;
 
+	// receives encoded packets on the writer
+	// thread, hence it must never block
+	class packet_sink {
+	public:
+		// called once, before any packet
+		virtual void on_stream(const AVCodecContext* ocodec, const AVRational& time_base) = 0;
+		// pkt is owned by the writer, sinks
+		// have to reference it to keep it
+		virtual void on_packet(const AVPacket* pkt) = 0;
+		virtual void on_end(void) = 0;
+		virtual ~packet_sink() {}
+	};
+
+	// runtime adaptation, written by other threads
+	// (see pressure.h), read by the writer every frame
+	struct controls {
+		// keep encoded packets in memory instead
+		// of writing them (bounded)
+		std::atomic<bool>	buffer_packets;
+		// percentage of the nominal bitrate
+		std::atomic<int>	bitrate_pct;
+
+		controls() : buffer_packets(false), bitrate_pct(100) {
+		}
+	};
+
 	struct params {
 		int		fps;
-		AVCodecContext	*ccodec;
+		int		width;
+		int		height;
+		AVPixelFormat	pix_fmt;
+		const char	*outfile;
+		// encoded frame size, when smaller than
+		// width/height frames are downscaled first
+		int		out_width;
+		int		out_height;
+		// downscaler bands, run on the shared pool
+		int		scale_threads;
+		// NUMA node to run on and bind buffers
+		// to, -1 to leave it to the OS
+		int		numa_node;
+		// additional consumers of encoded packets
+		std::vector<packet_sink*>	sinks;
+		// optional, may be null
+		controls			*ctl;
+		// frames between perceptual hashes written
+		// to the sidecar index (see phash.h), 0 for none
+		int				phash_interval;
+		// optional, its chunks are muxed
+		// along the video (may be null)
+		audio::iface			*audio;
 	};
 
 	class iface {
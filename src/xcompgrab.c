@@ -15,7 +15,7 @@
     along with replayer.  If not, see <https://www.gnu.org/licenses/>.
  * */
 
-#include <libavformat/avformat.h>
+#include "xcompgrab.h"
 #include <libavdevice/avdevice.h>
 #include <libavutil/parseutils.h>
 #include <libavutil/time.h>
@@ -23,10 +23,15 @@
 #include <X11/Xatom.h>
 #include <X11/Xutil.h>
 #include <X11/extensions/Xcomposite.h>
+#include <X11/extensions/Xdamage.h>
 #include <GL/gl.h>
 #include <GL/glx.h>
 #include <errno.h>
 #include <stdatomic.h>
+#include <numa.h>
+#include <sys/select.h>
+#include <time.h>
+#include <stdlib.h>
 
 /* taking inspiration from both
  * https://github.com/FFmpeg/FFmpeg/blob/e931119a41d0c48d1c544af89768b119b13feb4d/libavdevice/xcbgrab.c
@@ -64,6 +69,10 @@ typedef struct XCompGrabSlice {
 typedef struct XCompGrabBuffer {
 	int		n_slices;
 	XCompGrabSlice	*slices;
+	/* when >= 0 slices are allocated
+	 * on this NUMA node */
+	int		numa_node;
+	int		n_bytes;
 } XCompGrabBuffer;
 
 /* struct used for the PBO buffer allocation */
@@ -88,7 +97,20 @@ static void pvt_free(void* opaque, uint8_t* data) {
 		av_free(data);
 }
 
-static int pvt_init_membuffer(AVFormatContext *s, int n_slices, int n_bytes, XCompGrabBuffer* out) {
+static uint8_t* pvt_alloc_slice(XCompGrabBuffer* buf) {
+	if(buf->numa_node >= 0)
+		return (uint8_t*)numa_alloc_onnode(buf->n_bytes, buf->numa_node);
+	return (uint8_t*)av_malloc(buf->n_bytes);
+}
+
+static void pvt_free_slice(XCompGrabBuffer* buf, uint8_t* data) {
+	if(buf->numa_node >= 0)
+		numa_free(data, buf->n_bytes);
+	else
+		av_free(data);
+}
+
+static int pvt_init_membuffer(AVFormatContext *s, int n_slices, int n_bytes, int numa_node, XCompGrabBuffer* out) {
 	if(n_slices <= 0) {
 		av_log(s, AV_LOG_ERROR, "Invalid number of slices for internal memory buffer (%d)\n", n_slices);
 		return AVERROR(ENOTSUP);
@@ -100,13 +122,21 @@ static int pvt_init_membuffer(AVFormatContext *s, int n_slices, int n_bytes, XCo
 		return AVERROR(ENOMEM);
 	}
 	out->n_slices = n_slices;
+	out->n_bytes = n_bytes;
+	out->numa_node = -1;
+	if(numa_node >= 0) {
+		if(numa_available() < 0 || numa_node > numa_max_node())
+			av_log(s, AV_LOG_WARNING, "NUMA node %d not available, ignoring\n", numa_node);
+		else
+			out->numa_node = numa_node;
+	}
 	// initialize those
 	for(int i = 0; i < out->n_slices; ++i) {
 		out->slices[i].used = 0;
-		out->slices[i].buf = (uint8_t*)av_malloc(n_bytes);
+		out->slices[i].buf = pvt_alloc_slice(out);
 		if(!out->slices[i].buf) {
 			for(int j = 0; j < i; ++j) {
-				av_free(out->slices[j].buf);
+				pvt_free_slice(out, out->slices[j].buf);
 			}
 			av_free(out->slices);
 			return AVERROR(ENOMEM);
@@ -118,7 +148,7 @@ static int pvt_init_membuffer(AVFormatContext *s, int n_slices, int n_bytes, XCo
 static void pvt_cleanup_membuffer(XCompGrabBuffer* buf) {
 	if(buf->slices) {
 		for(int i = 0; i < buf->n_slices; ++i)
-			av_free(buf->slices[i].buf);
+			pvt_free_slice(buf, buf->slices[i].buf);
 		av_free(buf->slices);
 	}
 }
@@ -203,6 +233,53 @@ static void pvt_free_pbobuffer(void* opaque, uint8_t* data) {
 
 }
 
+/* presentation rate of a window, from
+ * XDamage events (X server time, ms) */
+#define RATE_MAX_SAMPLES	(4096)
+
+typedef struct XCompGrabRate {
+	int64_t	n_events;
+	Time	first;
+	Time	last;
+	/* last intervals, ring buffer */
+	int	n_iv;
+	int	iv[RATE_MAX_SAMPLES];
+} XCompGrabRate;
+
+static void pvt_rate_add(XCompGrabRate *r, Time t) {
+	if(r->n_events) {
+		r->iv[r->n_iv%RATE_MAX_SAMPLES] = (int)(t - r->last);
+		++r->n_iv;
+	} else {
+		r->first = t;
+	}
+	r->last = t;
+	++r->n_events;
+}
+
+static int pvt_cmp_int(const void *a, const void *b) {
+	return *(const int*)a - *(const int*)b;
+}
+
+static void pvt_rate_summary(const XCompGrabRate *r, double *fps, int *p50, int *p99) {
+	const int	n = (r->n_iv < RATE_MAX_SAMPLES) ? r->n_iv : RATE_MAX_SAMPLES;
+	int		*s = 0;
+
+	*fps = 0.0;
+	*p50 = *p99 = 0;
+	if(n <= 0 || r->last <= r->first)
+		return;
+	*fps = (r->n_events - 1)*1000.0/(r->last - r->first);
+	s = av_malloc(n*sizeof(int));
+	if(!s)
+		return;
+	memcpy(s, r->iv, n*sizeof(int));
+	qsort(s, n, sizeof(int), pvt_cmp_int);
+	*p50 = s[n/2];
+	*p99 = s[(n*99)/100];
+	av_free(s);
+}
+
 /* Useful typedefs */
 typedef void (*f_glXBindTexImageEXT)(Display *, GLXDrawable, int, int *);
 typedef void (*f_glXReleaseTexImageEXT)(Display *, GLXDrawable, int);
@@ -212,6 +289,11 @@ typedef void (*f_glBindBuffer)(GLenum, GLuint);
 typedef void (*f_glBufferData)(GLenum, GLsizeiptr, const void*, GLenum);
 typedef void* (*f_glMapBuffer)(GLenum, GLenum);
 typedef GLboolean (*f_glUnmapBuffer)(GLenum);
+typedef void (*f_glGenFramebuffers)(GLsizei, GLuint*);
+typedef void (*f_glDeleteFramebuffers)(GLsizei, const GLuint*);
+typedef void (*f_glBindFramebuffer)(GLenum, GLuint);
+typedef void (*f_glFramebufferTexture2D)(GLenum, GLenum, GLenum, GLuint, GLint);
+typedef GLenum (*f_glCheckFramebufferStatus)(GLenum);
 
 /* this type has to have the first member
  * as a AVClass*, otherwise it will
@@ -226,9 +308,37 @@ typedef struct XCompGrabCtx {
 	GLXContext		gl_ctx;
 	GLXPixmap		gl_pixmap;
 	GLuint			gl_texmap;
+	GLXFBConfig		*gl_configs;
+	int			gl_n_configs;
+	/* fixed size output canvas, window is
+	 * scaled and letterboxed into it */
+	GLuint			canvas_fbo;
+	GLuint			canvas_tex;
+	int			canvas_width;
+	int			canvas_height;
+	/* size of the frames we output */
+	int			out_width;
+	int			out_height;
+	Atom			net_active_window;
+	int			n_switches;
+	/* target application impact */
+	int			impact_baseline;
+	int			impact_monitor;
+	int			damage_event_base;
+	Damage			damage;
+	XCompGrabRate		*rate_baseline;
+	XCompGrabRate		*rate_capture;
+	int64_t			redirect_us;
+	int64_t			n_binds;
+	int64_t			bind_total_us;
+	int64_t			bind_max_us;
 	const char 		*framerate;
 	const char		*window_name;
 	int			framebuf_type;
+	int			numa_node;
+	int			follow_focus;
+	int			virtual_time;
+	int64_t			n_virtual;
 	int64_t			time_frame;
 	AVRational		time_base;
 	int64_t			frame_duration;
@@ -240,6 +350,11 @@ typedef struct XCompGrabCtx {
 	f_glBufferData		glBufferData;
 	f_glMapBuffer		glMapBuffer;
 	f_glUnmapBuffer		glUnmapBuffer;
+	f_glGenFramebuffers	glGenFramebuffers;
+	f_glDeleteFramebuffers	glDeleteFramebuffers;
+	f_glBindFramebuffer	glBindFramebuffer;
+	f_glFramebufferTexture2D	glFramebufferTexture2D;
+	f_glCheckFramebufferStatus	glCheckFramebufferStatus;
 	XCompGrabBuffer		pvt_framebuf;
 	XCompGrabPBOBuffer	glpbo_framebuf;
 } XCompGrabCtx;
@@ -255,6 +370,12 @@ static const AVOption options[] = {
 	{ "framerate", "", OFFSET(framerate), AV_OPT_TYPE_STRING, {.str = "ntsc" }, 0, 0, D },
 	{ "window_name", "X window name/title", OFFSET(window_name), AV_OPT_TYPE_STRING, {.str = "Desktop" }, 0, 0, D },
 	{ "framebuf_type", "0 to use system memory (slow), 1 for internal buffers, 2 for GL PBO managed buffers", OFFSET(framebuf_type), AV_OPT_TYPE_INT, { .i64 = BUF_INTERNAL }, BUF_SYSTEM, BUF_GLPBO, D },
+	{ "numa_node", "NUMA node to allocate internal buffers on, -1 for default policy", OFFSET(numa_node), AV_OPT_TYPE_INT, { .i64 = -1 }, -1, INT_MAX, D },
+	{ "follow_focus", "capture the focused window (_NET_ACTIVE_WINDOW), switching on focus change", OFFSET(follow_focus), AV_OPT_TYPE_BOOL, { .i64 = 0 }, 0, 1, D },
+	{ "impact_baseline", "seconds to measure the window presentation rate before redirecting it (implies impact_monitor)", OFFSET(impact_baseline), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, XCOMPGRAB_MAX_IMPACT_BASELINE, D },
+	{ "impact_monitor", "measure the window presentation rate while capturing (XDamage)", OFFSET(impact_monitor), AV_OPT_TYPE_BOOL, { .i64 = 0 }, 0, 1, D },
+	{ "virtual_time", "don't pace capture, frames are captured as fast as they are requested and timestamped at the nominal rate", OFFSET(virtual_time), AV_OPT_TYPE_BOOL, { .i64 = 0 }, 0, 1, D },
+	{ "canvas_size", "fixed output size, the window is scaled and letterboxed into it (default window size)", OFFSET(canvas_width), AV_OPT_TYPE_IMAGE_SIZE, {.str = NULL}, 0, 0, D },
 	{ NULL },
 };
 
@@ -324,6 +445,12 @@ static int pvt_find_window(Display *xdisplay, const char *target, Window* out) {
 	return -1;
 }
 
+static int64_t pvt_monotonic_us(void) {
+	struct timespec	ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000LL + ts.tv_nsec/1000;
+}
+
 static int pvt_init_stream(AVFormatContext *s) {
 	int		rv = 0;
 	XCompGrabCtx	*c = s->priv_data;
@@ -338,9 +465,9 @@ static int pvt_init_stream(AVFormatContext *s) {
 	st->codecpar->format = AV_PIX_FMT_RGBA;
 	st->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
 	st->codecpar->codec_id = AV_CODEC_ID_RAWVIDEO;
-	st->codecpar->width = c->win_attr.width;
-	st->codecpar->height = c->win_attr.height;
-	st->codecpar->bit_rate = av_rescale(32*c->win_attr.width*c->win_attr.height, st->avg_frame_rate.num, st->avg_frame_rate.den);
+	st->codecpar->width = c->out_width;
+	st->codecpar->height = c->out_height;
+	st->codecpar->bit_rate = av_rescale(32*c->out_width*c->out_height, st->avg_frame_rate.num, st->avg_frame_rate.den);
 	/* useful to determine the sleep interval */
 	/* TODO: verify why we need time_base and
 	 * frame_duration ... after all we already
@@ -348,7 +475,7 @@ static int pvt_init_stream(AVFormatContext *s) {
 	 */
 	c->time_base  = (AVRational){ st->avg_frame_rate.den, st->avg_frame_rate.num};
 	c->frame_duration = av_rescale_q(1, c->time_base, AV_TIME_BASE_Q);
-	c->time_frame = av_gettime();
+	c->time_frame = pvt_monotonic_us();
 	return 0;
 }
 
@@ -424,6 +551,28 @@ static int pvt_init_gl_func(AVFormatContext *s, XCompGrabCtx *c) {
 			return AVERROR(ENOTSUP);
 		}
 	}
+	if(c->canvas_width > 0) {
+		if(!(c->glGenFramebuffers = (f_glGenFramebuffers) glXGetProcAddress((GLubyte*)"glGenFramebuffers"))) {
+			av_log(s, AV_LOG_ERROR, "Can't lookup 'glGenFramebuffers'\n");
+			return AVERROR(ENOTSUP);
+		}
+		if(!(c->glDeleteFramebuffers = (f_glDeleteFramebuffers) glXGetProcAddress((GLubyte*)"glDeleteFramebuffers"))) {
+			av_log(s, AV_LOG_ERROR, "Can't lookup 'glDeleteFramebuffers'\n");
+			return AVERROR(ENOTSUP);
+		}
+		if(!(c->glBindFramebuffer = (f_glBindFramebuffer) glXGetProcAddress((GLubyte*)"glBindFramebuffer"))) {
+			av_log(s, AV_LOG_ERROR, "Can't lookup 'glBindFramebuffer'\n");
+			return AVERROR(ENOTSUP);
+		}
+		if(!(c->glFramebufferTexture2D = (f_glFramebufferTexture2D) glXGetProcAddress((GLubyte*)"glFramebufferTexture2D"))) {
+			av_log(s, AV_LOG_ERROR, "Can't lookup 'glFramebufferTexture2D'\n");
+			return AVERROR(ENOTSUP);
+		}
+		if(!(c->glCheckFramebufferStatus = (f_glCheckFramebufferStatus) glXGetProcAddress((GLubyte*)"glCheckFramebufferStatus"))) {
+			av_log(s, AV_LOG_ERROR, "Can't lookup 'glCheckFramebufferStatus'\n");
+			return AVERROR(ENOTSUP);
+		}
+	}
 	return 0;
 }
 
@@ -454,18 +603,341 @@ static int pvt_check_x_error(AVFormatContext *s, Display *d) {
 	return 0;
 }
 
+static Window pvt_get_active_window(XCompGrabCtx *c) {
+	Atom		actualType;
+	int		format;
+	unsigned long	numItems,
+			bytesAfter;
+	unsigned char	*data = 0;
+	Window		rv = 0;
+	if(c->net_active_window == None)
+		return 0;
+	if(XGetWindowProperty(c->xdisplay, DefaultRootWindow(c->xdisplay), c->net_active_window, 0L, 1L, 0,
+			XA_WINDOW, &actualType, &format, &numItems, &bytesAfter, &data) == Success && data) {
+		if(numItems && actualType == XA_WINDOW)
+			rv = *(Window*)data;
+		XFree(data);
+	}
+	return rv;
+}
+
+/* Redirects window 'w' (unless already captured, redirects
+ * are counted per client), creates its pixmap and GLX pixmap
+ * and makes it current in the (possibly already existing)
+ * GL context. On error the X error handler is expected
+ * to be set and nothing is left allocated.
+ */
+static int pvt_bind_window(AVFormatContext *s, XCompGrabCtx *c, Window w) {
+	XWindowAttributes	attr;
+	GLXFBConfig		*cur_cfg = 0;
+	Pixmap			win_pixmap = 0;
+	GLXPixmap		gl_pixmap = 0;
+	const int		redirect = (w != c->win_capture);
+
+	if(redirect) {
+		const int64_t	redirect_start = av_gettime_relative();
+		XCompositeRedirectWindow(c->xdisplay, w, CompositeRedirectAutomatic);
+		if(pvt_check_x_error(s, c->xdisplay) < 0)
+			return AVERROR(EINVAL);
+		/* includes the XSync round trip, only
+		 * the initial one is reported */
+		if(!c->redirect_us)
+			c->redirect_us = av_gettime_relative() - redirect_start;
+	}
+	/* Get windows attributes */
+	if(!XGetWindowAttributes(c->xdisplay, w, &attr)) {
+		av_log(s, AV_LOG_ERROR, "Can't retrieve window attributes!\n");
+		goto err_exit;
+	}
+	for(int i = 0; i < c->gl_n_configs; ++i) {
+		XVisualInfo *visual = glXGetVisualFromFBConfig(c->xdisplay, c->gl_configs[i]);
+		if (!visual)
+			continue;
+
+		if (attr.depth != visual->depth) {
+			XFree(visual);
+			continue;
+		}
+		XFree(visual);
+		cur_cfg = &c->gl_configs[i];
+		break;
+	}
+	if(!cur_cfg) {
+		av_log(s, AV_LOG_ERROR, "Couldn't find a valid FBConfig\n");
+		goto err_exit;
+	}
+	/* Create the pixmap */
+	win_pixmap = XCompositeNameWindowPixmap(c->xdisplay, w);
+	if(!win_pixmap || (pvt_check_x_error(s, c->xdisplay) < 0)) {
+		av_log(s, AV_LOG_ERROR, "Can't create Window Pixmap!\n");
+		goto err_exit;
+	}
+	const int pixmap_attrs[] = {GLX_TEXTURE_TARGET_EXT, GLX_TEXTURE_2D_EXT,
+				    GLX_TEXTURE_FORMAT_EXT,
+				    GLX_TEXTURE_FORMAT_RGBA_EXT, None};
+	gl_pixmap = glXCreatePixmap(c->xdisplay, *cur_cfg, win_pixmap, pixmap_attrs);
+	if(!gl_pixmap || (pvt_check_x_error(s, c->xdisplay) < 0)) {
+		av_log(s, AV_LOG_ERROR, "Can't create GL Pixmap!\n");
+		goto err_exit;
+	}
+	if(!c->gl_ctx) {
+		c->gl_ctx = glXCreateNewContext(c->xdisplay, *cur_cfg, GLX_RGBA_TYPE, 0, 1);
+		if(!c->gl_ctx) {
+			av_log(s, AV_LOG_ERROR, "Can't create new GLXContext with glXCreateNewContext!\n");
+			goto err_exit;
+		}
+	}
+	glXMakeCurrent(c->xdisplay, gl_pixmap, c->gl_ctx);
+	if(pvt_check_x_error(s, c->xdisplay) < 0) {
+		av_log(s, AV_LOG_ERROR, "Can't make GL Pixmap current (incompatible FBConfig?)\n");
+		goto err_exit;
+	}
+	c->win_capture = w;
+	c->win_attr = attr;
+	c->win_pixmap = win_pixmap;
+	c->gl_pixmap = gl_pixmap;
+	return 0;
+
+err_exit:
+	if(gl_pixmap)
+		glXDestroyPixmap(c->xdisplay, gl_pixmap);
+	if(win_pixmap)
+		XFreePixmap(c->xdisplay, win_pixmap);
+	if(redirect)
+		XCompositeUnredirectWindow(c->xdisplay, w, CompositeRedirectAutomatic);
+	pvt_check_x_error(s, c->xdisplay);
+	return AVERROR(ENOTSUP);
+}
+
+/* Tracks the damage of window 'w' (raw rectangles, so that
+ * no presentation is lost between our reads) to measure
+ * its presentation rate in 'r'. 0 stops tracking.
+ */
+static void pvt_track_damage(XCompGrabCtx *c, Window w) {
+	if(c->damage) {
+		XDamageDestroy(c->xdisplay, c->damage);
+		c->damage = 0;
+	}
+	if(w)
+		c->damage = XDamageCreate(c->xdisplay, w, XDamageReportRawRectangles);
+}
+
+/* One presentation can produce many rectangles,
+ * the last one has 'more' unset */
+static void pvt_damage_event(XEvent *ev, Window w, XCompGrabRate *r) {
+	const XDamageNotifyEvent	*de = (const XDamageNotifyEvent*)ev;
+	if(de->drawable == w && !de->more)
+		pvt_rate_add(r, de->timestamp);
+}
+
+/* Measures the presentation rate of 'w' for
+ * impact_baseline seconds, before we redirect it
+ */
+static void pvt_measure_baseline(AVFormatContext *s, XCompGrabCtx *c, Window w) {
+	const int64_t	end = av_gettime_relative() + c->impact_baseline*1000000LL;
+	const int	fd = ConnectionNumber(c->xdisplay);
+
+	av_log(s, AV_LOG_INFO, "Measuring window presentation rate for %d seconds before capture\n", c->impact_baseline);
+	pvt_track_damage(c, w);
+	while(av_gettime_relative() < end) {
+		if(!XPending(c->xdisplay)) {
+			struct timeval	tv = { 0, 10000 };
+			fd_set		fds;
+			FD_ZERO(&fds);
+			FD_SET(fd, &fds);
+			select(fd + 1, &fds, 0, 0, &tv);
+			continue;
+		}
+		XEvent	ev;
+		XNextEvent(c->xdisplay, &ev);
+		if(ev.type == c->damage_event_base + XDamageNotify)
+			pvt_damage_event(&ev, w, c->rate_baseline);
+	}
+	pvt_track_damage(c, 0);
+}
+
+/* Switches capture to window 'w' keeping GL context,
+ * textures and buffers; if that fails keeps capturing
+ * the current window. Only valid with a canvas, as the
+ * output size must not change.
+ * Used both on focus change and when the captured
+ * window is resized (pixmap has to be named again).
+ */
+static int pvt_switch_window(AVFormatContext *s, XCompGrabCtx *c, Window w) {
+	const Window		old_win = c->win_capture;
+	const Pixmap		old_pixmap = c->win_pixmap;
+	const GLXPixmap		old_gl_pixmap = c->gl_pixmap;
+	XErrorHandler		prev_x_error_handler = XSetErrorHandler(pvt_x_error_handler);
+	int			rv = 0;
+
+	if(old_win != w)
+		XSelectInput(c->xdisplay, old_win, NoEventMask);
+	if((rv = pvt_bind_window(s, c, w)) < 0) {
+		av_log(s, AV_LOG_WARNING, "Can't switch capture to window id %ld, keeping %ld\n", w, old_win);
+		glXMakeCurrent(c->xdisplay, old_gl_pixmap, c->gl_ctx);
+		XSelectInput(c->xdisplay, old_win, StructureNotifyMask);
+	} else {
+		glXDestroyPixmap(c->xdisplay, old_gl_pixmap);
+		XFreePixmap(c->xdisplay, old_pixmap);
+		if(old_win != w)
+			XCompositeUnredirectWindow(c->xdisplay, old_win, CompositeRedirectAutomatic);
+		XSelectInput(c->xdisplay, w, StructureNotifyMask);
+		if(c->impact_monitor && old_win != w)
+			pvt_track_damage(c, w);
+		++c->n_switches;
+		av_log(s, AV_LOG_INFO, "Capturing window id %ld, resolution %dx%d\n", c->win_capture, c->win_attr.width, c->win_attr.height);
+	}
+	pvt_check_x_error(s, c->xdisplay);
+	XSetErrorHandler(prev_x_error_handler);
+	return rv;
+}
+
+/* Drains pending X events, switching window
+ * if focus changed or captured window got resized.
+ */
+static void pvt_process_events(AVFormatContext *s, XCompGrabCtx *c) {
+	Window	target = 0;
+	int	rebind = 0;
+
+	while(XPending(c->xdisplay)) {
+		XEvent	ev;
+		XNextEvent(c->xdisplay, &ev);
+		if(ev.type == PropertyNotify && ev.xproperty.atom == c->net_active_window) {
+			target = pvt_get_active_window(c);
+		} else if(ev.type == ConfigureNotify && ev.xconfigure.window == c->win_capture && c->canvas_fbo) {
+			if(ev.xconfigure.width != c->win_attr.width || ev.xconfigure.height != c->win_attr.height)
+				rebind = 1;
+		} else if(c->damage && ev.type == c->damage_event_base + XDamageNotify) {
+			pvt_damage_event(&ev, c->win_capture, c->rate_capture);
+		}
+	}
+	if(target && target != c->win_capture)
+		pvt_switch_window(s, c, target);
+	else if(rebind)
+		pvt_switch_window(s, c, c->win_capture);
+}
+
+static int pvt_init_canvas(AVFormatContext *s, XCompGrabCtx *c) {
+	glGenTextures(1, &c->canvas_tex);
+	glBindTexture(GL_TEXTURE_2D, c->canvas_tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, c->canvas_width, c->canvas_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	if(pvt_check_gl_error(s, "canvas glTexImage2D") < 0)
+		return AVERROR(EINVAL);
+	c->glGenFramebuffers(1, &c->canvas_fbo);
+	c->glBindFramebuffer(GL_FRAMEBUFFER, c->canvas_fbo);
+	c->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, c->canvas_tex, 0);
+	if(c->glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		av_log(s, AV_LOG_ERROR, "Canvas framebuffer is not complete\n");
+		return AVERROR(ENOTSUP);
+	}
+	c->glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glBindTexture(GL_TEXTURE_2D, c->gl_texmap);
+	return 0;
+}
+
+/* Reads the current window texture (already bound) into 'dst',
+ * which is an offset when a PBO is bound.
+ * With a canvas the window is drawn scaled and letterboxed
+ * into it, rows keep the same order as glGetTexImage.
+ */
+static void pvt_read_pixels(XCompGrabCtx *c, void *dst) {
+	if(!c->canvas_fbo) {
+		glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, dst);
+		return;
+	}
+	const double	scale_w = (double)c->canvas_width/c->win_attr.width,
+			scale_h = (double)c->canvas_height/c->win_attr.height,
+			scale = (scale_w < scale_h) ? scale_w : scale_h;
+	const int	w = c->win_attr.width*scale,
+			h = c->win_attr.height*scale;
+	c->glBindFramebuffer(GL_FRAMEBUFFER, c->canvas_fbo);
+	glViewport(0, 0, c->canvas_width, c->canvas_height);
+	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glViewport((c->canvas_width - w)/2, (c->canvas_height - h)/2, w, h);
+	glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+	glBegin(GL_QUADS);
+	glTexCoord2f(0.0f, 0.0f); glVertex2f(-1.0f, -1.0f);
+	glTexCoord2f(1.0f, 0.0f); glVertex2f(1.0f, -1.0f);
+	glTexCoord2f(1.0f, 1.0f); glVertex2f(1.0f, 1.0f);
+	glTexCoord2f(0.0f, 1.0f); glVertex2f(-1.0f, 1.0f);
+	glEnd();
+	glReadPixels(0, 0, c->canvas_width, c->canvas_height, GL_RGBA, GL_UNSIGNED_BYTE, dst);
+	c->glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+/* Waits for the next frame tick, returns the capture time.
+ * Sleeps to an absolute (monotonic) deadline, so that there
+ * is a single wakeup per frame and no drift; when late it
+ * doesn't sleep at all.
+ * The time is monotonic too (as the pipeline fh->ts), a
+ * wall clock step must not move pts backwards.
+ * With virtual time it doesn't wait, the consumer paces the
+ * capture by asking for frames, and the time is synthesised
+ * from the frame number (starting at 0).
+ */
+static int64_t pvt_wait_frame(XCompGrabCtx *c) {
+	struct timespec	ts;
+
+	if(c->virtual_time)
+		return av_rescale_q(c->n_virtual++, c->time_base, AV_TIME_BASE_Q);
+	c->time_frame += c->frame_duration;
+	ts.tv_sec = c->time_frame/1000000;
+	ts.tv_nsec = (c->time_frame%1000000)*1000;
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR);
+	return av_gettime_relative();
+}
+
+/* Binds the composite window content to the texture,
+ * focus changes and resizes have to be handled before */
+static void pvt_begin_capture(AVFormatContext *s, XCompGrabCtx *c) {
+	int64_t	bind_us = 0;
+
+	if(XPending(c->xdisplay))
+		pvt_process_events(s, c);
+	glXMakeCurrent(c->xdisplay, c->gl_pixmap, c->gl_ctx);
+	glBindTexture(GL_TEXTURE_2D, c->gl_texmap);
+	/* this is where the X server and the driver get in
+	 * the way of the captured application, time it */
+	bind_us = av_gettime_relative();
+	c->glXBindTexImageEXT(c->xdisplay, c->gl_pixmap, GLX_FRONT_LEFT_EXT, NULL);
+	bind_us = av_gettime_relative() - bind_us;
+	c->bind_total_us += bind_us;
+	if(bind_us > c->bind_max_us)
+		c->bind_max_us = bind_us;
+	++c->n_binds;
+}
+
+static void pvt_end_capture(XCompGrabCtx *c) {
+	c->glXReleaseTexImageEXT(c->xdisplay, c->gl_pixmap, GLX_FRONT_LEFT_EXT);
+}
+
 static av_cold int xcompgrab_read_header(AVFormatContext *s) {
 	int		rv = 0;
-	GLXFBConfig	*configs = 0,
-			*cur_cfg = 0;
 	XCompGrabCtx	*c = s->priv_data;
 	XErrorHandler	prev_x_error_handler = 0;
+	Window		target = 0;
 
 	/* reset data members used for destruction */
 	c->xdisplay = 0;
 	c->win_pixmap = 0;
+	c->gl_pixmap = 0;
 	c->gl_ctx = 0;
 	c->gl_texmap = 0;
+	c->gl_configs = 0;
+	c->canvas_fbo = 0;
+	c->canvas_tex = 0;
+	c->n_switches = 0;
+	c->damage = 0;
+	c->rate_baseline = 0;
+	c->rate_capture = 0;
+	c->redirect_us = 0;
+	c->n_binds = 0;
+	c->bind_total_us = 0;
+	c->bind_max_us = 0;
+	c->n_virtual = 0;
 
 	c->xdisplay = XOpenDisplay(NULL);
 	if(!c->xdisplay)
@@ -476,25 +948,44 @@ static av_cold int xcompgrab_read_header(AVFormatContext *s) {
 	if((rv = pvt_check_comp_support(s, c)) < 0) {
 		goto err_exit;
 	}
+	c->net_active_window = XInternAtom(c->xdisplay, "_NET_ACTIVE_WINDOW", 1);
+	if(c->follow_focus) {
+		/* start from the focused window and
+		 * get notified when focus changes */
+		if(c->net_active_window == None) {
+			av_log(s, AV_LOG_ERROR, "Window manager doesn't support _NET_ACTIVE_WINDOW\n");
+			rv = AVERROR(ENOTSUP);
+			goto err_exit;
+		}
+		target = pvt_get_active_window(c);
+		XSelectInput(c->xdisplay, DefaultRootWindow(c->xdisplay), PropertyChangeMask);
+	}
 	/* find the window name */
-	if(pvt_find_window(c->xdisplay, c->window_name, &c->win_capture) < 0) {
+	if(!target && pvt_find_window(c->xdisplay, c->window_name, &target) < 0) {
 		av_log(s, AV_LOG_ERROR, "Can't find X window containing string '%s'\n", c->window_name);
 		rv = AVERROR(EINVAL);
 		goto err_exit;
 	}
-	XCompositeRedirectWindow(c->xdisplay, c->win_capture, CompositeRedirectAutomatic);
-	if(pvt_check_x_error(s, c->xdisplay) < 0) {
-		rv = AVERROR(EINVAL);
-		goto err_exit;
-	}
-	/* Get windows attributes */
-	if(!XGetWindowAttributes(c->xdisplay, c->win_capture, &c->win_attr)) {
-		av_log(s, AV_LOG_ERROR, "Can't retrieve window attributes!\n");
-		rv = AVERROR(ENOTSUP);
-		goto err_exit;
+	/* impact on the captured application */
+	if(c->impact_baseline > 0)
+		c->impact_monitor = 1;
+	if(c->impact_monitor) {
+		int	damage_error_base = 0;
+		if(!XDamageQueryExtension(c->xdisplay, &c->damage_event_base, &damage_error_base)) {
+			av_log(s, AV_LOG_ERROR, "XDamage extension is not available, can't monitor impact\n");
+			rv = AVERROR(ENOTSUP);
+			goto err_exit;
+		}
+		c->rate_baseline = av_mallocz(sizeof(XCompGrabRate));
+		c->rate_capture = av_mallocz(sizeof(XCompGrabRate));
+		if(!c->rate_baseline || !c->rate_capture) {
+			rv = AVERROR(ENOMEM);
+			goto err_exit;
+		}
+		if(c->impact_baseline > 0)
+			pvt_measure_baseline(s, c, target);
 	}
-	av_log(s, AV_LOG_INFO, "Captuing window id %ld, resolution %dx%d\n", c->win_capture, c->win_attr.width, c->win_attr.height);
-	/* get GLX FB configs and find the right to use */
+	/* get GLX FB configs, kept to bind windows later */
 	const int 	config_attrs[] = {GLX_BIND_TO_TEXTURE_RGBA_EXT,
 				GL_TRUE,
 				GLX_DRAWABLE_TYPE,
@@ -504,65 +995,34 @@ static av_cold int xcompgrab_read_header(AVFormatContext *s) {
 				GLX_DOUBLEBUFFER,
 				GL_FALSE,
 				None};
-	int		nelem = 0;
-	configs = glXChooseFBConfig(c->xdisplay, get_root_window_screen(c->xdisplay, c->win_attr.root), config_attrs, &nelem);
-	if(!configs) {
+	c->gl_configs = glXChooseFBConfig(c->xdisplay, get_root_window_screen(c->xdisplay, DefaultRootWindow(c->xdisplay)), config_attrs, &c->gl_n_configs);
+	if(!c->gl_configs) {
 		av_log(s, AV_LOG_ERROR, "glXChooseFBConfig failed\n");
 		rv = AVERROR(ENOTSUP);
 		goto err_exit;
 	}
-	for(int i = 0; i < nelem; ++i) {
-		XVisualInfo *visual = glXGetVisualFromFBConfig(c->xdisplay, configs[i]);
-		if (!visual)
-			continue;
-
-		if (c->win_attr.depth != visual->depth) {
-			XFree(visual);
-			continue;
-		}
-		XFree(visual);
-		cur_cfg = &configs[i];
-		break;
-	}
-	if(!cur_cfg) {
-		av_log(s, AV_LOG_ERROR, "Couldn't find a valid FBConfig\n");
-		rv = AVERROR(ENOTSUP);
-		goto err_exit;
-	}
-	/* Create the pixmap */
-	c->win_pixmap = XCompositeNameWindowPixmap(c->xdisplay, c->win_capture);
-	if(!c->win_pixmap || (pvt_check_x_error(s, c->xdisplay) < 0)) {
-		av_log(s, AV_LOG_ERROR, "Can't create Window Pixmap!\n");
-		rv = AVERROR(ENOTSUP);
-		goto err_exit;
-	}
-	const int pixmap_attrs[] = {GLX_TEXTURE_TARGET_EXT, GLX_TEXTURE_2D_EXT,
-				    GLX_TEXTURE_FORMAT_EXT,
-				    GLX_TEXTURE_FORMAT_RGBA_EXT, None};
-	c->gl_pixmap = glXCreatePixmap(c->xdisplay, *cur_cfg, c->win_pixmap, pixmap_attrs);
-	if(!c->gl_pixmap || (pvt_check_x_error(s, c->xdisplay) < 0)) {
-		av_log(s, AV_LOG_ERROR, "Can't create GL Pixmap!\n");
-		rv = AVERROR(ENOTSUP);
-		goto err_exit;
-	}
-	c->gl_ctx = glXCreateNewContext(c->xdisplay, *cur_cfg, GLX_RGBA_TYPE, 0, 1);
-	if(!c->gl_ctx) {
-		av_log(s, AV_LOG_ERROR, "Can't create new GLXContext with glXCreateNewContext!\n");
-		rv = AVERROR(ENOTSUP);
-		goto err_exit;
-	}
-	XFree(configs);
-	configs = 0;
-	glXMakeCurrent(c->xdisplay, c->gl_pixmap, c->gl_ctx);
-	if(pvt_check_x_error(s, c->xdisplay) < 0) {
-		rv = AVERROR(ENOTSUP);
+	if((rv = pvt_bind_window(s, c, target)) < 0) {
 		goto err_exit;
 	}
+	av_log(s, AV_LOG_INFO, "Captuing window id %ld, resolution %dx%d\n", c->win_capture, c->win_attr.width, c->win_attr.height);
+	if(c->impact_monitor)
+		pvt_track_damage(c, c->win_capture);
 	/* At this stage all X commands should have
 	 * been done, remove the error callback
 	 */
 	XSetErrorHandler(prev_x_error_handler);
 	prev_x_error_handler = 0;
+	/* output size, following focus implies a
+	 * canvas as windows will have different sizes */
+	if(c->follow_focus && c->canvas_width <= 0) {
+		c->canvas_width = c->win_attr.width;
+		c->canvas_height = c->win_attr.height;
+	}
+	c->out_width = (c->canvas_width > 0) ? c->canvas_width : c->win_attr.width;
+	c->out_height = (c->canvas_width > 0) ? c->canvas_height : c->win_attr.height;
+	/* with a canvas we can follow window resizes too */
+	if(c->canvas_width > 0)
+		XSelectInput(c->xdisplay, c->win_capture, StructureNotifyMask);
 	/* create gl texture in memory */
 	glEnable(GL_TEXTURE_2D);
 	glGenTextures(1, &c->gl_texmap);
@@ -582,11 +1042,17 @@ static av_cold int xcompgrab_read_header(AVFormatContext *s) {
 	if((rv = pvt_init_gl_func(s, c)) < 0) {
 		goto err_exit;
 	}
+	if(c->canvas_width > 0) {
+		av_log(s, AV_LOG_INFO, "Using fixed %dx%d output canvas\n", c->canvas_width, c->canvas_height);
+		if((rv = pvt_init_canvas(s, c)) < 0) {
+			goto err_exit;
+		}
+	}
 	/* take care of different buffer types */
 	switch(c->framebuf_type) {
 	case BUF_INTERNAL:
 		av_log(s, AV_LOG_INFO, "Using internal framebuffers\n");
-		if((rv = pvt_init_membuffer(s, 8, c->win_attr.width*c->win_attr.height*4, &c->pvt_framebuf)) < 0) {
+		if((rv = pvt_init_membuffer(s, 8, c->out_width*c->out_height*4, c->numa_node, &c->pvt_framebuf)) < 0) {
 			goto err_exit;
 		}
 		break;
@@ -604,7 +1070,7 @@ static av_cold int xcompgrab_read_header(AVFormatContext *s) {
 				goto err_exit;
 			}
 			c->glBindBuffer(GL_PIXEL_PACK_BUFFER, *cur_pbo);
-			c->glBufferData(GL_PIXEL_PACK_BUFFER, c->win_attr.width*c->win_attr.height* 4, NULL, GL_STREAM_READ);
+			c->glBufferData(GL_PIXEL_PACK_BUFFER, c->out_width*c->out_height* 4, NULL, GL_STREAM_READ);
 			if(pvt_check_gl_error(s, "glBufferData") < 0) {
 				rv = AVERROR(EINVAL);
 				goto err_exit;
@@ -623,8 +1089,6 @@ static av_cold int xcompgrab_read_header(AVFormatContext *s) {
 	return 0;
 
 err_exit:
-	if(configs)
-		XFree(configs);
 	if(is_x_error)
 		is_x_error = 0;
 	if(prev_x_error_handler)
@@ -635,20 +1099,12 @@ err_exit:
 
 static int xcompgrab_read_packet(AVFormatContext *s, AVPacket *pkt) {
 	XCompGrabCtx	*c = s->priv_data;
-	int64_t 	pts = 0,
-			delay = 0;
-	int		length = c->win_attr.width * c->win_attr.height * sizeof(uint8_t) * 4;
+	int64_t 	pts = 0;
+	int		length = c->out_width * c->out_height * sizeof(uint8_t) * 4;
 	uint8_t		*data = 0;
 
 	/* wait enough time */
-	c->time_frame += c->frame_duration;
-	while(1) {
-		pts = av_gettime();
-		delay = c->time_frame - pts;
-		if (delay <= 0)
-			break;
-		av_usleep(delay);
-	}
+	pts = pvt_wait_frame(c);
 	av_init_packet(pkt);
 	/* properly setup memory structures
 	 * to allocate buffer from desired
@@ -674,9 +1130,7 @@ static int xcompgrab_read_packet(AVFormatContext *s, AVPacket *pkt) {
 	pkt->data = data;
 	pkt->size = length;
 	/* gl calls to capture the composite window */
-	glXMakeCurrent(c->xdisplay, c->gl_pixmap, c->gl_ctx);
-	glBindTexture(GL_TEXTURE_2D, c->gl_texmap);
-	c->glXBindTexImageEXT(c->xdisplay, c->gl_pixmap, GLX_FRONT_LEFT_EXT, NULL);
+	pvt_begin_capture(s, c);
 	if(c->framebuf_type == BUF_GLPBO) {
 		XCompGrabPBOSlice	*slice = pvt_alloc_pbobuffer(&c->glpbo_framebuf);
 		if(!slice) {
@@ -692,7 +1146,7 @@ static int xcompgrab_read_packet(AVFormatContext *s, AVPacket *pkt) {
 		/* with PBOs, the below call is asynchronous
 		 * and the buffer indicates an offset - which is 0
 		 */
-		glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+		pvt_read_pixels(c, 0);
 		/* this call is synchrounous */
 		slice->ptr = c->glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
 		if(!slice->ptr) {
@@ -703,9 +1157,37 @@ static int xcompgrab_read_packet(AVFormatContext *s, AVPacket *pkt) {
 		pkt->buf = av_buffer_create(slice->ptr, length, pvt_free_pbobuffer, slice, 0);
 		pkt->data = slice->ptr;
 	} else {
-		glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+		pvt_read_pixels(c, data);
 	}
-	c->glXReleaseTexImageEXT(c->xdisplay, c->gl_pixmap, GLX_FRONT_LEFT_EXT);
+	pvt_end_capture(c);
+	return 0;
+}
+
+/* Direct capture, bypassing AVPacket and the rawvideo
+ * decoder: the window content is read straight into
+ * 'frame', which has to be already allocated by the
+ * caller as RGBA of the stream size. Rows are written
+ * honouring frame->linesize, hence padded frames from
+ * the pipeline pool can be passed untouched to the
+ * encoder. Sets frame->pts (stream time base).
+ */
+int xcompgrab_read_frame(AVFormatContext *s, AVFrame *frame) {
+	XCompGrabCtx	*c = s->priv_data;
+
+	if(frame->format != AV_PIX_FMT_RGBA || frame->width != c->out_width || frame->height != c->out_height
+	|| !frame->data[0] || frame->linesize[0] < c->out_width*4 || frame->linesize[0]%4) {
+		av_log(s, AV_LOG_ERROR, "Frame doesn't match capture format (RGBA %dx%d)\n", c->out_width, c->out_height);
+		return AVERROR(EINVAL);
+	}
+	frame->pts = pvt_wait_frame(c);
+	pvt_begin_capture(s, c);
+	/* pixels go to client memory, not to a PBO */
+	if(c->framebuf_type == BUF_GLPBO)
+		c->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glPixelStorei(GL_PACK_ROW_LENGTH, frame->linesize[0]/4);
+	pvt_read_pixels(c, frame->data[0]);
+	glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+	pvt_end_capture(c);
 	return 0;
 }
 
@@ -732,6 +1214,16 @@ static av_cold int xcompgrab_read_close(AVFormatContext *s) {
 		break;
 
 	}
+	if(c->canvas_fbo && c->xdisplay && c->gl_pixmap && c->gl_ctx) {
+		glXMakeCurrent(c->xdisplay, c->gl_pixmap, c->gl_ctx);
+		c->glDeleteFramebuffers(1, &c->canvas_fbo);
+		c->canvas_fbo = 0;
+	}
+	if(c->canvas_tex && c->xdisplay && c->gl_pixmap && c->gl_ctx) {
+		glXMakeCurrent(c->xdisplay, c->gl_pixmap, c->gl_ctx);
+		glDeleteTextures(1, &c->canvas_tex);
+		c->canvas_tex = 0;
+	}
 	if(c->gl_texmap && c->xdisplay && c->gl_pixmap && c->gl_ctx) {
 		glXMakeCurrent(c->xdisplay, c->gl_pixmap, c->gl_ctx);
 		glDeleteTextures(1, &c->gl_texmap);
@@ -742,10 +1234,32 @@ static av_cold int xcompgrab_read_close(AVFormatContext *s) {
 		glXDestroyContext(c->xdisplay, c->gl_ctx); 
 		c->gl_ctx = 0;
 	}
+	if(c->gl_pixmap && c->xdisplay) {
+		glXDestroyPixmap(c->xdisplay, c->gl_pixmap);
+		c->gl_pixmap = 0;
+	}
 	if(c->win_pixmap && c->xdisplay) {
 		XFreePixmap(c->xdisplay, c->win_pixmap);
 		c->win_pixmap = 0;
 	}
+	if(c->gl_configs) {
+		XFree(c->gl_configs);
+		c->gl_configs = 0;
+	}
+	if(c->n_switches)
+		av_log(s, AV_LOG_INFO, "Capture window switched %d times\n", c->n_switches);
+	if(c->impact_monitor && c->rate_capture) {
+		XCompGrabImpact	imp;
+		xcompgrab_impact(s, &imp);
+		av_log(s, AV_LOG_INFO, "Impact: window %.1f fps before capture (p50 %d ms, p99 %d ms), %.1f fps while capturing (p50 %d ms, p99 %d ms)\n",
+			imp.baseline_fps, imp.baseline_p50_ms, imp.baseline_p99_ms, imp.capture_fps, imp.capture_p50_ms, imp.capture_p99_ms);
+		av_log(s, AV_LOG_INFO, "Impact: redirect %"PRId64" us, glXBindTexImageEXT avg %"PRId64" us max %"PRId64" us over %"PRId64" frames\n",
+			imp.redirect_us, imp.bind_avg_us, imp.bind_max_us, imp.n_binds);
+	}
+	if(c->damage && c->xdisplay)
+		pvt_track_damage(c, 0);
+	av_freep(&c->rate_baseline);
+	av_freep(&c->rate_capture);
 	if(c->xdisplay) {
 		XCloseDisplay(c->xdisplay);
 		c->xdisplay = 0;
@@ -753,6 +1267,99 @@ static av_cold int xcompgrab_read_close(AVFormatContext *s) {
 	return 0;
 }
 
+int xcompgrab_pool_usage(AVFormatContext *s, int *total) {
+	XCompGrabCtx	*c = s->priv_data;
+	int		used = 0;
+
+	switch(c->framebuf_type) {
+	case BUF_INTERNAL:
+		*total = c->pvt_framebuf.n_slices;
+		for(int i = 0; i < c->pvt_framebuf.n_slices; ++i)
+			used += atomic_load(&c->pvt_framebuf.slices[i].used);
+		return used;
+	case BUF_GLPBO:
+		*total = c->glpbo_framebuf.n_slices;
+		for(int i = 0; i < c->glpbo_framebuf.n_slices; ++i)
+			used += atomic_load(&c->glpbo_framebuf.slices[i].used);
+		return used;
+	case BUF_SYSTEM:
+	default:
+		break;
+	}
+	*total = 0;
+	return -1;
+}
+
+int xcompgrab_impact(AVFormatContext *s, XCompGrabImpact *out) {
+	XCompGrabCtx	*c = s->priv_data;
+
+	memset(out, 0, sizeof(*out));
+	if(c->rate_baseline)
+		pvt_rate_summary(c->rate_baseline, &out->baseline_fps, &out->baseline_p50_ms, &out->baseline_p99_ms);
+	if(c->rate_capture)
+		pvt_rate_summary(c->rate_capture, &out->capture_fps, &out->capture_p50_ms, &out->capture_p99_ms);
+	out->redirect_us = c->redirect_us;
+	out->n_binds = c->n_binds;
+	out->bind_avg_us = c->n_binds ? c->bind_total_us/c->n_binds : 0;
+	out->bind_max_us = c->bind_max_us;
+	return c->impact_monitor ? 0 : AVERROR(EINVAL);
+}
+
+struct XCompGrabPool {
+	int			type;
+	XCompGrabBuffer		mem;
+	XCompGrabPBOBuffer	pbo;
+};
+
+XCompGrabPool *xcompgrab_pool_create(int framebuf_type, int n_slices, int n_bytes) {
+	XCompGrabPool	*p = av_mallocz(sizeof(XCompGrabPool));
+
+	if(!p)
+		return 0;
+	p->type = framebuf_type;
+	if(p->type == BUF_GLPBO) {
+		if(pvt_init_pbobuffer(0, n_slices, &p->pbo) < 0) {
+			av_free(p);
+			return 0;
+		}
+		/* the slice itself, so that put can find it */
+		for(int i = 0; i < n_slices; ++i)
+			p->pbo.slices[i].ptr = &p->pbo.slices[i];
+	} else if(p->type == BUF_INTERNAL) {
+		if(pvt_init_membuffer(0, n_slices, n_bytes, -1, &p->mem) < 0) {
+			av_free(p);
+			return 0;
+		}
+	} else {
+		av_free(p);
+		return 0;
+	}
+	return p;
+}
+
+void *xcompgrab_pool_get(XCompGrabPool *p) {
+	if(p->type == BUF_GLPBO) {
+		XCompGrabPBOSlice	*slice = pvt_alloc_pbobuffer(&p->pbo);
+		return slice ? slice->ptr : 0;
+	}
+	return pvt_alloc_membuffer(&p->mem);
+}
+
+void xcompgrab_pool_put(XCompGrabPool *p, void *data) {
+	if(p->type == BUF_GLPBO)
+		pvt_free_pbobuffer(data, data);
+	else
+		pvt_free_membuffer(&p->mem, data);
+}
+
+void xcompgrab_pool_destroy(XCompGrabPool *p) {
+	if(p->type == BUF_GLPBO)
+		pvt_cleanup_pbobuffer(&p->pbo);
+	else
+		pvt_cleanup_membuffer(&p->mem);
+	av_free(p);
+}
+
 AVInputFormat ff_xcompgrab_demuxer = {
 	.name           = "xcompgrab",
 	.long_name      = "XComposite window capture, using X and OpenGL",
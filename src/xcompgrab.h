@@ -0,0 +1,82 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+#ifndef _XCOMPGRAB_H_
+#define _XCOMPGRAB_H_
+
+#include <libavformat/avformat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern AVInputFormat ff_xcompgrab_demuxer;
+
+/* Monitoring helper, returns the number of internal
+ * framebuffers currently held by consumers and
+ * sets 'total' to their number. -1 when frames
+ * are allocated in system memory.
+ */
+extern int xcompgrab_pool_usage(AVFormatContext *s, int *total);
+
+/* Direct capture into a caller allocated RGBA frame
+ * of the stream size, see xcompgrab.c
+ */
+extern int xcompgrab_read_frame(AVFormatContext *s, AVFrame *frame);
+
+/* Impact of the capture on the captured application,
+ * rates are measured from XDamage events on the window:
+ * 'baseline' before it gets redirected (option
+ * impact_baseline), 'capture' while recording.
+ * Rates are 0 when not measured.
+ */
+#define XCOMPGRAB_MAX_IMPACT_BASELINE	600
+
+typedef struct XCompGrabImpact {
+	double	baseline_fps;
+	int	baseline_p50_ms;
+	int	baseline_p99_ms;
+	double	capture_fps;
+	int	capture_p50_ms;
+	int	capture_p99_ms;
+	/* first XCompositeRedirectWindow, including the round trip */
+	int64_t	redirect_us;
+	/* glXBindTexImageEXT per captured frame */
+	int64_t	n_binds;
+	int64_t	bind_avg_us;
+	int64_t	bind_max_us;
+} XCompGrabImpact;
+
+extern int xcompgrab_impact(AVFormatContext *s, XCompGrabImpact *out);
+
+/* The internal slice pools (framebuf_type 1 and 2),
+ * exposed for the stress harness, see stress.h.
+ * GL PBO slices get fake mapped pointers, no GL is
+ * needed. Get returns NULL when all slices are used.
+ */
+typedef struct XCompGrabPool XCompGrabPool;
+
+extern XCompGrabPool *xcompgrab_pool_create(int framebuf_type, int n_slices, int n_bytes);
+extern void *xcompgrab_pool_get(XCompGrabPool *p);
+extern void xcompgrab_pool_put(XCompGrabPool *p, void *data);
+extern void xcompgrab_pool_destroy(XCompGrabPool *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_XCOMPGRAB_H_
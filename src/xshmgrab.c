@@ -0,0 +1,494 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+
+#include "xshmgrab.h"
+#include <libavdevice/avdevice.h>
+#include <libavutil/opt.h>
+#include <libavutil/parseutils.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <pthread.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <string.h>
+
+/* Root window (whole desktop) capture via MIT-SHM
+ * A single XShmGetImage of a multi monitor desktop (e.g.
+ * 7680x2160) plus the copy into the frame doesn't fit
+ * in a 60 fps frame period, hence the region is split
+ * into a grid of tiles, each one with its own X connection,
+ * SHM segment and thread. Each frame all the tiles are
+ * grabbed concurrently and copied into their rectangle of
+ * the output frame; the reading thread grabs the first
+ * tile itself, so a frame costs a single wakeup per
+ * additional tile.
+ */
+
+struct XShmGrabCtx;
+
+typedef struct XShmGrabTile {
+	struct XShmGrabCtx	*c;
+	Display			*xdisplay;
+	XImage			*image;
+	XShmSegmentInfo		shminfo;
+	int			attached;
+	/* rectangle, relative to the region */
+	int			x;
+	int			y;
+	int			width;
+	int			height;
+	pthread_t		thread;
+	int			has_thread;
+	int			rv;
+	int64_t			total_us;
+	int64_t			max_us;
+} XShmGrabTile;
+
+typedef struct XShmGrabCtx {
+	const AVClass		*class;
+	const char		*framerate;
+	int			width;
+	int			height;
+	int			grab_x;
+	int			grab_y;
+	int			tiles_cols;
+	int			tiles_rows;
+	int			virtual_time;
+	enum AVPixelFormat	pix_fmt;
+	int			n_tiles;
+	XShmGrabTile		*tiles;
+	/* frame handoff to the tile threads */
+	pthread_mutex_t		mtx;
+	pthread_cond_t		cv_start;
+	pthread_cond_t		cv_done;
+	int			sync_init;
+	uint64_t		gen;
+	int			pending;
+	int			quit;
+	uint8_t			*dst;
+	int			dst_linesize;
+	AVRational		time_base;
+	int64_t			time_frame;
+	int64_t			frame_duration;
+	int64_t			n_virtual;
+	int64_t			n_frames;
+	int64_t			total_us;
+	int64_t			max_us;
+} XShmGrabCtx;
+
+#define OFFSET(x) offsetof(XShmGrabCtx, x)
+#define D AV_OPT_FLAG_DECODING_PARAM
+
+static const AVOption options[] = {
+	{ "framerate", "", OFFSET(framerate), AV_OPT_TYPE_STRING, {.str = "ntsc" }, 0, 0, D },
+	{ "video_size", "size of the captured region (default whole root window)", OFFSET(width), AV_OPT_TYPE_IMAGE_SIZE, {.str = NULL}, 0, 0, D },
+	{ "grab_x", "left of the captured region", OFFSET(grab_x), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, INT_MAX, D },
+	{ "grab_y", "top of the captured region", OFFSET(grab_y), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, INT_MAX, D },
+	{ "tiles", "CxR grid of tiles captured in parallel (default ~1920x1080 tiles, at most one per CPU)", OFFSET(tiles_cols), AV_OPT_TYPE_IMAGE_SIZE, {.str = NULL}, 0, 0, D },
+	{ "virtual_time", "don't pace capture, frames are captured as fast as they are requested and timestamped at the nominal rate", OFFSET(virtual_time), AV_OPT_TYPE_BOOL, { .i64 = 0 }, 0, 1, D },
+	{ NULL },
+};
+
+static const AVClass xshmgrab_class = {
+    .class_name = "xshmgrab indev",
+    .item_name  = av_default_item_name,
+    .option     = options,
+    .version    = LIBAVUTIL_VERSION_INT,
+    .category   = AV_CLASS_CATEGORY_DEVICE_VIDEO_INPUT,
+};
+
+/* Fwd declaration */
+static av_cold int xshmgrab_read_close(AVFormatContext *s);
+
+/* XShmAttach failures (i.e. remote display) are only
+ * reported asynchronously, through the error handler */
+static int	is_x_error = 0;
+
+static int pvt_x_error_handler(Display *d, XErrorEvent* e) {
+	is_x_error = 1;
+	return 0;
+}
+
+static int64_t pvt_monotonic_us(void) {
+	struct timespec	ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000LL + ts.tv_nsec/1000;
+}
+
+/* Same pacing as xcompgrab, absolute deadline or virtual time */
+static int64_t pvt_wait_frame(XShmGrabCtx *c) {
+	struct timespec	ts;
+
+	if(c->virtual_time)
+		return av_rescale_q(c->n_virtual++, c->time_base, AV_TIME_BASE_Q);
+	c->time_frame += c->frame_duration;
+	ts.tv_sec = c->time_frame/1000000;
+	ts.tv_nsec = (c->time_frame%1000000)*1000;
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR);
+	return av_gettime_relative();
+}
+
+/* default grid: tiles of about 1920x1080, then
+ * trimmed so that there is at most one per CPU */
+static void pvt_auto_tiles(XShmGrabCtx *c) {
+	const long	n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	const int	max_tiles = (n_cpus > 0) ? n_cpus : 1;
+
+	c->tiles_cols = (c->width + 1919)/1920;
+	c->tiles_rows = (c->height + 1079)/1080;
+	while(c->tiles_cols*c->tiles_rows > max_tiles) {
+		if(c->tiles_rows > 1) --c->tiles_rows;
+		else --c->tiles_cols;
+	}
+}
+
+static int pvt_init_tile(AVFormatContext *s, XShmGrabTile *t) {
+	Display	*d = 0;
+	int	screen = 0;
+
+	t->xdisplay = d = XOpenDisplay(NULL);
+	if(!d)
+		return AVERROR(ENODEV);
+	if(!XShmQueryExtension(d)) {
+		av_log(s, AV_LOG_ERROR, "MIT-SHM extension not supported\n");
+		return AVERROR(ENOTSUP);
+	}
+	screen = DefaultScreen(d);
+	t->image = XShmCreateImage(d, DefaultVisual(d, screen), DefaultDepth(d, screen), ZPixmap, NULL, &t->shminfo, t->width, t->height);
+	if(!t->image)
+		return AVERROR(ENOMEM);
+	t->shminfo.shmid = shmget(IPC_PRIVATE, t->image->bytes_per_line*t->image->height, IPC_CREAT|0600);
+	if(t->shminfo.shmid < 0) {
+		av_log(s, AV_LOG_ERROR, "shmget failed: %s\n", strerror(errno));
+		return AVERROR(errno);
+	}
+	t->shminfo.shmaddr = t->image->data = shmat(t->shminfo.shmid, 0, 0);
+	/* marked for removal now, goes away with the last detach */
+	shmctl(t->shminfo.shmid, IPC_RMID, 0);
+	if(t->shminfo.shmaddr == (char*)-1) {
+		t->shminfo.shmaddr = t->image->data = 0;
+		return AVERROR(ENOMEM);
+	}
+	t->shminfo.readOnly = False;
+	if(!XShmAttach(d, &t->shminfo))
+		return AVERROR(EIO);
+	XSync(d, False);
+	if(is_x_error) {
+		av_log(s, AV_LOG_ERROR, "XShmAttach failed, is the display local?\n");
+		return AVERROR(EIO);
+	}
+	t->attached = 1;
+	return 0;
+}
+
+/* Grabs the tile and copies it into its rectangle of 'dst' */
+static int pvt_grab_tile(XShmGrabCtx *c, XShmGrabTile *t, uint8_t *dst, const int linesize) {
+	int64_t		us = av_gettime_relative();
+	const int	row_bytes = t->width*4;
+
+	if(!XShmGetImage(t->xdisplay, DefaultRootWindow(t->xdisplay), t->image, c->grab_x + t->x, c->grab_y + t->y, AllPlanes))
+		return AVERROR(EIO);
+	dst += t->y*linesize + t->x*4;
+	for(int i = 0; i < t->height; ++i)
+		memcpy(dst + i*linesize, t->image->data + i*t->image->bytes_per_line, row_bytes);
+	us = av_gettime_relative() - us;
+	t->total_us += us;
+	if(us > t->max_us)
+		t->max_us = us;
+	return 0;
+}
+
+static void *pvt_tile_thread(void *arg) {
+	XShmGrabTile	*t = arg;
+	XShmGrabCtx	*c = t->c;
+	uint64_t	gen = 0;
+
+	pthread_mutex_lock(&c->mtx);
+	while(1) {
+		while(!c->quit && c->gen == gen)
+			pthread_cond_wait(&c->cv_start, &c->mtx);
+		if(c->quit)
+			break;
+		gen = c->gen;
+		pthread_mutex_unlock(&c->mtx);
+		t->rv = pvt_grab_tile(c, t, c->dst, c->dst_linesize);
+		pthread_mutex_lock(&c->mtx);
+		if(!--c->pending)
+			pthread_cond_signal(&c->cv_done);
+	}
+	pthread_mutex_unlock(&c->mtx);
+	return 0;
+}
+
+/* Grabs all the tiles into 'dst', tile 0 on this thread */
+static int pvt_grab(AVFormatContext *s, uint8_t *dst, const int linesize) {
+	XShmGrabCtx	*c = s->priv_data;
+	int64_t		us = av_gettime_relative();
+	int		rv = 0;
+
+	pthread_mutex_lock(&c->mtx);
+	c->dst = dst;
+	c->dst_linesize = linesize;
+	c->pending = c->n_tiles - 1;
+	++c->gen;
+	pthread_cond_broadcast(&c->cv_start);
+	pthread_mutex_unlock(&c->mtx);
+	c->tiles[0].rv = pvt_grab_tile(c, &c->tiles[0], dst, linesize);
+	pthread_mutex_lock(&c->mtx);
+	while(c->pending)
+		pthread_cond_wait(&c->cv_done, &c->mtx);
+	pthread_mutex_unlock(&c->mtx);
+	for(int i = 0; i < c->n_tiles; ++i) {
+		if(c->tiles[i].rv < 0) {
+			av_log(s, AV_LOG_ERROR, "XShmGetImage failed on tile %d\n", i);
+			rv = c->tiles[i].rv;
+		}
+	}
+	us = av_gettime_relative() - us;
+	c->total_us += us;
+	if(us > c->max_us)
+		c->max_us = us;
+	++c->n_frames;
+	return rv;
+}
+
+static av_cold int xshmgrab_read_header(AVFormatContext *s) {
+	int		rv = 0;
+	XShmGrabCtx	*c = s->priv_data;
+	XErrorHandler	prev_x_error_handler = 0;
+	Display		*d = 0;
+	AVStream	*st = 0;
+	int		root_w = 0,
+			root_h = 0;
+
+	/* reset data members used for destruction */
+	c->n_tiles = 0;
+	c->tiles = 0;
+	c->sync_init = 0;
+	c->gen = 0;
+	c->pending = 0;
+	c->quit = 0;
+	c->n_frames = 0;
+	c->total_us = 0;
+	c->max_us = 0;
+	c->n_virtual = 0;
+
+	d = XOpenDisplay(NULL);
+	if(!d)
+		return AVERROR(ENODEV);
+	root_w = DisplayWidth(d, DefaultScreen(d));
+	root_h = DisplayHeight(d, DefaultScreen(d));
+	/* 32 bits per pixel TrueColor only, which is
+	 * what any compositing desktop runs with */
+	{
+		Visual	*v = DefaultVisual(d, DefaultScreen(d));
+		if(v->red_mask == 0xff0000 && v->green_mask == 0xff00 && v->blue_mask == 0xff)
+			c->pix_fmt = AV_PIX_FMT_BGR0;
+		else if(v->red_mask == 0xff && v->green_mask == 0xff00 && v->blue_mask == 0xff0000)
+			c->pix_fmt = AV_PIX_FMT_RGB0;
+		else
+			c->pix_fmt = AV_PIX_FMT_NONE;
+	}
+	XCloseDisplay(d);
+	if(c->pix_fmt == AV_PIX_FMT_NONE) {
+		av_log(s, AV_LOG_ERROR, "Unsupported root window visual\n");
+		return AVERROR(ENOTSUP);
+	}
+	if(c->width <= 0) {
+		c->width = root_w - c->grab_x;
+		c->height = root_h - c->grab_y;
+	}
+	if(c->width <= 0 || c->height <= 0 || c->grab_x + c->width > root_w || c->grab_y + c->height > root_h) {
+		av_log(s, AV_LOG_ERROR, "Region %dx%d+%d+%d is outside of the %dx%d root window\n", c->width, c->height, c->grab_x, c->grab_y, root_w, root_h);
+		return AVERROR(EINVAL);
+	}
+	if(c->tiles_cols <= 0)
+		pvt_auto_tiles(c);
+	if(c->tiles_cols > c->width || c->tiles_rows > c->height) {
+		av_log(s, AV_LOG_ERROR, "Too many tiles (%dx%d) for a %dx%d region\n", c->tiles_cols, c->tiles_rows, c->width, c->height);
+		return AVERROR(EINVAL);
+	}
+	/* tiles */
+	c->n_tiles = c->tiles_cols*c->tiles_rows;
+	c->tiles = av_mallocz_array(c->n_tiles, sizeof(XShmGrabTile));
+	if(!c->tiles) {
+		c->n_tiles = 0;
+		return AVERROR(ENOMEM);
+	}
+	prev_x_error_handler = XSetErrorHandler(pvt_x_error_handler);
+	for(int i = 0; i < c->n_tiles; ++i) {
+		XShmGrabTile	*t = &c->tiles[i];
+		const int	col = i%c->tiles_cols,
+				row = i/c->tiles_cols;
+		t->c = c;
+		t->shminfo.shmaddr = 0;
+		t->x = col*c->width/c->tiles_cols;
+		t->y = row*c->height/c->tiles_rows;
+		t->width = (col + 1)*c->width/c->tiles_cols - t->x;
+		t->height = (row + 1)*c->height/c->tiles_rows - t->y;
+		if((rv = pvt_init_tile(s, t)) < 0) {
+			goto err_exit;
+		}
+		if(t->image->bits_per_pixel != 32) {
+			av_log(s, AV_LOG_ERROR, "Unsupported root window depth (%d bits per pixel)\n", t->image->bits_per_pixel);
+			rv = AVERROR(ENOTSUP);
+			goto err_exit;
+		}
+	}
+	XSetErrorHandler(prev_x_error_handler);
+	prev_x_error_handler = 0;
+	/* threads, one less than the tiles */
+	pthread_mutex_init(&c->mtx, 0);
+	pthread_cond_init(&c->cv_start, 0);
+	pthread_cond_init(&c->cv_done, 0);
+	c->sync_init = 1;
+	for(int i = 1; i < c->n_tiles; ++i) {
+		if(pthread_create(&c->tiles[i].thread, 0, pvt_tile_thread, &c->tiles[i])) {
+			rv = AVERROR(EAGAIN);
+			goto err_exit;
+		}
+		c->tiles[i].has_thread = 1;
+	}
+	av_log(s, AV_LOG_INFO, "Capturing root window region %dx%d+%d+%d as %dx%d tiles\n", c->width, c->height, c->grab_x, c->grab_y, c->tiles_cols, c->tiles_rows);
+	/* init public stream info */
+	st = avformat_new_stream(s, NULL);
+	if(!st) {
+		rv = AVERROR(ENOMEM);
+		goto err_exit;
+	}
+	if((rv = av_parse_video_rate(&st->avg_frame_rate, c->framerate)) < 0) {
+		goto err_exit;
+	}
+	/* pts are in us, as xcompgrab */
+	st->time_base = AV_TIME_BASE_Q;
+	st->codecpar->format = c->pix_fmt;
+	st->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+	st->codecpar->codec_id = AV_CODEC_ID_RAWVIDEO;
+	st->codecpar->width = c->width;
+	st->codecpar->height = c->height;
+	st->codecpar->bit_rate = av_rescale(32*c->width*c->height, st->avg_frame_rate.num, st->avg_frame_rate.den);
+	c->time_base = (AVRational){ st->avg_frame_rate.den, st->avg_frame_rate.num };
+	c->frame_duration = av_rescale_q(1, c->time_base, AV_TIME_BASE_Q);
+	c->time_frame = pvt_monotonic_us();
+	return 0;
+
+err_exit:
+	if(is_x_error)
+		is_x_error = 0;
+	if(prev_x_error_handler)
+		XSetErrorHandler(prev_x_error_handler);
+	xshmgrab_read_close(s);
+	return rv;
+}
+
+static int xshmgrab_read_packet(AVFormatContext *s, AVPacket *pkt) {
+	XShmGrabCtx	*c = s->priv_data;
+	int64_t		pts = 0;
+	int		rv = 0;
+
+	pts = pvt_wait_frame(c);
+	if((rv = av_new_packet(pkt, c->width*c->height*4)) < 0)
+		return rv;
+	if((rv = pvt_grab(s, pkt->data, c->width*4)) < 0) {
+		av_packet_unref(pkt);
+		return rv;
+	}
+	pkt->dts = pkt->pts = pts;
+	pkt->duration = c->frame_duration;
+	return 0;
+}
+
+/* Direct capture, as xcompgrab_read_frame: 'frame'
+ * has to be allocated by the caller with the stream
+ * size and format, rows honour frame->linesize.
+ * Sets frame->pts (stream time base).
+ */
+int xshmgrab_read_frame(AVFormatContext *s, AVFrame *frame) {
+	XShmGrabCtx	*c = s->priv_data;
+
+	if(frame->format != c->pix_fmt || frame->width != c->width || frame->height != c->height
+	|| !frame->data[0] || frame->linesize[0] < c->width*4) {
+		av_log(s, AV_LOG_ERROR, "Frame doesn't match capture format (%s %dx%d)\n", av_get_pix_fmt_name(c->pix_fmt), c->width, c->height);
+		return AVERROR(EINVAL);
+	}
+	frame->pts = pvt_wait_frame(c);
+	return pvt_grab(s, frame->data[0], frame->linesize[0]);
+}
+
+static av_cold int xshmgrab_read_close(AVFormatContext *s) {
+	XShmGrabCtx	*c = s->priv_data;
+	int64_t		slowest_us = 0;
+	int		slowest = 0;
+
+	if(c->sync_init) {
+		pthread_mutex_lock(&c->mtx);
+		c->quit = 1;
+		pthread_cond_broadcast(&c->cv_start);
+		pthread_mutex_unlock(&c->mtx);
+	}
+	for(int i = 0; i < c->n_tiles; ++i) {
+		XShmGrabTile	*t = &c->tiles[i];
+		if(t->has_thread)
+			pthread_join(t->thread, 0);
+		if(t->total_us > slowest_us) {
+			slowest_us = t->total_us;
+			slowest = i;
+		}
+		if(t->attached)
+			XShmDetach(t->xdisplay, &t->shminfo);
+		/* XShm images don't own their data */
+		if(t->image)
+			XDestroyImage(t->image);
+		if(t->shminfo.shmaddr)
+			shmdt(t->shminfo.shmaddr);
+		if(t->xdisplay)
+			XCloseDisplay(t->xdisplay);
+	}
+	if(c->n_frames) {
+		av_log(s, AV_LOG_INFO, "Grabbed %"PRId64" frames, avg %"PRId64" us max %"PRId64" us, slowest tile %d avg %"PRId64" us max %"PRId64" us\n",
+			c->n_frames, c->total_us/c->n_frames, c->max_us, slowest, slowest_us/c->n_frames, c->tiles[slowest].max_us);
+	}
+	if(c->sync_init) {
+		pthread_cond_destroy(&c->cv_done);
+		pthread_cond_destroy(&c->cv_start);
+		pthread_mutex_destroy(&c->mtx);
+		c->sync_init = 0;
+	}
+	av_freep(&c->tiles);
+	c->n_tiles = 0;
+	return 0;
+}
+
+AVInputFormat ff_xshmgrab_demuxer = {
+	.name           = "xshmgrab",
+	.long_name      = "Tiled parallel root window capture, using X MIT-SHM",
+	.priv_data_size = sizeof(XShmGrabCtx),
+	.read_header    = xshmgrab_read_header,
+	.read_packet    = xshmgrab_read_packet,
+	.read_close     = xshmgrab_read_close,
+	.flags          = AVFMT_NOFILE,
+	.priv_class     = &xshmgrab_class
+};
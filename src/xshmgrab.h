@@ -0,0 +1,39 @@
+/*
+    This file is part of replayer.
+
+    replayer is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    replayer is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with replayer.  If not, see <https://www.gnu.org/licenses/>.
+ * */
+
+
+#ifndef _XSHMGRAB_H_
+#define _XSHMGRAB_H_
+
+#include <libavformat/avformat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern AVInputFormat ff_xshmgrab_demuxer;
+
+/* Direct capture into a caller allocated frame
+ * of the stream size and format, see xshmgrab.c
+ */
+extern int xshmgrab_read_frame(AVFormatContext *s, AVFrame *frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_XSHMGRAB_H_